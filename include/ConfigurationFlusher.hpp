@@ -0,0 +1,156 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <osal.h>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_FLUSHER_QUEUE_SIZE
+#define CORE_STM32_FLASH_FLUSHER_QUEUE_SIZE 256
+#endif
+
+/*! \brief Write-behind of the user configuration
+ *
+ * post() queues an update and returns at once. A thread applies the queued
+ * updates to the RAM shadow of the ConfigurationStorage (see setShadow()) and
+ * flushes it: the updates posted meanwhile are coalesced in the same commit.
+ * A failed commit is retried, at the same rate.
+ *
+ * The commits are rate limited by a token bucket: up to burst commits in a row,
+ * then one every interval.
+ *
+ * The application creates the thread, at a low priority, running run():
+ *
+ *     chThdCreateStatic(wa, sizeof(wa), LOWPRIO + 1, ConfigurationFlusher::thread, &flusher);
+ *
+ * Once running, the flusher owns the shadow buffer: the application must not
+ * modify it. The other ConfigurationStorage functions (write*(), transactions,
+ * TypedConfigurationStorage) can still be used, the ConfigurationStorage mutex
+ * serializes them with the flusher.
+ */
+class ConfigurationFlusher
+{
+public:
+    struct Statistics {
+        uint32_t posts;
+        uint32_t dropped; //!< Posts not applied: queue full, or outside the shadow
+        uint32_t commits;
+        uint32_t failures; //!< Commits failed, then retried
+    };
+
+public:
+    ConfigurationFlusher(
+        ConfigurationStorage& configuration,
+        systime_t             interval,
+        uint32_t              burst = 1
+    );
+
+    //! Body of the flusher thread, never returns
+    void
+    run();
+
+    //! Thread function running run(), arg is the flusher
+    static void
+    thread(
+        void* arg
+    );
+
+    //! Never waits for the flash, fails if the queue is full
+    bool
+    post(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+    //! Apply and flush the pending updates now, regardless of the rate limit (i.e. before a reset)
+    bool
+    sync();
+
+    /*! \brief Wait until the updates posted so far are committed
+     *
+     * False if a commit fails meanwhile (it will be retried) or on timeout.
+     * One thread at a time.
+     */
+    bool
+    wait(
+        systime_t timeout
+    );
+
+    inline const Statistics&
+    statistics() const;
+
+
+private:
+    struct Update {
+        Address  offset;
+        uint16_t size;
+    };
+
+    ConfigurationStorage& _configuration;
+    systime_t             _interval;
+    uint32_t              _burst;
+    uint32_t              _tokens;
+    systime_t             _refill;  //!< Time of the last token refill
+    thread_reference_t    _thread;  //!< The flusher thread, while waiting for updates
+    bool                  _retry;   //!< The last commit failed
+    bool                  _pending; //!< Updates posted and not committed yet
+    thread_reference_t    _waiter;  //!< The thread in wait()
+    mutex_t               _mutex;
+    Statistics            _statistics;
+
+    uint8_t     _queue[CORE_STM32_FLASH_FLUSHER_QUEUE_SIZE]; //!< Update, then its bytes
+    std::size_t _queueHead; //!< Next byte written
+    std::size_t _queueTail; //!< Next byte read
+    std::size_t _queueUsed;
+
+private:
+    //! Rate limit, if no token is available wait is the time to the next one
+    bool
+    takeToken(
+        systime_t& wait
+    );
+
+    //! Move the queued updates to the shadow
+    void
+    drainM();
+
+    void
+    drain();
+
+    bool
+    flushM();
+
+    void
+    push(
+        const void* data,
+        std::size_t size
+    );
+
+    void
+    pop(
+        void*       data,
+        std::size_t size
+    );
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline const ConfigurationFlusher::Statistics&
+ConfigurationFlusher::statistics() const
+{
+    return _statistics;
+}
+}
+}
@@ -14,11 +14,25 @@ namespace stm32_flash {
 #define CORE_PACKED_ALIGNED  __attribute__((aligned(4), packed))
 #endif
 
+#ifndef CORE_STM32_FLASH_TRANSACTION_SIZE
+#define CORE_STM32_FLASH_TRANSACTION_SIZE 128
+#endif
+
+#ifndef CORE_STM32_FLASH_DIRTY_RANGES
+#define CORE_STM32_FLASH_DIRTY_RANGES 8
+#endif
+
 struct ModuleConfiguration {
     uint32_t imageCRC;
     uint32_t canID;
     char     name[16];
-    uint8_t  padding[32 - sizeof(name) - sizeof(imageCRC) - sizeof(canID)];
+    uint32_t imageLength; //!< Bytes covered by imageCRC, IMAGE_LENGTH_FULL (erased) for the whole program segment
+    uint8_t  programSlot; //!< Slot the image is booted from, PROGRAM_SLOT_B or slot A (any other value, erased too)
+    uint8_t  padding[32 - sizeof(name) - sizeof(imageCRC) - sizeof(canID) - sizeof(imageLength) - sizeof(programSlot)];
+
+    static const uint32_t IMAGE_LENGTH_FULL = 0xFFFFFFFF;
+    static const uint8_t  PROGRAM_SLOT_A    = 0;
+    static const uint8_t  PROGRAM_SLOT_B    = 1;
 }
 
 CORE_PACKED_ALIGNED;
@@ -61,6 +75,25 @@ public:
         uint32_t crc
     );
 
+    //! CRC of the first length bytes of the program segment only
+    bool
+    writeProgramCRC(
+        uint32_t    crc,
+        std::size_t length
+    );
+
+    /*! \brief Boot from another program slot
+     *
+     * The slot and the CRC of its image are written in the same generation:
+     * an interrupted switch leaves the previous slot active.
+     */
+    bool
+    writeProgramSlot(
+        uint8_t     slot,
+        uint32_t    crc,
+        std::size_t length
+    );
+
     bool
     writeCanID(
         uint32_t id
@@ -84,6 +117,13 @@ public:
         uint32_t data
     );
 
+    bool
+    writeUserData(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
     bool
     beginWrite();
 
@@ -102,16 +142,189 @@ public:
     bool
     isValid() const;
 
+    /*! \brief Start staging changes in RAM
+     *
+     * The staged fields and user data are applied by commitTransaction() with a
+     * single format and copy pass, instead of one per write*() call.
+     * The write*() functions must not be used while a transaction is open.
+     */
+    bool
+    beginTransaction();
+
+    bool
+    setModuleName(
+        const char* name
+    );
+
+    bool
+    setProgramCRC(
+        uint32_t    crc,
+        std::size_t length = ModuleConfiguration::IMAGE_LENGTH_FULL
+    );
+
+    bool
+    setProgramSlot(
+        uint8_t slot
+    );
+
+    bool
+    setCanID(
+        uint32_t id
+    );
+
+    //! Fails when the staging buffer (CORE_STM32_FLASH_TRANSACTION_SIZE) is full
+    bool
+    setUserData(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+    //! Room taken in the staging buffer by a setUserData() of size bytes
+    static constexpr std::size_t
+    stagedSize(
+        std::size_t size
+    );
+
+    bool
+    commitTransaction();
+
+    void
+    abortTransaction();
+
+    /*! \brief Keep a RAM copy of the first size bytes of the user data
+     *
+     * The application modifies the shadow and marks the dirty ranges; flush()
+     * then writes a new generation, taking the dirty ranges from RAM and the
+     * rest from the current one. Any other rewrite of the configuration (such as
+     * writeCanID()) flushes the shadow too.
+     * beginWrite()/endWrite() bypass it: endWrite() reloads it.
+     *
+     * The rewrites, the transactions and the shadow functions are serialized by
+     * a mutex, they can be called from several threads (i.e. a ConfigurationFlusher
+     * and the application). Modifying the buffer directly is not: use writeShadow().
+     */
+    void
+    setShadow(
+        void*       buffer,
+        std::size_t size
+    );
+
+    inline void*
+    shadow() const;
+
+    inline std::size_t
+    shadowSize() const;
+
+    inline bool
+    isDirty() const;
+
+    bool
+    markDirty(
+        Address     offset,
+        std::size_t size
+    );
+
+    //! Copy to the shadow and mark dirty
+    bool
+    writeShadow(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+    bool
+    flush();
+
+    //! Discard the changes to the shadow
+    void
+    reloadShadow();
+
 
 private:
+    //! Bytes of user data actually stored in the read bank
+    std::size_t
+    usedUserDataSize() const;
+
+    bool
+    rewrite(
+        const ModuleConfiguration& configuration,
+        bool                       copyUserData
+    );
+
+    //! Write a new generation with the given module configuration, the user data is copied (with the staged changes) if required
+    bool
+    rewriteM(
+        const ModuleConfiguration& configuration,
+        bool                       copyUserData
+    );
+
+    void
+    reloadShadowM();
+
+    bool
+    markDirtyM(
+        Address     offset,
+        std::size_t size
+    );
+
+    //! True if the new generation would be identical to the current one
+    bool
+    isUnchanged(
+        const ModuleConfiguration& configuration,
+        bool                       copyUserData
+    ) const;
+
+    //! Size of the user data with the staged changes and the dirty shadow ranges
+    std::size_t
+    newUserDataSize() const;
+
+    //! A chunk of the user data, with the staged changes and the dirty shadow ranges applied
+    void
+    newUserData(
+        Address     offset,
+        uint8_t*    buffer,
+        std::size_t size
+    ) const;
+
+    struct Patch {
+        Address  offset;
+        uint16_t size;
+    };
+
+    struct Range {
+        Address from;
+        Address to;
+    };
+
     Storage& _storage;
     bool     _ready;
+
+    bool                _transaction;
+    ModuleConfiguration _staged;
+    uint8_t             _patches[CORE_STM32_FLASH_TRANSACTION_SIZE]; //!< Staged user data: Patch, then its bytes
+    std::size_t         _patchesSize;
+
+    uint8_t*    _shadow;
+    std::size_t _shadowSize;
+    Range       _dirty[CORE_STM32_FLASH_DIRTY_RANGES];
+    std::size_t _dirtyCount;
+
+    mutex_t _mutex; //!< Held by the functions suffixed with M
 };
 
 // --------------------------------------------------------------------------------------------------------------------
 // IMPLEMENTATION
 // --------------------------------------------------------------------------------------------------------------------
 
+constexpr std::size_t
+ConfigurationStorage::stagedSize(
+    std::size_t size
+)
+{
+    return sizeof(Patch) + size;
+}
+
 inline bool
 ConfigurationStorage::isUserAddressValid(
     Address address
@@ -144,6 +357,24 @@ ConfigurationStorage::isReady() const
     return _ready;
 }
 
+inline void*
+ConfigurationStorage::shadow() const
+{
+    return _shadow;
+}
+
+inline std::size_t
+ConfigurationStorage::shadowSize() const
+{
+    return _shadowSize;
+}
+
+inline bool
+ConfigurationStorage::isDirty() const
+{
+    return _dirtyCount != 0;
+}
+
 inline bool
 ConfigurationStorage::isValid() const
 {
@@ -18,6 +18,20 @@ using Sector  = std::size_t;
 
 class FlashSegment
 {
+public:
+    struct Statistics {
+        uint32_t erases;        //!< Sectors erased
+        uint32_t erasesSkipped; //!< Sector erases avoided by the blank check
+        uint32_t programs;      //!< Program cycles issued to the flash controller
+        uint32_t bytes;         //!< Bytes requested by the callers
+    };
+
+    /*! \brief Completion callback of the asynchronous operations
+     *
+     * Called from the flash ISR in locked state: only I-class functions can be used.
+     */
+    using Callback = void (*)(FlashSegment& segment, bool success, void* arg);
+
 public:
     FlashSegment(
         uint32_t from,
@@ -31,6 +45,12 @@ public:
         Address address
     ) const;
 
+    bool
+    isRangeValid(
+        Address     address,
+        std::size_t size
+    ) const;
+
 
     //--- LOCK --------------------------------------------------------------------
     bool
@@ -41,6 +61,21 @@ public:
 
 
     //--- ERASE -------------------------------------------------------------------
+    /*! \brief Skip the erase of sectors that already read all 0xFF
+     *
+     * Disabled by default: a sector whose erase was interrupted may read blank
+     * and still need a full erase.
+     */
+    inline void
+    setBlankCheck(
+        bool enabled
+    );
+
+    bool
+    isSectorBlank(
+        Sector sector
+    ) const;
+
     bool
     erase();
 
@@ -112,6 +147,102 @@ public:
         uint16_t data
     );
 
+    /*! \brief Program a block of data
+     *
+     * The range is checked once, then the block is programmed using the widest
+     * program unit of the chip. Unaligned head and tail bytes are padded with 0xFF,
+     * so the program unit they share must still be erased on F0/F3.
+     */
+    bool
+    write(
+        Address     address,
+        const void* data,
+        std::size_t size
+    );
+
+    bool
+    write_offset(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+
+    //--- ASYNCHRONOUS -------------------------------------------------------------
+    /* The flash controller works in background and signals the end of the operation
+     * with its interrupt. Only one operation can be in progress at a time.
+     *
+     * Note that the bus stalls on any flash read while the controller is busy:
+     * only the code running from RAM (or hitting the F4 ART cache) keeps running.
+     */
+
+    //! Erase a sector, suspending the calling thread until the end of the operation
+    bool
+    eraseSectorAsync(
+        Sector sector
+    );
+
+    //! Start the erase of a sector, callback is called at the end of the operation
+    bool
+    eraseSectorAsync(
+        Sector   sector,
+        Callback callback,
+        void*    arg
+    );
+
+    //! Erase the whole segment, suspending the calling thread during each sector erase
+    bool
+    eraseAsync();
+
+    /*! \brief Program a block, suspending the calling thread until the end of the operation
+     *
+     * address and size must be multiple of the program unit (2 bytes on F0/F3, 4 on F4).
+     */
+    bool
+    writeAsync(
+        Address     address,
+        const void* data,
+        std::size_t size
+    );
+
+    /*! \brief Start programming a block, callback is called at the end of the operation
+     *
+     * data must stay valid until then.
+     */
+    bool
+    writeAsync(
+        Address     address,
+        const void* data,
+        std::size_t size,
+        Callback    callback,
+        void*       arg
+    );
+
+    //! As writeAsync(), from a callback or in locked state (I-class)
+    bool
+    writeAsyncI(
+        Address     address,
+        const void* data,
+        std::size_t size,
+        Callback    callback,
+        void*       arg
+    );
+
+    /*! \brief An asynchronous operation started on this segment is in progress
+     *
+     * The controller can still be busy with an operation of another segment.
+     */
+    bool
+    isBusy() const;
+
+
+    //--- STATISTICS --------------------------------------------------------------
+    inline const Statistics&
+    statistics() const;
+
+    void
+    resetStatistics();
+
 
     inline Address
     from() const;
@@ -124,8 +255,30 @@ public:
 
 
 private:
+    friend struct AsyncOperation;
+
+    //! blank is the result of the blank check, done by the caller before entering the critical section (it reads the whole sector)
+    bool
+    startEraseS(
+        Sector   sector,
+        bool     blank,
+        Callback callback,
+        void*    arg
+    );
+
+    bool
+    startWriteS(
+        Address     address,
+        const void* data,
+        std::size_t size,
+        Callback    callback,
+        void*       arg
+    );
+
     const uint32_t _from;
     const uint32_t _to;
+    bool           _blankCheck;
+    Statistics     _statistics;
 };
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -146,6 +299,34 @@ FlashSegment::isAddressValid(
     }
 }
 
+inline
+bool
+FlashSegment::isRangeValid(
+    Address     address,
+    std::size_t size
+) const
+{
+    if ((address < _from) || (address > _to) || (size > (_to - address))) {
+        return false;
+    } else {
+        return true;
+    }
+}
+
+inline void
+FlashSegment::setBlankCheck(
+    bool enabled
+)
+{
+    _blankCheck = enabled;
+}
+
+inline const FlashSegment::Statistics&
+FlashSegment::statistics() const
+{
+    return _statistics;
+}
+
 inline Address
 FlashSegment::from() const
 {
@@ -0,0 +1,183 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <osal.h>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+/*! \brief Append-only storage
+ *
+ * Each bank holds a base image followed by a journal. A write appends a record
+ * with the new bytes to the journal of the current bank, and reads resolve the
+ * latest value of each byte. Only when the journal is full the image is compacted
+ * into the other bank, so an update costs a few program operations instead of an
+ * erase and a full rewrite.
+ *
+ * Unlike Storage, the data cannot be accessed in place: use read().
+ */
+class JournalStorage
+{
+public:
+    struct Statistics {
+        uint32_t appends;
+        uint32_t compactions;
+    };
+
+public:
+    /*! \param size size of the image. It must leave room for the journal in both banks.
+     *
+     * The record offsets and lengths are 16 bit: banks larger than 64 KB are never valid.
+     */
+    JournalStorage(
+        FlashSegment& bank1,
+        FlashSegment& bank2,
+        std::size_t   size
+    );
+
+    bool
+    isValid() const;
+
+    inline std::size_t
+    size() const;
+
+    //! Bytes never written read as 0xFF
+    bool
+    read(
+        Address     offset,
+        void*       data,
+        std::size_t size
+    );
+
+    bool
+    write(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+    //! Rewrite the resolved image in the other bank, with an empty journal
+    bool
+    compact();
+
+    bool
+    erase();
+
+    inline const Statistics&
+    statistics() const;
+
+
+private:
+    FlashSegment& _bank1;
+    FlashSegment& _bank2;
+    std::size_t   _size;
+    uint16_t      _cnt;
+    FlashSegment* _readBank;
+    FlashSegment* _writeBank;
+    Address       _head; //!< Offset of the next record in the read bank
+    mutex_t       _mutex;
+    Statistics    _statistics;
+
+    /* Bank layout
+     *
+     * CNT_OFFSET    uint16_t generation counter, 0xFFFF if the bank is not valid
+     * FORMAT_OFFSET uint16_t FORMAT_JOURNAL
+     * CRC_OFFSET    uint32_t CRC of the image
+     * DATA_OFFSET   image, then the journal
+     *
+     * Journal record: uint32_t offset (16 LSBs) and length (16 MSBs), data padded
+     * to a word with 0xFF, uint32_t CRC of the previous words. The CRC is written
+     * last: a torn record is ignored.
+     */
+    static const std::size_t CNT_OFFSET    = 0;
+    static const std::size_t FORMAT_OFFSET = 2;
+    static const std::size_t CRC_OFFSET    = 4;
+    static const std::size_t DATA_OFFSET   = 4 + 4;
+
+    static const uint16_t    FORMAT_JOURNAL = 0x2FFF;
+    static const std::size_t RECORD_OVERHEAD = 4 + 4;
+    static const std::size_t MAX_BANK_SIZE   = 0x10000;
+
+private:
+    inline Address
+    journalFrom() const;
+
+    static inline std::size_t
+    recordSize(
+        std::size_t length
+    );
+
+    //! Room for the image, and within MAX_BANK_SIZE
+    inline bool
+    isBankUsable(
+        const FlashSegment& bank
+    ) const;
+
+    bool
+    isBankValid(
+        FlashSegment& bank
+    ) const;
+
+    Address
+    findHead(
+        FlashSegment& bank
+    ) const;
+
+    void
+    resolve(
+        Address     offset,
+        uint8_t*    data,
+        std::size_t size
+    ) const;
+
+    bool
+    compactM();
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline std::size_t
+JournalStorage::size() const
+{
+    return _size;
+}
+
+inline const JournalStorage::Statistics&
+JournalStorage::statistics() const
+{
+    return _statistics;
+}
+
+inline Address
+JournalStorage::journalFrom() const
+{
+    return DATA_OFFSET + _size;
+}
+
+inline bool
+JournalStorage::isBankUsable(
+    const FlashSegment& bank
+) const
+{
+    return (bank.size() >= journalFrom()) && (bank.size() <= MAX_BANK_SIZE);
+}
+
+inline std::size_t
+JournalStorage::recordSize(
+    std::size_t length
+)
+{
+    return RECORD_OVERHEAD + ((length + 3) & ~static_cast<std::size_t>(3));
+}
+}
+}
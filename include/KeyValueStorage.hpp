@@ -0,0 +1,174 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/Storage.hpp>
+#include <osal.h>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_KEYS
+#define CORE_STM32_FLASH_KEYS 256
+#endif
+
+/*! \brief Key-value store
+ *
+ * Each value is a record tagged with its key. A generation of the Storage holds
+ * the compacted records, updates are appended after its payload. When there is
+ * no room left, the latest records are compacted into a new generation.
+ *
+ * The record of each key is found through a RAM hash index (open addressing),
+ * built at construction: get() is constant time and returns a pointer into the
+ * flash, valid until the next set(), remove() or compact().
+ */
+class KeyValueStorage
+{
+public:
+    using Key = uint16_t;
+
+    struct Statistics {
+        uint32_t appends;
+        uint32_t compactions;
+    };
+
+    //! The index holds up to CORE_STM32_FLASH_KEYS keys (a power of 2, keep it well above the keys in use)
+    static const std::size_t MAX_KEYS = CORE_STM32_FLASH_KEYS;
+
+    //! Reserved, it marks the erased flash
+    static const Key INVALID_KEY = 0xFFFF;
+
+
+public:
+    KeyValueStorage(
+        Storage& storage
+    );
+
+    //! nullptr if the key is not stored
+    const void*
+    get(
+        Key          key,
+        std::size_t& size
+    ) const;
+
+    bool
+    set(
+        Key         key,
+        const void* data,
+        std::size_t size
+    );
+
+    bool
+    remove(
+        Key key
+    );
+
+    //! Rewrite the latest records in a new generation
+    bool
+    compact();
+
+    inline const Statistics&
+    statistics() const;
+
+
+private:
+    struct Entry {
+        Key     key;
+        Address record; //!< Absolute address of the latest record, 0 if removed
+    };
+
+    Storage&    _storage;
+    Address     _head; //!< Offset of the next appended record, in the current generation
+    Entry       _index[MAX_KEYS];
+    mutex_t     _mutex;
+    Statistics  _statistics;
+
+    /* Record
+     *
+     * uint32_t key (16 LSBs) and length (16 MSBs), a zero length removes the key
+     * data padded to a word with 0xFF
+     * uint32_t CRC of the previous words, written last: a torn record is ignored
+     */
+    static const std::size_t RECORD_OVERHEAD = 4 + 4;
+
+private:
+    static inline std::size_t
+    recordSize(
+        std::size_t length
+    );
+
+    static inline std::size_t
+    hash(
+        Key key
+    );
+
+    //! The entry of key, or the free entry where it goes. nullptr if the index is full
+    Entry*
+    find(
+        Key key
+    );
+
+    const Entry*
+    find(
+        Key key
+    ) const;
+
+    void
+    build();
+
+    //! Index the valid records in [from, to), returns the offset where the scan stopped
+    Address
+    scan(
+        Address from,
+        Address to
+    );
+
+    bool
+    appendM(
+        Key         key,
+        const void* data,
+        std::size_t size
+    );
+
+    bool
+    compactM(
+        Key         key,
+        const void* data,
+        std::size_t size
+    );
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline const KeyValueStorage::Statistics&
+KeyValueStorage::statistics() const
+{
+    return _statistics;
+}
+
+inline std::size_t
+KeyValueStorage::recordSize(
+    std::size_t length
+)
+{
+    return RECORD_OVERHEAD + ((length + 3) & ~static_cast<std::size_t>(3));
+}
+
+inline std::size_t
+KeyValueStorage::hash(
+    Key key
+)
+{
+    // Fibonacci hashing, the calibration keys are often consecutive
+    return (static_cast<uint32_t>(key) * 2654435761u) >> 16;
+}
+}
+}
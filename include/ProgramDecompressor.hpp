@@ -0,0 +1,137 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_LZ_WINDOW
+#define CORE_STM32_FLASH_LZ_WINDOW 1024
+#endif
+
+/*! \brief Program an image from an LZ4 style compressed stream
+ *
+ * The stream is a header (magic "NLZ1", uncompressed length: uint32_t, little
+ * endian) followed by LZ4 sequences, as in an LZ4 block:
+ *
+ *     token, [literal length bytes], literals, offset (uint16_t, little endian), [match length bytes]
+ *
+ * The high nibble of the token is the literal length, the low one the match
+ * length minus 4; 15 means that more length bytes follow, up to the first one
+ * that is not 255. The last sequence has literals only: it ends at the
+ * uncompressed length. Unlike an LZ4 block, the offsets cannot go back more
+ * than CORE_STM32_FLASH_LZ_WINDOW bytes.
+ *
+ * The window is also the write buffer: each half is programmed when full.
+ * The ProgramStorage must be ready (beginWrite()) for the whole stream.
+ * tools/lz.hpp builds the streams on the host.
+ */
+class ProgramDecompressor
+{
+    static_assert((CORE_STM32_FLASH_LZ_WINDOW & (CORE_STM32_FLASH_LZ_WINDOW - 1)) == 0, "The window must be a power of 2");
+    static_assert(((CORE_STM32_FLASH_LZ_WINDOW / 2) % 4) == 0, "Half the window must be multiple of a word");
+
+public:
+    static const uint32_t MAGIC = 0x315A4C4E; //!< "NLZ1"
+
+public:
+    ProgramDecompressor(
+        ProgramStorage& program
+    );
+
+    //! address must be word aligned
+    bool
+    begin(
+        Address address
+    );
+
+    //! Decompress the next chunk of the stream, false if it is not valid
+    bool
+    push(
+        const void* data,
+        std::size_t size
+    );
+
+    //! Program the last bytes, false if the stream is not complete
+    bool
+    finish();
+
+    inline std::size_t
+    written() const;
+
+    inline bool
+    hasFailed() const;
+
+
+private:
+    enum class State {
+        HEADER,
+        TOKEN,
+        LITERAL_LENGTH,
+        LITERALS,
+        OFFSET,
+        MATCH_LENGTH,
+        DONE
+    };
+
+    ProgramStorage& _program;
+    Address         _address;
+    State           _state;
+    bool            _failed;
+    uint32_t        _header[2];
+    std::size_t     _headerSize;
+    uint8_t         _token;
+    std::size_t     _length;      //!< Literal or match length being decoded
+    uint16_t        _offset;
+    std::size_t     _offsetSize;
+    std::size_t     _out;         //!< Bytes decompressed
+    std::size_t     _flushed;     //!< Bytes programmed
+    uint8_t         _window[CORE_STM32_FLASH_LZ_WINDOW];
+
+private:
+    bool
+    parse(
+        uint8_t byte
+    );
+
+    //! Literals, or the end of the stream
+    bool
+    literals();
+
+    bool
+    match();
+
+    bool
+    emit(
+        uint8_t byte
+    );
+
+    bool
+    flush();
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline std::size_t
+ProgramDecompressor::written() const
+{
+    return _out;
+}
+
+inline bool
+ProgramDecompressor::hasFailed() const
+{
+    return _failed;
+}
+}
+}
@@ -0,0 +1,174 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_PATCH_BUFFER_SIZE
+#define CORE_STM32_FLASH_PATCH_BUFFER_SIZE 64
+#endif
+
+/*! \brief Rebuild the program image from the installed one and a binary patch
+ *
+ * The patch is a header followed by a list of operations:
+ *
+ *     header: magic "NLDP", old length, old CRC, new length, new CRC (uint32_t, little endian)
+ *     COPY:   0x00, length, delta  - length bytes of the old image
+ *     DIFF:   0x01, length, delta, length bytes - old image bytes plus the given bytes (modulo 256)
+ *     INSERT: 0x02, length, length bytes
+ *
+ * length and delta are LEB128 varints, delta is zigzag encoded: it moves the
+ * old image position before the operation. COPY and DIFF advance the old image
+ * position by length. The CRCs are the ones of ProgramStorage::updateCRC(length).
+ *
+ * The new image is written in place, one sector after the other: each sector
+ * is built in the scratch segment first, then the program sector is erased and
+ * programmed from it. The scratch must start on a sector boundary and be at
+ * least as large as the largest sector of the program segment. The old image
+ * can be read from the sector being built and from the following ones, never
+ * from the sectors before it: a patch that does fails before the sector is
+ * erased. tools/patch.hpp builds the patches on the host.
+ * An interrupted patch leaves a broken image: the old one is gone.
+ */
+class ProgramPatcher
+{
+    static_assert((CORE_STM32_FLASH_PATCH_BUFFER_SIZE % 4) == 0, "The buffer must be multiple of a word");
+
+public:
+    static const uint32_t MAGIC = 0x50444C4E; //!< "NLDP"
+
+    enum Operation : uint8_t {
+        COPY   = 0x00,
+        DIFF   = 0x01,
+        INSERT = 0x02
+    };
+
+public:
+    ProgramPatcher(
+        ProgramStorage& program,
+        FlashSegment&   scratch
+    );
+
+    bool
+    begin();
+
+    //! Apply the next chunk of the patch, false if the patch is not valid for the installed image
+    bool
+    push(
+        const void* data,
+        std::size_t size
+    );
+
+    //! Program the last bytes and check the new image against the CRC of the header, also closes the write session after a failure
+    bool
+    finish();
+
+    inline std::size_t
+    written() const;
+
+    inline bool
+    hasFailed() const;
+
+
+private:
+    enum class State {
+        HEADER,
+        OPERATION,
+        LENGTH,
+        DELTA,
+        DATA,
+        DONE
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t oldLength;
+        uint32_t oldCRC;
+        uint32_t newLength;
+        uint32_t newCRC;
+    };
+
+    ProgramStorage& _program;
+    FlashSegment&   _scratch;
+    State           _state;
+    bool            _failed;
+    Header          _header;
+    std::size_t     _headerSize;
+    uint8_t         _operation;
+    uint32_t        _varint;
+    unsigned        _shift;
+    std::size_t     _length; //!< Bytes left of the current operation
+    std::size_t     _old;    //!< Old image position
+    std::size_t     _out;    //!< Bytes of the new image produced
+    std::size_t     _flushed; //!< Bytes of the new image in the scratch
+    uint8_t         _buffer[CORE_STM32_FLASH_PATCH_BUFFER_SIZE];
+    Address         _sector;    //!< Sector being built in the scratch
+    Address         _sectorEnd;
+
+private:
+    bool
+    parse(
+        uint8_t byte
+    );
+
+    bool
+    start();
+
+    //! The operation is complete, move to the next one
+    void
+    next();
+
+    bool
+    copy();
+
+    bool
+    emit(
+        uint8_t byte
+    );
+
+    bool
+    readOld(
+        uint8_t& byte
+    );
+
+    //! Move the buffer to the scratch
+    bool
+    flush();
+
+    //! Erase the scratch for the sector at address
+    bool
+    open(
+        Address address
+    );
+
+    //! Erase the program sector and program it from the scratch
+    bool
+    commit();
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline std::size_t
+ProgramPatcher::written() const
+{
+    return _out;
+}
+
+inline bool
+ProgramPatcher::hasFailed() const
+{
+    return _failed;
+}
+}
+}
@@ -0,0 +1,110 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+namespace core {
+namespace stm32_flash {
+/*! \brief Two program slots (see PROGRAM_SLOTS in flash_segments.hpp), one of them is booted
+ *
+ * The application keeps running from the active slot while the new image is
+ * programmed into the inactive one, with any of the ProgramStorage write
+ * sessions; activate() then checks it and switches the slot in the module
+ * configuration, the new image runs after the next reboot.
+ *
+ * The images are not position independent: each one must be linked for the
+ * slot it is programmed into (PROGRAM_JUMP or PROGRAM_B_JUMP).
+ */
+class ProgramSlots
+{
+public:
+    enum Slot : uint8_t {
+        A = ModuleConfiguration::PROGRAM_SLOT_A,
+        B = ModuleConfiguration::PROGRAM_SLOT_B
+    };
+
+public:
+    ProgramSlots(
+        ProgramStorage&       a,
+        ProgramStorage&       b,
+        ConfigurationStorage& configuration
+    );
+
+    Slot
+    active() const;
+
+    inline Slot
+    inactive() const;
+
+    inline ProgramStorage&
+    storage(
+        Slot slot
+    );
+
+    //! The slot to boot
+    inline ProgramStorage&
+    activeStorage();
+
+    //! The slot to program
+    inline ProgramStorage&
+    inactiveStorage();
+
+    /*! \brief Make the inactive slot the active one
+     *
+     * The first length bytes of its image must match crc (see
+     * ProgramStorage::updateCRC()), its write session must be closed.
+     */
+    bool
+    activate(
+        uint32_t    crc,
+        std::size_t length
+    );
+
+    //! The image in the active slot matches the CRC in the module configuration
+    bool
+    isActiveValid();
+
+
+private:
+    ProgramStorage&       _a;
+    ProgramStorage&       _b;
+    ConfigurationStorage& _configuration;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline ProgramSlots::Slot
+ProgramSlots::inactive() const
+{
+    return (active() == A) ? B : A;
+}
+
+inline ProgramStorage&
+ProgramSlots::storage(
+    Slot slot
+)
+{
+    return (slot == B) ? _b : _a;
+}
+
+inline ProgramStorage&
+ProgramSlots::activeStorage()
+{
+    return storage(active());
+}
+
+inline ProgramStorage&
+ProgramSlots::inactiveStorage()
+{
+    return storage(inactive());
+}
+}
+}
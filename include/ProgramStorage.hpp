@@ -7,9 +7,26 @@
 #pragma once
 
 #include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/RunningCRC.hpp>
+#include <osal.h>
 
 namespace core {
 namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_MANIFEST_SECTORS
+#define CORE_STM32_FLASH_MANIFEST_SECTORS 128
+#endif
+
+/*! \brief CRC of each sector of an image
+ *
+ * Sector i is the i-th sector of the program segment, its CRC is computed over
+ * the whole sector (the part not used by the image is erased, 0xFF), as the CRC
+ * unit does.
+ */
+struct ImageManifest {
+    uint32_t sectors;
+    uint32_t crc[CORE_STM32_FLASH_MANIFEST_SECTORS];
+};
+
 class ProgramStorage
 {
 public:
@@ -43,9 +60,104 @@ public:
         uint16_t data
     );
 
+    inline bool
+    write(
+        Address     address,
+        const void* data,
+        std::size_t size
+    );
+
+    //! Start programming a block in background, see FlashSegment::writeAsyncI()
+    inline bool
+    writeAsyncI(
+        Address                address,
+        const void*            data,
+        std::size_t            size,
+        FlashSegment::Callback callback,
+        void*                  arg
+    );
+
     bool
     beginWrite();
 
+    /*! \brief Start a write session without erasing the segment up front
+     *
+     * Each sector is erased when first written (all the sectors below the write
+     * head are erased too), so a short image erases only the sectors it covers.
+     * When the image length is given, the sector after the write head is erased
+     * in background while the caller waits for the next data, up to the sector
+     * holding the end of the image. Zero (the default) disables the erase ahead.
+     *
+     * The erase ahead is started by prepare(), so by write16()/write() and by the
+     * asynchronous writers calling prepare() whenever isPrepared() is false (as
+     * ProgramStreamWriter does). A block given to writeAsyncI() while it runs is
+     * started at the end of the erase.
+     */
+    bool
+    beginLazyWrite(
+        std::size_t length = 0
+    );
+
+    /*! \brief Erase the sectors not erased yet, up to address + size
+     *
+     * Called by the writes, needed before writeAsyncI() in a lazy session.
+     * It must not be called while a writeAsyncI() is in progress.
+     */
+    bool
+    prepare(
+        Address     address,
+        std::size_t size
+    );
+
+    //! True if prepare() has nothing to do: the range is erased, the erase ahead (if any) is started
+    bool
+    isPrepared(
+        Address     address,
+        std::size_t size
+    ) const;
+
+    /*! \brief Start a write session that only updates the sectors that change
+     *
+     * The sectors whose installed CRC matches the manifest of the new image are
+     * neither erased nor programmed: the writes falling in them are dropped. The
+     * other sectors of the manifest are erased; the ones past it are left as they are.
+     * A manifest longer than CORE_STM32_FLASH_MANIFEST_SECTORS is rejected.
+     */
+    bool
+    beginDifferentialWrite(
+        const ImageManifest& manifest
+    );
+
+    //! Sectors left untouched by the differential session
+    inline std::size_t
+    skippedSectors() const;
+
+    /*! \brief Start a write session that can be resumed after an interruption
+     *
+     * The checkpoint segment records the sectors of the image that have been
+     * programmed and verified against the manifest: a session started again with
+     * the same manifest neither erases nor programs them, as a differential
+     * session does, and the sender resumes at resumeAddress(). It needs
+     * 4 + 2 * manifest.sectors bytes, it is erased only when the manifest changes.
+     *
+     * The sectors below the write head are recorded by write16() and write();
+     * after writeAsyncI() the caller records them with checkpoint().
+     * The manifest is not copied: it must stay valid until endWrite().
+     */
+    bool
+    beginResumableWrite(
+        const ImageManifest& manifest,
+        FlashSegment&        checkpoint
+    );
+
+    //! Start of the first sector not recorded yet in the checkpoint
+    Address
+    resumeAddress() const;
+
+    //! Verify the sectors below the write head and record them in the checkpoint, false if the checkpoint cannot be written
+    bool
+    checkpoint();
+
     bool
     endWrite();
 
@@ -55,13 +167,136 @@ public:
     bool
     unlock();
 
+    //! CRC of the whole segment (reads back all of it)
     uint32_t updateCRC();
+
+    //! CRC of the first length bytes only (rounded up to a word): the erased tail is skipped
+    uint32_t
+    updateCRC(
+        std::size_t length
+    );
+    //! After endWrite(), CRC of the image just written: computed while programming, no read back is needed
     uint32_t crc();
 
+    //! After endWrite(), bytes of the image just written (up to the highest address written)
+    inline std::size_t
+    imageLength() const;
+
+    //! Read the image back and check it against crc()
+    bool
+    verify();
+
+    //! Sectors of the segment
+    std::size_t
+    sectors() const;
+
+    uint32_t
+    sectorCRC(
+        std::size_t index
+    );
+
+    //! Manifest of the installed image
+    bool
+    buildManifest(
+        ImageManifest& manifest
+    );
+
 private:
-    FlashSegment& _storage;
-    bool          _ready;
-    uint32_t      _crc;
+    struct Deferred {
+        Address                address;
+        const void*            data;
+        std::size_t            size;
+        FlashSegment::Callback callback; //!< nullptr if none
+        void*                  arg;
+    };
+
+    FlashSegment&      _storage;
+    bool               _ready;
+    uint32_t           _crc;
+    bool               _lazy;
+    Address            _eraseAheadTo; //!< In a lazy session, the erase ahead stops here
+    volatile Address   _erasedTo; //!< In a lazy session, everything below is erased
+    volatile bool      _erasing;  //!< The sector at _erasedTo is being erased in background
+    thread_reference_t _waiter;
+    Deferred           _deferred; //!< Given to writeAsyncI() while erasing, started by erased()
+    RunningCRC         _runningCRC;
+    bool               _runningCRCValid; //!< The image was written sequentially so far
+    std::size_t        _end;
+    bool               _differential;
+    std::size_t        _skipped;
+    uint32_t           _skip[(CORE_STM32_FLASH_MANIFEST_SECTORS + 31) / 32]; //!< Sectors not updated by the differential session
+    const ImageManifest* _manifest; //!< Not owned, valid until endWrite()
+    FlashSegment*      _checkpoint;
+    std::size_t        _checkpointed; //!< Sectors before this are recorded in the checkpoint (or failed the verification)
+
+private:
+    //! Skip the sectors already matching the manifest (and recorded in the checkpoint, if any), erase the others
+    bool
+    beginDifferential(
+        const ImageManifest& manifest,
+        const FlashSegment*  checkpoint
+    );
+
+    inline bool
+    isSkipped(
+        std::size_t index
+    ) const;
+
+    //! Sectors of the manifest that fall in the segment
+    std::size_t
+    manifestSectors(
+        const ImageManifest& manifest
+    ) const;
+
+    //! Verify and record the sectors up to count, only the ones below the write head unless all
+    bool
+    record(
+        bool all
+    );
+
+    //! Bytes of the range falling in sectors skipped by the differential session
+    std::size_t
+    skippedBytes(
+        Address     address,
+        std::size_t size
+    ) const;
+
+    //! Write in a differential session, the parts falling in skipped sectors are dropped
+    bool
+    writeDifferential(
+        Address     address,
+        const void* data,
+        std::size_t size
+    );
+
+    //! The range must be valid
+    void
+    track(
+        Address     address,
+        const void* data,
+        std::size_t size
+    );
+
+    //! Keep a block for the end of the erase ahead, only one
+    bool
+    deferI(
+        Address                address,
+        const void*            data,
+        std::size_t            size,
+        FlashSegment::Callback callback,
+        void*                  arg
+    );
+
+    //! Also starts the deferred block
+    static void
+    erased(
+        FlashSegment& segment,
+        bool          success,
+        void*         arg
+    );
+
+    void
+    waitErase();
 };
 
 // --------------------------------------------------------------------------------------------------------------------
@@ -106,8 +341,67 @@ ProgramStorage::write16(
     uint16_t data
 )
 {
-    if (_ready) {
-        return _storage.write16(address, data);
+    if (_ready && _storage.isRangeValid(address, sizeof(data)) && prepare(address, sizeof(data))) {
+        track(address, &data, sizeof(data));
+
+        bool success = (skippedBytes(address, sizeof(data)) != 0) || _storage.write16(address, data);
+
+        return success && ((_checkpoint == nullptr) || checkpoint());
+    } else {
+        return false;
+    }
+}
+
+bool
+ProgramStorage::write(
+    Address     address,
+    const void* data,
+    std::size_t size
+)
+{
+    if (_ready && _storage.isRangeValid(address, size) && prepare(address, size)) {
+        track(address, data, size);
+
+        bool success = _differential ? writeDifferential(address, data, size) : _storage.write(address, data, size);
+
+        return success && ((_checkpoint == nullptr) || checkpoint());
+    } else {
+        return false;
+    }
+}
+
+bool
+ProgramStorage::writeAsyncI(
+    Address                address,
+    const void*            data,
+    std::size_t            size,
+    FlashSegment::Callback callback,
+    void*                  arg
+)
+{
+    // No erase from here: the range must be prepared
+    if (_ready && (!_lazy || ((address + size) <= _erasedTo)) && _storage.isRangeValid(address, size)) {
+        std::size_t skipped = skippedBytes(address, size);
+
+        if (skipped == size) {
+            track(address, data, size);
+            callback(_storage, true, arg);
+            return true;
+        }
+
+        if (skipped != 0) {
+            // Partly in a skipped sector: the blocks must not cross sector boundaries
+            return false;
+        }
+
+        track(address, data, size);
+
+        if (_erasing) {
+            // The erase ahead holds the controller
+            return deferI(address, data, size, callback, arg);
+        }
+
+        return _storage.writeAsyncI(address, data, size, callback, arg);
     } else {
         return false;
     }
@@ -117,5 +411,25 @@ inline uint32_t
 ProgramStorage::crc() {
     return _crc;
 }
+
+inline std::size_t
+ProgramStorage::skippedSectors() const
+{
+    return _skipped;
+}
+
+inline bool
+ProgramStorage::isSkipped(
+    std::size_t index
+) const
+{
+    return (index < CORE_STM32_FLASH_MANIFEST_SECTORS) && ((_skip[index / 32] & (1u << (index % 32))) != 0);
+}
+
+inline std::size_t
+ProgramStorage::imageLength() const
+{
+    return _end;
+}
 }
 }
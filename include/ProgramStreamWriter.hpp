@@ -0,0 +1,140 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ProgramStorage.hpp>
+#include <osal.h>
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+#ifndef CORE_STM32_FLASH_STREAM_BUFFERS
+#define CORE_STM32_FLASH_STREAM_BUFFERS 2
+#endif
+
+#ifndef CORE_STM32_FLASH_STREAM_BUFFER_SIZE
+#define CORE_STM32_FLASH_STREAM_BUFFER_SIZE 256
+#endif
+
+/*! \brief Sequential programming of an image, overlapped with its reception
+ *
+ * push() copies the received bytes into a ring of buffers: each full buffer is
+ * programmed in background by the flash interrupt, while the next one is filled.
+ * When all the buffers are waiting to be programmed push() accepts less bytes
+ * than given (back-pressure): the caller retries later. A buffer crossing a
+ * sector boundary is programmed in two blocks, one per sector, as a
+ * differential session needs.
+ *
+ * In a lazy session each buffer is prepared before being queued: when it
+ * reaches a sector not erased yet, or the erase ahead of the next one is due,
+ * push() waits for the buffers in progress, then erases it or starts the erase
+ * ahead (see ProgramStorage::beginLazyWrite()).
+ *
+ * The ProgramStorage must be ready (beginWrite()) for the whole stream.
+ */
+class ProgramStreamWriter
+{
+    static_assert((CORE_STM32_FLASH_STREAM_BUFFER_SIZE % 4) == 0, "The buffers must be multiple of a word");
+
+public:
+    ProgramStreamWriter(
+        ProgramStorage& program
+    );
+
+    //! address must be word aligned
+    bool
+    begin(
+        Address address
+    );
+
+    //! Returns the bytes accepted, it waits for the flash only to erase a sector (lazy session)
+    std::size_t
+    push(
+        const void* data,
+        std::size_t size
+    );
+
+    //! Bytes that push() would accept now
+    std::size_t
+    available() const;
+
+    //! Program the last bytes (padded to a word with 0xFF) and wait for the end of the stream
+    bool
+    finish();
+
+    inline std::size_t
+    received() const;
+
+    inline std::size_t
+    programmed() const;
+
+    inline bool
+    hasFailed() const;
+
+
+private:
+    ProgramStorage&      _program;
+    Address              _address; //!< Where the oldest full buffer goes
+    Address              _next;    //!< Where the buffer being filled goes
+    uint8_t              _buffers[CORE_STM32_FLASH_STREAM_BUFFERS][CORE_STM32_FLASH_STREAM_BUFFER_SIZE];
+    std::size_t          _sizes[CORE_STM32_FLASH_STREAM_BUFFERS];
+    std::size_t          _oldest; //!< Buffer being programmed, or the next one
+    std::size_t          _sent;   //!< Bytes of the oldest buffer already programmed
+    std::size_t          _block;  //!< Bytes being programmed
+    std::size_t          _full;   //!< Buffers waiting to be programmed, including the one in progress
+    std::size_t          _filled; //!< Bytes in the buffer being filled
+    volatile bool        _busy;
+    volatile bool        _failed;
+    std::size_t          _received;
+    volatile std::size_t _programmed;
+    thread_reference_t   _waiter;
+
+private:
+    static void
+    done(
+        FlashSegment& segment,
+        bool          success,
+        void*         arg
+    );
+
+    //! Erase the sectors of the buffer being filled, if needed (lazy session)
+    bool
+    prepare();
+
+    //! Queue the buffer being filled
+    void
+    submitS();
+
+    void
+    startI();
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline std::size_t
+ProgramStreamWriter::received() const
+{
+    return _received;
+}
+
+inline std::size_t
+ProgramStreamWriter::programmed() const
+{
+    return _programmed;
+}
+
+inline bool
+ProgramStreamWriter::hasFailed() const
+{
+    return _failed;
+}
+}
+}
@@ -0,0 +1,87 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace core {
+namespace stm32_flash {
+/*! \brief Software CRC32, computed as data is written
+ *
+ * Gives the same result as the CRC unit run over the same memory: polynomial
+ * 0x04C11DB7, initial value 0xFFFFFFFF, little endian 32 bit words, no reflection.
+ * Unlike the F4 CRC unit, it can be suspended and resumed at any point.
+ */
+class RunningCRC
+{
+public:
+    RunningCRC();
+
+    void
+    reset();
+
+    void
+    update(
+        const void* data,
+        std::size_t size
+    );
+
+    //! Feed size erased (0xFF) bytes
+    void
+    updateErased(
+        std::size_t size
+    );
+
+    //! CRC of the bytes fed so far, a trailing partial word is padded with 0xFF
+    uint32_t
+    value() const;
+
+    inline std::size_t
+    size() const;
+
+
+private:
+    uint32_t    _crc;
+    uint32_t    _word;
+    std::size_t _size;
+
+    static const uint32_t TABLE[256];
+
+    static inline uint32_t
+    updateWord(
+        uint32_t crc,
+        uint32_t word
+    );
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+inline std::size_t
+RunningCRC::size() const
+{
+    return _size;
+}
+
+inline uint32_t
+RunningCRC::updateWord(
+    uint32_t crc,
+    uint32_t word
+)
+{
+    crc ^= word;
+    crc  = (crc << 8) ^ TABLE[crc >> 24];
+    crc  = (crc << 8) ^ TABLE[crc >> 24];
+    crc  = (crc << 8) ^ TABLE[crc >> 24];
+    crc  = (crc << 8) ^ TABLE[crc >> 24];
+
+    return crc;
+}
+}
+}
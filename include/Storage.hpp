@@ -7,6 +7,8 @@
 #pragma once
 
 #include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/RunningCRC.hpp>
+#include <osal.h>
 
 #include <cstddef>
 #include <stdint.h>
@@ -16,9 +18,44 @@ namespace stm32_flash {
 class Storage
 {
 public:
+    /*! \brief Longest critical section (interrupts disabled) of each operation
+     *
+     * In realtime counter ticks, zero if the port has no realtime counter.
+     */
+    struct Statistics {
+        uint32_t erase;
+        uint32_t format;
+        uint32_t commit;
+        uint32_t skipped; //!< Updates not written, as identical to the current generation
+    };
+
+public:
+    /*! \param slotSize when smaller than the banks, each bank holds several generations,
+     *                  one per slot: a bank is erased only when it has no free slot left.
+     *                  Zero (the default) means one generation per bank.
+     *                  A generation written with one per bank stays readable (up to size()),
+     *                  its bank is erased when the next generation needs it.
+     */
     Storage(
         FlashSegment& bank1,
-        FlashSegment& bank2
+        FlashSegment& bank2,
+        std::size_t   slotSize = 0
+    );
+
+    /*! \brief Ring of up to MAX_BANKS banks
+     *
+     * Generations are written in turn in all the banks, spreading the erases.
+     */
+    Storage(
+        FlashSegment* banks,
+        std::size_t   count,
+        std::size_t   slotSize = 0
+    );
+
+    template <std::size_t N>
+    Storage(
+        FlashSegment (&banks)[N],
+        std::size_t slotSize = 0
     );
 
     bool
@@ -54,34 +91,156 @@ public:
         uint32_t data
     );
 
+    inline bool
+    write(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
     inline std::size_t
     size() const;
 
+    //! Bytes used by the payload of the read bank (the whole size() for banks in the legacy format)
+    std::size_t
+    usedSize() const;
+
+    /*! \brief Program data in the current generation, after its payload (see usedSize())
+     *
+     * The appended bytes are not covered by the generation CRC, the caller has to
+     * validate them. They are dropped by the next generation.
+     */
+    bool
+    append(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    );
+
+    //! True if the current generation holds exactly data at offset
+    bool
+    matches(
+        Address     offset,
+        const void* data,
+        std::size_t size
+    ) const;
+
+    //! Account an update that was not written, see matches()
+    inline void
+    countSkipped();
+
     bool
     lock();
 
     bool
     unlock();
 
+    inline const Statistics&
+    statistics() const;
+
+    void
+    resetStatistics();
+
+    /*! \brief Serial number comparison of the generation counters
+     *
+     * The counters run from 0 to 0xFFFE and wrap, a is newer than b if it is less
+     * than half the sequence space ahead.
+     */
+    static inline bool
+    isNewer(
+        uint16_t a,
+        uint16_t b
+    );
+
+
+    static const std::size_t MAX_BANKS = 16;
+
 
 private:
-    FlashSegment& _bank1;
-    FlashSegment& _bank2;
+    FlashSegment* _banks[MAX_BANKS];
+    std::size_t   _bankCount;
     uint16_t      _cnt;
     FlashSegment* _readBank;
     FlashSegment* _writeBank;
-    uint32_t      _head;
+    Address       _readSlot;  //!< Offset of the current slot in _readBank
+    Address       _writeSlot; //!< Offset of the slot being written in _writeBank
     bool          _writeReady;
     std::size_t   _bankSize;
+    std::size_t   _slotSize; //!< Zero if the slot is the whole bank
+    FlashSegment* _wholeBank; //!< With slots, a bank still holding a generation in the whole bank
+    mutex_t       _mutex;
+    Statistics    _statistics;
+    RunningCRC    _runningCRC;
+    bool          _runningCRCValid;
+    std::size_t   _used;
+
+    /* Slot header
+     *
+     * CNT_OFFSET    uint16_t generation counter, 0xFFFF if the bank is not valid
+     * FORMAT_OFFSET uint16_t format version (4 MSBs) and payload length (12 LSBs, in LENGTH_UNIT bytes).
+     *                        Legacy banks left it erased (version 0xF): their payload is the whole bank.
+     * CRC_OFFSET    uint32_t CRC of the payload
+     */
+    static const std::size_t CNT_OFFSET    = 0;
+    static const std::size_t FORMAT_OFFSET = 2;
+    static const std::size_t CRC_OFFSET    = 4;
+    static const std::size_t DATA_OFFSET   = 4 + 4;
 
-    static const std::size_t CNT_OFFSET  = 0;
-    static const std::size_t CRC_OFFSET  = 4;
-    static const std::size_t DATA_OFFSET = 4 + 4;
+    static const uint16_t    FORMAT_VERSION = 1;
+    static const uint16_t    FORMAT_LENGTH_FULL = 0x0FFF;
+    static const std::size_t LENGTH_UNIT = 16;
 
 private:
+    void
+    init(
+        std::size_t slotSize
+    );
+
+    FlashSegment*
+    nextBank(
+        const FlashSegment* bank
+    ) const;
+
+    inline std::size_t
+    getSlotSize(
+        const FlashSegment& bank
+    ) const;
+
+    //! The range is within size()
+    inline bool
+    isRangeValid(
+        Address     offset,
+        std::size_t size
+    ) const;
+
     uint32_t
-    getBankCRC(
-        FlashSegment& bank
+    getSlotCRC(
+        FlashSegment& bank,
+        Address       slot
+    );
+
+    std::size_t
+    getPayloadSize(
+        const FlashSegment& bank,
+        Address             slot
+    ) const;
+
+    bool
+    isSlotBlank(
+        const FlashSegment& bank,
+        Address             slot
+    ) const;
+
+    /*! \brief Track the used size and feed the running CRC with the data being written
+     *
+     * Writes must come in increasing offset order, gaps are accounted as erased.
+     * Otherwise the running CRC is dropped and commit() reads back the payload.
+     */
+    void
+    trackWrite(
+        Address     offset,
+        const void* data,
+        std::size_t size
     );
 };
 
@@ -89,6 +248,23 @@ private:
 // IMPLEMENTATION
 // --------------------------------------------------------------------------------------------------------------------
 
+template <std::size_t N>
+Storage::Storage(
+    FlashSegment (&banks)[N],
+    std::size_t slotSize
+) : Storage(banks, N, slotSize) {}
+
+bool
+Storage::isNewer(
+    uint16_t a,
+    uint16_t b
+)
+{
+    uint32_t distance = (static_cast<uint32_t>(a) + 0xFFFF - b) % 0xFFFF;
+
+    return (distance != 0) && (distance < 0x8000);
+}
+
 Storage::operator void*() const
 {
     return reinterpret_cast<void*>(getAddress());
@@ -97,7 +273,7 @@ Storage::operator void*() const
 Address
 Storage::getAddress() const
 {
-    return _readBank->from() + DATA_OFFSET;
+    return _readBank->from() + _readSlot + DATA_OFFSET;
 }
 
 bool
@@ -106,7 +282,12 @@ Storage::write16(
     uint16_t data
 )
 {
-    return _writeBank->write16_offset(offset + DATA_OFFSET, data);
+    if (!isRangeValid(offset, sizeof(data))) {
+        return false;
+    }
+
+    trackWrite(offset, &data, sizeof(data));
+    return _writeBank->write16_offset(_writeSlot + offset + DATA_OFFSET, data);
 }
 
 bool
@@ -115,13 +296,62 @@ Storage::write32(
     uint32_t data
 )
 {
-    return _writeBank->write32_offset(offset + DATA_OFFSET, data);
+    if (!isRangeValid(offset, sizeof(data))) {
+        return false;
+    }
+
+    trackWrite(offset, &data, sizeof(data));
+    return _writeBank->write32_offset(_writeSlot + offset + DATA_OFFSET, data);
+}
+
+bool
+Storage::write(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    if (!isRangeValid(offset, size)) {
+        return false;
+    }
+
+    trackWrite(offset, data, size);
+    return _writeBank->write_offset(_writeSlot + offset + DATA_OFFSET, data, size);
 }
 
 std::size_t
 Storage::size() const
 {
-    return _bankSize - DATA_OFFSET;
+    return (_slotSize != 0 ? _slotSize : _bankSize) - DATA_OFFSET;
+}
+
+std::size_t
+Storage::getSlotSize(
+    const FlashSegment& bank
+) const
+{
+    return ((_slotSize != 0) && (&bank != _wholeBank)) ? _slotSize : bank.size();
+}
+
+bool
+Storage::isRangeValid(
+    Address     offset,
+    std::size_t size
+) const
+{
+    return (offset <= this->size()) && (size <= (this->size() - offset));
+}
+
+void
+Storage::countSkipped()
+{
+    _statistics.skipped++;
+}
+
+const Storage::Statistics&
+Storage::statistics() const
+{
+    return _statistics;
 }
 }
 }
@@ -0,0 +1,166 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+//! Offset and type of a member of the user configuration, the template arguments of TypedConfigurationStorage::write()
+#define CORE_STM32_FLASH_MEMBER(type, member) offsetof(type, member), decltype(type::member)
+
+namespace core {
+namespace stm32_flash {
+/*! \brief User configuration accessed as a struct
+ *
+ * get() returns a reference straight into the flash. Members are written by
+ * offset, computed at compile time:
+ *
+ *     typed.write<CORE_STM32_FLASH_MEMBER(UserConfig, gain)>(gain);
+ *
+ * Each write is a single new generation, see ConfigurationStorage::beginTransaction().
+ */
+template <typename T>
+class TypedConfigurationStorage
+{
+    static_assert(std::is_trivially_copyable<T>::value, "The user configuration must be trivially copyable");
+    static_assert(alignof(T) <= sizeof(uint32_t), "The user configuration is only word aligned in flash");
+
+public:
+    //! \param defaults returned by get() while the flash holds no configuration, copied
+    TypedConfigurationStorage(
+        ConfigurationStorage& configuration,
+        const T&              defaults
+    );
+
+    //! The user data area is known at run time only, it depends on the banks
+    inline bool
+    fits() const;
+
+    inline const T&
+    get() const;
+
+    //! Replace the whole user data
+    bool
+    write(
+        const T& value
+    );
+
+    //! The member of type M at OFFSET (see CORE_STM32_FLASH_MEMBER)
+    template <std::size_t OFFSET, typename M>
+    bool
+    write(
+        const M& value
+    );
+
+
+private:
+    ConfigurationStorage& _configuration;
+    const T               _defaults;
+};
+
+// --------------------------------------------------------------------------------------------------------------------
+// IMPLEMENTATION
+// --------------------------------------------------------------------------------------------------------------------
+
+template <typename T>
+TypedConfigurationStorage<T>::TypedConfigurationStorage(
+    ConfigurationStorage& configuration,
+    const T&              defaults
+) : _configuration(configuration), _defaults(defaults) {}
+
+template <typename T>
+inline bool
+TypedConfigurationStorage<T>::fits() const
+{
+    return sizeof(T) <= _configuration.userDataSize();
+}
+
+template <typename T>
+inline const T&
+TypedConfigurationStorage<T>::get() const
+{
+    const void* user = _configuration.getUserConfiguration();
+
+    if ((user == nullptr) || !fits()) {
+        return _defaults;
+    }
+
+    return *reinterpret_cast<const T*>(user);
+}
+
+template <typename T>
+bool
+TypedConfigurationStorage<T>::write(
+    const T& value
+)
+{
+    if (!fits()) {
+        return false;
+    }
+
+    if (std::memcmp(&get(), &value, sizeof(T)) == 0) {
+        return true;
+    }
+
+    bool success = true;
+
+    success &= _configuration.beginWrite();
+
+    if (success) {
+        success &= _configuration.writeUserData(0, &value, sizeof(T));
+    }
+
+    success &= _configuration.endWrite();
+
+    return success;
+}
+
+template <typename T>
+template <std::size_t OFFSET, typename M>
+bool
+TypedConfigurationStorage<T>::write(
+    const M& value
+)
+{
+    static_assert(std::is_trivially_copyable<M>::value, "The member must be trivially copyable");
+    static_assert((OFFSET <= sizeof(T)) && (sizeof(M) <= (sizeof(T) - OFFSET)), "The member is outside the user configuration");
+    static_assert(ConfigurationStorage::stagedSize(sizeof(M)) <= CORE_STM32_FLASH_TRANSACTION_SIZE, "The member does not fit in a transaction, write the whole configuration");
+
+    if (!fits()) {
+        return false;
+    }
+
+    if (_configuration.getUserConfiguration() == nullptr) {
+        // Nothing stored yet, start from the defaults
+        T configuration = _defaults;
+
+        std::memcpy(reinterpret_cast<uint8_t*>(&configuration) + OFFSET, &value, sizeof(M));
+
+        return write(configuration);
+    }
+
+    bool success = true;
+
+    success &= _configuration.beginTransaction();
+
+    if (success) {
+        success &= _configuration.setUserData(OFFSET, &value, sizeof(M));
+
+        if (success) {
+            success &= _configuration.commitTransaction();
+        } else {
+            _configuration.abortTransaction();
+        }
+    }
+
+    return success;
+} // write
+}
+}
@@ -7,16 +7,23 @@
 #ifndef FLASH_SEGMENTS_HPP_
 #define FLASH_SEGMENTS_HPP_
 
-#ifdef CORE_IS_BOOTLOADER
+#if defined(CORE_IS_BOOTLOADER) || (PROGRAM_SLOTS > 1)
 extern const uint32_t user_address_bottom[];
 extern const uint32_t user_address_top[];
-#else
+#endif
+
+#ifndef CORE_IS_BOOTLOADER
 #if BOOTLOADER_SIZE > 0
 extern const uint32_t bootloader_address_bottom[];
 extern const uint32_t bootloader_address_top[];
 #endif
 #endif
 
+#if PROGRAM_SLOTS > 1
+extern const uint32_t user_b_address_bottom[];
+extern const uint32_t user_b_address_top[];
+#endif
+
 #if TAGS_SIZE > 0
 extern const uint32_t tags_address_bottom[];
 extern const uint32_t tags_address_top[];
@@ -31,33 +38,43 @@ namespace core {
 namespace stm32_flash {
 #include <stdint.h>
 
-#ifdef CORE_IS_BOOTLOADER
-static const uint32_t PROGRAM_FLASH_FROM = reinterpret_cast<uint32_t>(user_address_bottom);
-static const uint32_t PROGRAM_FLASH_TO   = reinterpret_cast<uint32_t>(user_address_top);
+// With PROGRAM_SLOTS > 1 the application sees the program slots too: it programs the inactive one
+#if defined(CORE_IS_BOOTLOADER) || (PROGRAM_SLOTS > 1)
+static const uint32_t PROGRAM_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_address_bottom));
+static const uint32_t PROGRAM_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_address_top));
 static const uint32_t PROGRAM_FLASH_SIZE = PROGRAM_FLASH_TO - PROGRAM_FLASH_FROM;
-static const uint32_t PROGRAM_JUMP       = reinterpret_cast<uint32_t>(user_address_bottom);
-#else
+static const uint32_t PROGRAM_JUMP       = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_address_bottom));
+#endif
+
+#ifndef CORE_IS_BOOTLOADER
 #if BOOTLOADER_SIZE > 0
-static const uint32_t BOOTLOADER_FLASH_FROM = reinterpret_cast<uint32_t>(bootloader_address_bottom);
-static const uint32_t BOOTLOADER_FLASH_TO   = reinterpret_cast<uint32_t>(bootloader_address_top);
+static const uint32_t BOOTLOADER_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(bootloader_address_bottom));
+static const uint32_t BOOTLOADER_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(bootloader_address_top));
 static const uint32_t BOOTLOADER_FLASH_SIZE = BOOTLOADER_FLASH_TO - BOOTLOADER_FLASH_FROM;
 #endif
 #endif
 
+#if PROGRAM_SLOTS > 1
+static const uint32_t PROGRAM_B_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_b_address_bottom));
+static const uint32_t PROGRAM_B_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_b_address_top));
+static const uint32_t PROGRAM_B_FLASH_SIZE = PROGRAM_B_FLASH_TO - PROGRAM_B_FLASH_FROM;
+static const uint32_t PROGRAM_B_JUMP       = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(user_b_address_bottom));
+#endif
+
 #if TAGS_SIZE > 0
-static const uint32_t TAGS_FLASH_FROM = reinterpret_cast<uint32_t>(tags_address_bottom);
-static const uint32_t TAGS_FLASH_TO   = reinterpret_cast<uint32_t>(tags_address_top);
+static const uint32_t TAGS_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(tags_address_bottom));
+static const uint32_t TAGS_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(tags_address_top));
 static const uint32_t TAGS_FLASH_SIZE = TAGS_FLASH_TO - TAGS_FLASH_FROM;
 #else
 static const uint32_t TAGS_FLASH_SIZE = 0;
 #endif
 
-static const uint32_t CONFIGURATION1_FLASH_FROM = reinterpret_cast<uint32_t>(conf1_address_bottom);
-static const uint32_t CONFIGURATION1_FLASH_TO   = reinterpret_cast<uint32_t>(conf1_address_top);
+static const uint32_t CONFIGURATION1_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(conf1_address_bottom));
+static const uint32_t CONFIGURATION1_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(conf1_address_top));
 static const uint32_t CONFIGURATION1_FLASH_SIZE = CONFIGURATION1_FLASH_TO - CONFIGURATION1_FLASH_FROM;
 
-static const uint32_t CONFIGURATION2_FLASH_FROM = reinterpret_cast<uint32_t>(conf2_address_bottom);
-static const uint32_t CONFIGURATION2_FLASH_TO   = reinterpret_cast<uint32_t>(conf2_address_top);
+static const uint32_t CONFIGURATION2_FLASH_FROM = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(conf2_address_bottom));
+static const uint32_t CONFIGURATION2_FLASH_TO   = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(conf2_address_top));
 static const uint32_t CONFIGURATION2_FLASH_SIZE = CONFIGURATION2_FLASH_TO - CONFIGURATION2_FLASH_FROM;
 }
 }
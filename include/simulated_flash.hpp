@@ -0,0 +1,183 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * RAM simulated flash, used instead of the StdPeriph driver when the library is
+ * built with CORE_STM32_FLASH_SIMULATED (together with the usual chip defines).
+ *
+ * The simulated memory is mapped at the real flash address (0x08000000), so the
+ * segments, the linker symbols (see flash_segments.hpp) and the direct reads work
+ * unchanged. This requires a host executable that is not position independent
+ * (-no-pie), with the segment symbols placed by --defsym: see the host build in
+ * CMakeLists.txt, and test/host for the OSAL and CRC stand-ins.
+ *
+ * NOR rules are enforced: erase sets a whole sector to 0xFF, programming can only
+ * clear bits, and on F0/F3 programming a half-word that is not blank fails with
+ * FLASH_ERROR_PROGRAM, like the real controller.
+ * Erase and program times are accumulated, so the cost of an operation can be
+ * measured without the hardware.
+ *
+ * The asynchronous operations are done when started, their interrupt runs at once
+ * unless it is held (see holdInterrupt()).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+#if defined(STM32F303xx)
+    #include <core/stm32_flash/stm32f30x.hpp>
+#elif defined(STM32F091xC)
+    #include <core/stm32_flash/stm32f0xx.hpp>
+#elif defined(STM32F407xx) || defined(STM32F417xx)
+    #include <core/stm32_flash/stm32f4xx.hpp>
+#else
+    #error "Chip not supported"
+#endif
+
+typedef enum {
+    FLASH_BUSY = 1,
+    FLASH_ERROR_WRP,
+    FLASH_ERROR_PROGRAM,
+    FLASH_ERROR_PGA,
+    FLASH_ERROR_OPERATION,
+    FLASH_COMPLETE,
+    FLASH_TIMEOUT
+} FLASH_Status;
+
+void
+FLASH_Unlock(
+    void
+);
+
+void
+FLASH_Lock(
+    void
+);
+
+FLASH_Status
+FLASH_ErasePage(
+    uint32_t Page_Address
+);
+
+FLASH_Status
+FLASH_ProgramWord(
+    uint32_t Address,
+    uint32_t Data
+);
+
+FLASH_Status
+FLASH_ProgramHalfWord(
+    uint32_t Address,
+    uint16_t Data
+);
+
+FLASH_Status
+FLASH_GetStatus(
+    void
+);
+
+namespace core {
+namespace stm32_flash {
+namespace simulated {
+struct Statistics {
+    uint32_t erases;   //!< Sectors erased
+    uint32_t programs; //!< Program cycles
+    uint32_t errors;   //!< Operations rejected by the NOR rules
+    uint64_t time;     //!< Accumulated flash busy time [us]
+};
+
+static const uint32_t FLASH_BASE_ADDRESS = 0x08000000;
+
+static constexpr uint32_t
+FLASH_TOTAL_SIZE()
+{
+    return FLASH_SECTOR_OFFSET(FLASH_NUMBER_OF_PAGES - 1) + FLASH_SECTOR_SIZE(FLASH_NUMBER_OF_PAGES - 1);
+}
+
+/*! \brief Time to program one FLASH_PROGRAM_UNIT [us]
+ *
+ * F0/F3: tPROG, 16 bit, typical (53.5 us).
+ * F4: tPROG, x32 parallelism, typical.
+ */
+static constexpr uint32_t
+FLASH_PROGRAM_TIME()
+{
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    return 54;
+#else
+    return 16;
+#endif
+}
+
+/*! \brief Time to erase a sector [us]
+ *
+ * F0/F3: tERASE, worst case (the datasheets give no typical value).
+ * F4: tERASE, x32 parallelism, typical (16 KB: 400 ms, 64 KB: 1.1 s, 128 KB: 2 s).
+ */
+static constexpr uint32_t
+FLASH_ERASE_TIME(
+    std::size_t sector
+)
+{
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    return sector < FLASH_NUMBER_OF_PAGES ? 40000 : 0;
+
+#else
+    return FLASH_SECTOR_SIZE(sector) == 0x4000 ? 400000 :
+           FLASH_SECTOR_SIZE(sector) == 0x10000 ? 1100000 :
+           FLASH_SECTOR_SIZE(sector) == 0x20000 ? 2000000 :
+           0;
+#endif
+}
+
+/*! \brief Map the simulated flash, fully erased
+ *
+ * Called implicitly by the first flash operation.
+ */
+bool
+init();
+
+/*! \brief Bring the whole flash back to the factory state (all 0xFF) and clear the statistics
+ */
+void
+reset();
+
+const Statistics&
+statistics();
+
+void
+resetStatistics();
+
+uint32_t
+sectorErases(
+    std::size_t sector
+);
+
+/*! \brief Keep the asynchronous operations in progress until serveInterrupt()
+ *
+ * Meanwhile FLASH_GetStatus() returns FLASH_BUSY. The blocking asynchronous
+ * functions (such as FlashSegment::eraseSectorAsync(sector)) wait for another
+ * thread to serve the interrupt.
+ */
+void
+holdInterrupt(
+    bool hold
+);
+
+//! Run the held interrupt, false if there is none
+bool
+serveInterrupt();
+
+//! Called by FlashSegment when an asynchronous operation is started
+void
+raiseInterrupt(
+    void (* handler)()
+);
+}
+}
+}
@@ -6,7 +6,9 @@
 
 #pragma once
 
+#ifndef CORE_STM32_FLASH_SIMULATED
 #include "stm32f30x.h"
+#endif
 
 #include <stdint.h>
 #include <cstddef>
@@ -25,6 +27,9 @@ static const std::size_t FLASH_NUMBER_OF_PAGES = 128;
 #error "Unknown flash memory map"
 #endif
 
+// Widest unit the flash controller can program in a single cycle
+static const std::size_t FLASH_PROGRAM_UNIT = 2;
+
 static constexpr uint32_t
 FLASH_SECTOR_SIZE(
     std::size_t sector
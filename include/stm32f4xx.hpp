@@ -6,7 +6,9 @@
 
 #pragma once
 
+#ifndef CORE_STM32_FLASH_SIMULATED
 #include "stm32f4xx.h"
+#endif
 
 #include <stdint.h>
 #include <cstddef>
@@ -27,6 +29,10 @@ static const std::size_t FLASH_NUMBER_OF_PAGES = 12;
 #error "Unknown flash memory map"
 #endif
 
+// Widest unit the flash controller can program in a single cycle at VoltageRange_3.
+// Double words need an external VPP, which is not available on our boards.
+static const std::size_t FLASH_PROGRAM_UNIT = 4;
+
 static constexpr uint32_t
 FLASH_SECTOR_SIZE(
     std::size_t sector
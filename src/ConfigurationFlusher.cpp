@@ -0,0 +1,253 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/ConfigurationFlusher.hpp>
+
+#include <algorithm>
+
+namespace core {
+namespace stm32_flash {
+ConfigurationFlusher::ConfigurationFlusher(
+    ConfigurationStorage& configuration,
+    systime_t             interval,
+    uint32_t              burst
+) : _configuration(configuration), _interval(std::max(interval, static_cast<systime_t>(1))), _burst(std::max(burst, static_cast<uint32_t>(1))), _tokens(_burst), _refill(0), _thread(nullptr), _retry(false), _pending(false), _waiter(nullptr), _statistics(), _queue(), _queueHead(0), _queueTail(0), _queueUsed(0)
+{
+    osalMutexObjectInit(&_mutex);
+}
+
+bool
+ConfigurationFlusher::post(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    Update update = {
+        offset, static_cast<uint16_t>(size)
+    };
+
+    osalSysLock();
+
+    _statistics.posts++;
+
+    if ((size > 0xFFFF) || ((sizeof(update) + size) > (sizeof(_queue) - _queueUsed))) {
+        _statistics.dropped++;
+        osalSysUnlock();
+        return false;
+    }
+
+    push(&update, sizeof(update));
+    push(data, size);
+
+    _pending = true;
+
+    osalThreadResumeS(&_thread, MSG_OK);
+
+    osalSysUnlock();
+
+    return true;
+} // post
+
+bool
+ConfigurationFlusher::sync()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = flushM();
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+ConfigurationFlusher::wait(
+    systime_t timeout
+)
+{
+    osalSysLock();
+
+    msg_t msg = _pending ? osalThreadSuspendTimeoutS(&_waiter, timeout) : MSG_OK;
+
+    osalSysUnlock();
+
+    return msg == MSG_OK;
+}
+
+void
+ConfigurationFlusher::run()
+{
+    systime_t wait;
+
+    _refill = osalOsGetSystemTimeX();
+
+    for (;;) {
+        osalSysLock();
+
+        // A failed commit is retried with the next token, no need for a new update
+        while (!_retry && (_queueUsed == 0)) {
+            osalThreadSuspendS(&_thread);
+        }
+
+        osalSysUnlock();
+
+        drain();
+
+        // Until a token is available the new updates keep going to the shadow,
+        // they end up in the same commit
+        while (!takeToken(wait)) {
+            osalSysLock();
+            osalThreadSuspendTimeoutS(&_thread, wait);
+            osalSysUnlock();
+
+            drain();
+        }
+
+        osalMutexLock(&_mutex);
+        flushM();
+        osalMutexUnlock(&_mutex);
+    }
+} // run
+
+void
+ConfigurationFlusher::thread(
+    void* arg
+)
+{
+    reinterpret_cast<ConfigurationFlusher*>(arg)->run();
+}
+
+bool
+ConfigurationFlusher::takeToken(
+    systime_t& wait
+)
+{
+    systime_t elapsed = osalOsGetSystemTimeX() - _refill;
+    uint32_t  tokens  = elapsed / _interval;
+
+    if (tokens != 0) {
+        _tokens  = std::min(_burst, _tokens + tokens);
+        _refill += tokens * _interval;
+    }
+
+    if (_tokens != 0) {
+        _tokens--;
+        return true;
+    }
+
+    wait = _interval - (elapsed % _interval);
+
+    return false;
+}
+
+bool
+ConfigurationFlusher::flushM()
+{
+    bool success = true;
+
+    drainM();
+
+    if (_configuration.isDirty()) {
+        _statistics.commits++;
+        success = _configuration.flush();
+    }
+
+    osalSysLock();
+
+    _retry = !success;
+
+    if (!success) {
+        _statistics.failures++;
+
+        // The thread retries, even when the commit was from sync()
+        osalThreadResumeS(&_thread, MSG_OK);
+        osalThreadResumeS(&_waiter, MSG_RESET);
+    } else if (_queueUsed == 0) {
+        // Everything drained is committed
+        _pending = false;
+        osalThreadResumeS(&_waiter, MSG_OK);
+    }
+
+    osalSysUnlock();
+
+    return success;
+} // flushM
+
+void
+ConfigurationFlusher::drainM()
+{
+    uint8_t buffer[32];
+
+    osalSysLock();
+
+    while (_queueUsed != 0) {
+        Update update;
+
+        pop(&update, sizeof(update));
+
+        // Chunked, to keep the critical sections short
+        for (std::size_t done = 0; done < update.size; done += sizeof(buffer)) {
+            std::size_t n = std::min(sizeof(buffer), static_cast<std::size_t>(update.size - done));
+
+            pop(buffer, n);
+
+            osalSysUnlock();
+
+            bool success = _configuration.writeShadow(update.offset + done, buffer, n);
+
+            osalSysLock();
+
+            if (!success) {
+                _statistics.dropped++;
+            }
+        }
+    }
+
+    osalSysUnlock();
+} // drainM
+
+void
+ConfigurationFlusher::drain()
+{
+    osalMutexLock(&_mutex);
+    drainM();
+    osalMutexUnlock(&_mutex);
+}
+
+void
+ConfigurationFlusher::push(
+    const void* data,
+    std::size_t size
+)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+    for (std::size_t i = 0; i < size; i++) {
+        _queue[_queueHead] = bytes[i];
+        _queueHead = (_queueHead + 1) % sizeof(_queue);
+    }
+
+    _queueUsed += size;
+}
+
+void
+ConfigurationFlusher::pop(
+    void*       data,
+    std::size_t size
+)
+{
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+
+    for (std::size_t i = 0; i < size; i++) {
+        bytes[i]   = _queue[_queueTail];
+        _queueTail = (_queueTail + 1) % sizeof(_queue);
+    }
+
+    _queueUsed -= size;
+}
+}
+}
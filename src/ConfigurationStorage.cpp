@@ -6,25 +6,25 @@
 
 #include <core/stm32_flash/ConfigurationStorage.hpp>
 
-#ifndef CORE_WARNINGS_NO_CAST_ALIGN
-#define CORE_WARNINGS_NO_CAST_ALIGN
-#endif
-
-#ifndef CORE_WARNINGS_RESET
-#define CORE_WARNINGS_RESET
-#endif
+#include <algorithm>
+#include <cstring>
 
 namespace core {
 namespace stm32_flash {
 ConfigurationStorage::ConfigurationStorage(
     Storage& storage
-) : _storage(storage), _ready(false) {}
+) : _storage(storage), _ready(false), _transaction(false), _staged(), _patches(), _patchesSize(0), _shadow(nullptr), _shadowSize(0), _dirty(), _dirtyCount(0)
+{
+    osalMutexObjectInit(&_mutex);
+}
 
 const ModuleConfiguration*
 ConfigurationStorage::getModuleConfiguration() const
 {
     static const ModuleConfiguration defaultConfiguration = {
-        0, 0xFFFFFFFF, "***invalid***", 0
+        0, 0xFFFFFFFF, "***invalid***", ModuleConfiguration::IMAGE_LENGTH_FULL, ModuleConfiguration::PROGRAM_SLOT_A, {
+            0
+        }
     };
 
     if (_storage.isValid()) {
@@ -44,113 +44,229 @@ ConfigurationStorage::getUserConfiguration() const
     }
 }
 
+std::size_t
+ConfigurationStorage::usedUserDataSize() const
+{
+    std::size_t used = _storage.usedSize();
+
+    return used > sizeof(ModuleConfiguration) ? used - sizeof(ModuleConfiguration) : 0;
+}
+
 bool
-ConfigurationStorage::writeModuleName(
-    const char* name
+ConfigurationStorage::rewrite(
+    const ModuleConfiguration& configuration,
+    bool                       copyUserData
+)
+{
+    osalMutexLock(&_mutex);
+
+    bool success = rewriteM(configuration, copyUserData);
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+ConfigurationStorage::rewriteM(
+    const ModuleConfiguration& configuration,
+    bool                       copyUserData
 )
 {
-    const uint16_t* tmp = nullptr;
+    if (isUnchanged(configuration, copyUserData)) {
+        // Nothing to write, spare the flash
+        _storage.countSkipped();
+        reloadShadowM();
+        return true;
+    }
+
     bool success = true;
 
     success &= _storage.format();
 
     if (success) {
-    	CORE_WARNINGS_NO_CAST_ALIGN
-        tmp = reinterpret_cast<const uint16_t*>(name); //NOTE: warning: cast increases required alignment of target type - It is OK by design
-    	CORE_WARNINGS_RESET
+        // Sequential order, so that Storage can keep its running CRC
+        success &= _storage.write(0, &configuration, offsetof(ModuleConfiguration, padding));
 
-        for (std::size_t i = 0; i < sizeof(ModuleConfiguration::name); i += 2) {
-            success &= _storage.write16(offsetof(ModuleConfiguration, name) + i, *tmp++);
-        }
+        if (copyUserData) {
+            std::size_t size = newUserDataSize();
+            uint8_t     buffer[64];
 
-        success &= _storage.write32(offsetof(ModuleConfiguration, imageCRC), getModuleConfiguration()->imageCRC);
-        success &= _storage.write32(offsetof(ModuleConfiguration, canID), getModuleConfiguration()->canID);
+            for (Address offset = 0; success && (offset < size); offset += sizeof(buffer)) {
+                std::size_t n = std::min(sizeof(buffer), static_cast<std::size_t>(size - offset));
 
-        tmp = reinterpret_cast<const uint16_t*>(getUserConfiguration());
+                newUserData(offset, buffer, n);
 
-        if (tmp != nullptr) {
-            for (std::size_t i = 0; i < _storage.size() - sizeof(ModuleConfiguration); i += 2) {
-                success &= _storage.write16(sizeof(ModuleConfiguration) + i, *tmp++);
+                // Erased chunks need no programming
+                if (std::any_of(buffer, buffer + n, [](uint8_t x) {
+                    return x != 0xFF;
+                })) {
+                    success &= _storage.write(sizeof(ModuleConfiguration) + offset, buffer, n);
+                }
             }
         }
 
         success &= _storage.commit();
     }
 
+    if (success) {
+        // The dirty ranges are stored, the staged changes may have touched the shadow
+        reloadShadowM();
+    }
+
     return success;
-} // writeModuleName
+} // rewriteM
 
 bool
-ConfigurationStorage::writeProgramCRC(
-    uint32_t crc
-)
+ConfigurationStorage::isUnchanged(
+    const ModuleConfiguration& configuration,
+    bool                       copyUserData
+) const
 {
-    const uint16_t* tmp = nullptr;
-    bool success = true;
+    if (!_storage.isValid() || !_storage.matches(0, &configuration, offsetof(ModuleConfiguration, padding))) {
+        return false;
+    }
 
-    success &= _storage.format();
+    std::size_t size = std::max(usedUserDataSize(), copyUserData ? newUserDataSize() : 0);
+    uint8_t     buffer[64];
 
-    if (success) {
-    	CORE_WARNINGS_NO_CAST_ALIGN
-        tmp = reinterpret_cast<const uint16_t*>(getModuleConfiguration()->name); //NOTE: warning: cast increases required alignment of target type - It is OK by design
-    	CORE_WARNINGS_RESET
+    for (Address offset = 0; offset < size; offset += sizeof(buffer)) {
+        std::size_t n = std::min(sizeof(buffer), static_cast<std::size_t>(size - offset));
 
-        for (std::size_t i = 0; i < sizeof(ModuleConfiguration::name); i += 2) {
-            success &= _storage.write16(offsetof(ModuleConfiguration, name) + i, *tmp++);
+        if (copyUserData) {
+            newUserData(offset, buffer, n);
+        } else {
+            std::memset(buffer, 0xFF, n);
         }
 
-        success &= _storage.write32(offsetof(ModuleConfiguration, imageCRC), crc);
-        success &= _storage.write32(offsetof(ModuleConfiguration, canID), getModuleConfiguration()->canID);
+        if (!_storage.matches(sizeof(ModuleConfiguration) + offset, buffer, n)) {
+            return false;
+        }
+    }
 
-        tmp = reinterpret_cast<const uint16_t*>(getUserConfiguration());
+    return true;
+} // isUnchanged
 
-        if (tmp != nullptr) {
-            for (std::size_t i = 0; i < _storage.size() - sizeof(ModuleConfiguration); i += 2) {
-                success &= _storage.write16(sizeof(ModuleConfiguration) + i, *tmp++);
-            }
+std::size_t
+ConfigurationStorage::newUserDataSize() const
+{
+    std::size_t size = (getUserConfiguration() != nullptr) ? usedUserDataSize() : 0;
+    Patch       patch;
+
+    for (std::size_t i = 0; _transaction && (i < _patchesSize); i += sizeof(patch) + patch.size) {
+        std::memcpy(&patch, _patches + i, sizeof(patch));
+        size = std::max(size, static_cast<std::size_t>(patch.offset + patch.size));
+    }
+
+    for (std::size_t i = 0; i < _dirtyCount; i++) {
+        size = std::max(size, static_cast<std::size_t>(_dirty[i].to));
+    }
+
+    return size;
+}
+
+void
+ConfigurationStorage::newUserData(
+    Address     offset,
+    uint8_t*    buffer,
+    std::size_t size
+) const
+{
+    const uint8_t* user = reinterpret_cast<const uint8_t*>(getUserConfiguration());
+    std::size_t    used = (user != nullptr) ? usedUserDataSize() : 0;
+    Address        to   = offset + size;
+    Patch          patch;
+
+    std::memset(buffer, 0xFF, size);
+
+    if (offset < used) {
+        std::memcpy(buffer, user + offset, std::min(size, static_cast<std::size_t>(used - offset)));
+    }
+
+    // Dirty ranges first: the staged changes were made after the shadow ones
+    for (std::size_t i = 0; i < _dirtyCount; i++) {
+        Address begin = std::max(_dirty[i].from, offset);
+        Address end   = std::min(_dirty[i].to, to);
+
+        if (begin < end) {
+            std::memcpy(buffer + (begin - offset), _shadow + begin, end - begin);
         }
+    }
 
-        success &= _storage.commit();
+    // Apply the staged changes in order, the last one wins
+    for (std::size_t i = 0; _transaction && (i < _patchesSize); i += sizeof(patch) + patch.size) {
+        std::memcpy(&patch, _patches + i, sizeof(patch));
+
+        Address begin = std::max(patch.offset, offset);
+        Address end   = std::min(static_cast<Address>(patch.offset + patch.size), to);
+
+        if (begin < end) {
+            std::memcpy(buffer + (begin - offset), _patches + i + sizeof(patch) + (begin - patch.offset), end - begin);
+        }
     }
+} // newUserData
 
-    return success;
-} // writeProgramCRC
+bool
+ConfigurationStorage::writeModuleName(
+    const char* name
+)
+{
+    ModuleConfiguration configuration = *getModuleConfiguration();
+
+    std::memcpy(configuration.name, name, sizeof(configuration.name));
+
+    return rewrite(configuration, true);
+}
 
 bool
-ConfigurationStorage::writeCanID(
-    uint32_t id
+ConfigurationStorage::writeProgramCRC(
+    uint32_t crc
 )
 {
-    const uint16_t* tmp = nullptr;
-    bool success = true;
+    return writeProgramCRC(crc, ModuleConfiguration::IMAGE_LENGTH_FULL);
+}
 
-    success &= _storage.format();
+bool
+ConfigurationStorage::writeProgramCRC(
+    uint32_t    crc,
+    std::size_t length
+)
+{
+    ModuleConfiguration configuration = *getModuleConfiguration();
 
-    if (success) {
-    	CORE_WARNINGS_NO_CAST_ALIGN
-        tmp = reinterpret_cast<const uint16_t*>(getModuleConfiguration()->name); //NOTE: warning: cast increases required alignment of target type - It is OK by design
-    	CORE_WARNINGS_RESET
+    configuration.imageCRC    = crc;
+    configuration.imageLength = length;
 
-        for (std::size_t i = 0; i < sizeof(ModuleConfiguration::name); i += 2) {
-            success &= _storage.write16(offsetof(ModuleConfiguration, name) + i, *tmp++);
-        }
+    return rewrite(configuration, true);
+}
+
+bool
+ConfigurationStorage::writeProgramSlot(
+    uint8_t     slot,
+    uint32_t    crc,
+    std::size_t length
+)
+{
+    ModuleConfiguration configuration = *getModuleConfiguration();
 
-        success &= _storage.write32(offsetof(ModuleConfiguration, imageCRC), getModuleConfiguration()->imageCRC);
-        success &= _storage.write32(offsetof(ModuleConfiguration, canID), id);
+    configuration.programSlot = slot;
+    configuration.imageCRC    = crc;
+    configuration.imageLength = length;
 
-        tmp = reinterpret_cast<const uint16_t*>(getUserConfiguration());
+    return rewrite(configuration, true);
+}
 
-        if (tmp != nullptr) {
-            for (std::size_t i = 0; i < _storage.size() - sizeof(ModuleConfiguration); i += 2) {
-                success &= _storage.write16(sizeof(ModuleConfiguration) + i, *tmp++);
-            }
-        }
+bool
+ConfigurationStorage::writeCanID(
+    uint32_t id
+)
+{
+    ModuleConfiguration configuration = *getModuleConfiguration();
 
-        success &= _storage.commit();
-    }
+    configuration.canID = id;
 
-    return success;
-} // writeProgramCRC
+    return rewrite(configuration, true);
+}
 
 bool
 ConfigurationStorage::erase()
@@ -184,30 +300,39 @@ ConfigurationStorage::writeUserData32(
     }
 }
 
+bool
+ConfigurationStorage::writeUserData(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    if (_ready) {
+        return _storage.write(offset + sizeof(ModuleConfiguration), data, size);
+    } else {
+        return false;
+    }
+}
+
 bool
 ConfigurationStorage::beginWrite()
 {
-    const uint16_t* tmp = nullptr;
     bool success = true;
 
+    osalMutexLock(&_mutex);
+
     success &= unlock();
     success &= _storage.format();
 
     if (success) {
-    	CORE_WARNINGS_NO_CAST_ALIGN
-        tmp = reinterpret_cast<const uint16_t*>(getModuleConfiguration()->name); //NOTE: warning: cast increases required alignment of target type - It is OK by design
-    	CORE_WARNINGS_RESET
-
-        for (std::size_t i = 0; i < sizeof(ModuleConfiguration::name); i += 2) {
-            success &= _storage.write16(offsetof(ModuleConfiguration, name) + i, *tmp++);
-        }
-
-        success &= _storage.write32(offsetof(ModuleConfiguration, imageCRC), getModuleConfiguration()->imageCRC);
-        success &= _storage.write32(offsetof(ModuleConfiguration, canID), getModuleConfiguration()->canID);
+        // All the fields, as rewrite() does: the image length and the program slot too
+        success &= _storage.write(0, getModuleConfiguration(), offsetof(ModuleConfiguration, padding));
     }
 
     _ready = success;
 
+    osalMutexUnlock(&_mutex);
+
     return success;
 } // beginWrite
 
@@ -216,38 +341,292 @@ ConfigurationStorage::endWrite()
 {
     bool success = true;
 
+    osalMutexLock(&_mutex);
+
     success &= _storage.commit();
     success &= lock();
     _ready   = false;
 
+    reloadShadowM();
+
+    osalMutexUnlock(&_mutex);
+
     return success;
 }
 
 bool
 ConfigurationStorage::eraseUserConfiguration()
 {
-    const uint16_t* tmp = nullptr;
-    bool success = true;
+    return rewrite(*getModuleConfiguration(), false);
+}
 
-    success &= _storage.format();
+bool
+ConfigurationStorage::beginTransaction()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = !_transaction && !_ready;
 
     if (success) {
-    	CORE_WARNINGS_NO_CAST_ALIGN
-        tmp = reinterpret_cast<const uint16_t*>(getModuleConfiguration()->name); //NOTE: warning: cast increases required alignment of target type - It is OK by design
-    	CORE_WARNINGS_RESET
+        _staged      = *getModuleConfiguration();
+        _patchesSize = 0;
+        _transaction = true;
+    }
+
+    osalMutexUnlock(&_mutex);
 
-        for (std::size_t i = 0; i < sizeof(ModuleConfiguration::name); i += 2) {
-            success &= _storage.write16(offsetof(ModuleConfiguration, name) + i, *tmp++);
+    return success;
+}
+
+bool
+ConfigurationStorage::setModuleName(
+    const char* name
+)
+{
+    if (!_transaction) {
+        return false;
+    }
+
+    std::memcpy(_staged.name, name, sizeof(_staged.name));
+
+    return true;
+}
+
+bool
+ConfigurationStorage::setProgramCRC(
+    uint32_t    crc,
+    std::size_t length
+)
+{
+    if (!_transaction) {
+        return false;
+    }
+
+    _staged.imageCRC    = crc;
+    _staged.imageLength = length;
+
+    return true;
+}
+
+bool
+ConfigurationStorage::setProgramSlot(
+    uint8_t slot
+)
+{
+    if (!_transaction) {
+        return false;
+    }
+
+    _staged.programSlot = slot;
+
+    return true;
+}
+
+bool
+ConfigurationStorage::setCanID(
+    uint32_t id
+)
+{
+    if (!_transaction) {
+        return false;
+    }
+
+    _staged.canID = id;
+
+    return true;
+}
+
+bool
+ConfigurationStorage::setUserData(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    Patch patch = {
+        offset, static_cast<uint16_t>(size)
+    };
+
+    if (!_transaction || (size > 0xFFFF) || (offset > userDataSize()) || (size > (userDataSize() - offset))) {
+        return false;
+    }
+
+    if ((sizeof(patch) + size) > (sizeof(_patches) - _patchesSize)) {
+        return false;
+    }
+
+    std::memcpy(_patches + _patchesSize, &patch, sizeof(patch));
+    std::memcpy(_patches + _patchesSize + sizeof(patch), data, size);
+    _patchesSize += sizeof(patch) + size;
+
+    return true;
+} // setUserData
+
+bool
+ConfigurationStorage::commitTransaction()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = _transaction && rewriteM(_staged, true);
+
+    _transaction = false;
+    _patchesSize = 0;
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+void
+ConfigurationStorage::abortTransaction()
+{
+    osalMutexLock(&_mutex);
+
+    _transaction = false;
+    _patchesSize = 0;
+
+    osalMutexUnlock(&_mutex);
+}
+
+void
+ConfigurationStorage::setShadow(
+    void*       buffer,
+    std::size_t size
+)
+{
+    osalMutexLock(&_mutex);
+
+    _shadow     = reinterpret_cast<uint8_t*>(buffer);
+    _shadowSize = (buffer != nullptr) ? std::min(size, userDataSize()) : 0;
+
+    reloadShadowM();
+
+    osalMutexUnlock(&_mutex);
+}
+
+void
+ConfigurationStorage::reloadShadow()
+{
+    osalMutexLock(&_mutex);
+    reloadShadowM();
+    osalMutexUnlock(&_mutex);
+}
+
+void
+ConfigurationStorage::reloadShadowM()
+{
+    _dirtyCount = 0;
+
+    if (_shadow == nullptr) {
+        return;
+    }
+
+    const void* user = getUserConfiguration();
+    std::size_t used = (user != nullptr) ? std::min(usedUserDataSize(), _shadowSize) : 0;
+
+    std::memset(_shadow + used, 0xFF, _shadowSize - used);
+
+    if (used != 0) {
+        std::memcpy(_shadow, user, used);
+    }
+}
+
+bool
+ConfigurationStorage::markDirty(
+    Address     offset,
+    std::size_t size
+)
+{
+    osalMutexLock(&_mutex);
+
+    bool success = markDirtyM(offset, size);
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+ConfigurationStorage::markDirtyM(
+    Address     offset,
+    std::size_t size
+)
+{
+    if ((offset > _shadowSize) || (size > (_shadowSize - offset))) {
+        return false;
+    }
+
+    Range range = {
+        offset, static_cast<Address>(offset + size)
+    };
+
+    if (size == 0) {
+        return true;
+    }
+
+    // Coalesce with the overlapping or adjacent ranges
+    std::size_t i = 0;
+
+    while (i < _dirtyCount) {
+        if ((_dirty[i].from <= range.to) && (range.from <= _dirty[i].to)) {
+            range.from = std::min(range.from, _dirty[i].from);
+            range.to   = std::max(range.to, _dirty[i].to);
+            _dirty[i]  = _dirty[--_dirtyCount];
+        } else {
+            i++;
         }
+    }
 
-        success &= _storage.write32(offsetof(ModuleConfiguration, imageCRC), getModuleConfiguration()->imageCRC);
-        success &= _storage.write32(offsetof(ModuleConfiguration, canID), getModuleConfiguration()->canID);
+    if (_dirtyCount == CORE_STM32_FLASH_DIRTY_RANGES) {
+        // No room left, track a single range covering everything
+        for (i = 0; i < _dirtyCount; i++) {
+            range.from = std::min(range.from, _dirty[i].from);
+            range.to   = std::max(range.to, _dirty[i].to);
+        }
 
-        success &= _storage.commit();
+        _dirtyCount = 0;
     }
 
+    _dirty[_dirtyCount++] = range;
+
+    return true;
+} // markDirtyM
+
+bool
+ConfigurationStorage::writeShadow(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    osalMutexLock(&_mutex);
+
+    bool success = markDirtyM(offset, size);
+
+    if (success) {
+        std::memcpy(_shadow + offset, data, size);
+    }
+
+    osalMutexUnlock(&_mutex);
+
     return success;
-} // eraseUserConfiguration
+}
+
+bool
+ConfigurationStorage::flush()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = _dirtyCount == 0;
+
+    if (!success && !_transaction && !_ready) {
+        success = rewriteM(*getModuleConfiguration(), true);
+    }
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
 
 bool
 ConfigurationStorage::lock()
@@ -7,7 +7,12 @@
 #include <core/stm32_flash/FlashSegment.hpp>
 #include <osal.h>
 
-#if defined(STM32F303xx)
+#include <algorithm>
+#include <cstring>
+
+#if defined(CORE_STM32_FLASH_SIMULATED)
+    #include <core/stm32_flash/simulated_flash.hpp>
+#elif defined(STM32F303xx)
     #include <core/stm32_flash/stm32f30x_flash.h>
     #include <core/stm32_flash/stm32f30x.hpp>
 #elif defined(STM32F091xC)
@@ -41,14 +46,127 @@ FLASH_Status FLASH_ErasePage(uint32_t Page_Address) {
     #error "Chip not supported"
 #endif
 
+#if !defined(CORE_STM32_FLASH_SIMULATED)
+    #include <hal.h>
+
+    #if !defined(CORE_STM32_FLASH_IRQ_PRIORITY)
+        #define CORE_STM32_FLASH_IRQ_PRIORITY 12
+    #endif
+
+    #if defined(STM32F091xC)
+        #define CORE_STM32_FLASH_HANDLER Vector4C
+        #define CORE_STM32_FLASH_ERRORS  (FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR)
+    #elif defined(STM32F303xx)
+        #define CORE_STM32_FLASH_HANDLER Vector50
+        #define CORE_STM32_FLASH_ERRORS  (FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR)
+    #else
+        #define CORE_STM32_FLASH_HANDLER Vector50
+        #define CORE_STM32_FLASH_ERRORS  (FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR)
+    #endif
+#endif
+
 namespace core {
 namespace stm32_flash {
+/*! \brief Program count aligned units, keeping the controller in programming mode
+ *
+ * Compared to calling FLASH_ProgramHalfWord/FLASH_ProgramWord for each unit,
+ * this saves the leading wait and the PG bit toggling at every cycle.
+ */
+static FLASH_Status
+programUnits(
+    Address        address,
+    const uint8_t* data,
+    std::size_t    count
+)
+{
+#if defined(CORE_STM32_FLASH_SIMULATED)
+    FLASH_Status status = FLASH_COMPLETE;
+
+    for (std::size_t i = 0; (i < count) && (status == FLASH_COMPLETE); i++) {
+        if (FLASH_PROGRAM_UNIT == sizeof(uint16_t)) {
+            uint16_t tmp;
+            std::memcpy(&tmp, data, sizeof(tmp));
+            status = FLASH_ProgramHalfWord(address, tmp);
+        } else {
+            uint32_t tmp;
+            std::memcpy(&tmp, data, sizeof(tmp));
+            status = FLASH_ProgramWord(address, tmp);
+        }
+
+        address += FLASH_PROGRAM_UNIT;
+        data    += FLASH_PROGRAM_UNIT;
+    }
+
+    return status;
+#elif defined(STM32F303xx) || defined(STM32F091xC)
+    FLASH_Status status = FLASH_WaitForLastOperation(FLASH_ER_PRG_TIMEOUT);
+
+    if (status != FLASH_COMPLETE) {
+        return status;
+    }
+
+    FLASH->CR |= FLASH_CR_PG;
+
+    for (std::size_t i = 0; i < count; i++) {
+        uint16_t tmp;
+        std::memcpy(&tmp, data, sizeof(tmp));
+
+        *(volatile uint16_t*)address = tmp;
+
+        status = FLASH_WaitForLastOperation(FLASH_ER_PRG_TIMEOUT);
+
+        if (status != FLASH_COMPLETE) {
+            break;
+        }
+
+        address += sizeof(tmp);
+        data    += sizeof(tmp);
+    }
+
+    FLASH->CR &= ~FLASH_CR_PG;
+
+    return status;
+#else
+    FLASH_Status status = FLASH_WaitForLastOperation();
+
+    if (status != FLASH_COMPLETE) {
+        return status;
+    }
+
+    FLASH->CR &= CR_PSIZE_MASK;
+    FLASH->CR |= FLASH_PSIZE_WORD;
+    FLASH->CR |= FLASH_CR_PG;
+
+    for (std::size_t i = 0; i < count; i++) {
+        uint32_t tmp;
+        std::memcpy(&tmp, data, sizeof(tmp));
+
+        *(volatile uint32_t*)address = tmp;
+
+        status = FLASH_WaitForLastOperation();
+
+        if (status != FLASH_COMPLETE) {
+            break;
+        }
+
+        address += sizeof(tmp);
+        data    += sizeof(tmp);
+    }
+
+    FLASH->CR &= (~FLASH_CR_PG);
+
+    return status;
+#endif // if defined(CORE_STM32_FLASH_SIMULATED)
+} // programUnits
+
 FlashSegment::FlashSegment(
     uint32_t from,
     uint32_t to
 ) :
     _from(from),
-    _to(to)
+    _to(to),
+    _blankCheck(false),
+    _statistics()
 {}
 
 FlashSegment::~FlashSegment() {}
@@ -68,6 +186,32 @@ FlashSegment::unlock()
     return true;
 }
 
+bool
+FlashSegment::isSectorBlank(
+    Sector sector
+) const
+{
+    Address address = FLASH_SECTOR_ADDRESS(sector);
+
+    if (!isRangeValid(address, FLASH_SECTOR_SIZE(sector))) {
+        return false;
+    }
+
+    const uint32_t* word = reinterpret_cast<const uint32_t*>(address);
+    const uint32_t* end  = reinterpret_cast<const uint32_t*>(address + FLASH_SECTOR_SIZE(sector));
+
+    // Sector sizes are multiple of 16 bytes: check 4 words per iteration
+    while (word < end) {
+        if ((word[0] & word[1] & word[2] & word[3]) != 0xFFFFFFFF) {
+            return false;
+        }
+
+        word += 4;
+    }
+
+    return true;
+} // isSectorBlank
+
 bool
 FlashSegment::erase()
 {
@@ -95,10 +239,16 @@ FlashSegment::eraseSectorAt(
         return false;
     }
 
+    if (_blankCheck && isSectorBlank(FLASH_ADDRESS_SECTOR(address2))) {
+        _statistics.erasesSkipped++;
+        return true;
+    }
+
     //__disable_irq();
     bool success = FLASH_ErasePage(address2) == FLASH_COMPLETE;
     //__enable_irq();
 
+    _statistics.erases++;
 
     return success;
 }
@@ -152,6 +302,9 @@ FlashSegment::write32(
     bool success = FLASH_ProgramWord(address, data) == FLASH_COMPLETE;
     //__enable_irq();
 
+    _statistics.programs += sizeof(uint32_t) / FLASH_PROGRAM_UNIT;
+    _statistics.bytes    += sizeof(uint32_t);
+
     return success;
 }
 
@@ -171,6 +324,9 @@ FlashSegment::write32_offset(
     bool success = FLASH_ProgramWord(address, data) == FLASH_COMPLETE;
     //__enable_irq();
 
+    _statistics.programs += sizeof(uint32_t) / FLASH_PROGRAM_UNIT;
+    _statistics.bytes    += sizeof(uint32_t);
+
     return success;
 }
 
@@ -188,6 +344,9 @@ FlashSegment::write16(
     bool success = FLASH_ProgramHalfWord(address, data) == FLASH_COMPLETE;
     //__enable_irq();
 
+    _statistics.programs++;
+    _statistics.bytes += sizeof(uint16_t);
+
     return success;
 }
 
@@ -207,7 +366,469 @@ FlashSegment::write16_offset(
     bool success = FLASH_ProgramHalfWord(address, data) == FLASH_COMPLETE;
     //__enable_irq();
 
+    _statistics.programs++;
+    _statistics.bytes += sizeof(uint16_t);
+
     return success;
 }
+bool
+FlashSegment::write(
+    Address     address,
+    const void* data,
+    std::size_t size
+)
+{
+    if (!isRangeValid(address, size)) {
+        return false;
+    }
+
+    const uint8_t* src     = reinterpret_cast<const uint8_t*>(data);
+    std::size_t    length  = size;
+    bool           success = true;
+
+    // Unaligned head and tail share a program unit with bytes we must not touch,
+    // pad them with 0xFF (which leaves the cells as they are).
+    std::size_t misalignment = address % FLASH_PROGRAM_UNIT;
+
+    if ((misalignment != 0) && (length > 0)) {
+        uint8_t     unit[FLASH_PROGRAM_UNIT];
+        std::size_t n = std::min(FLASH_PROGRAM_UNIT - misalignment, length);
+
+        std::memset(unit, 0xFF, sizeof(unit));
+        std::memcpy(unit + misalignment, src, n);
+
+        if (!isAddressValid(address - misalignment)) {
+            return false;
+        }
+
+        success &= programUnits(address - misalignment, unit, 1) == FLASH_COMPLETE;
+        _statistics.programs++;
+
+        address += n;
+        src     += n;
+        length  -= n;
+    }
+
+    std::size_t units = length / FLASH_PROGRAM_UNIT;
+
+    if (success && (units > 0)) {
+        success &= programUnits(address, src, units) == FLASH_COMPLETE;
+        _statistics.programs += units;
+
+        address += units * FLASH_PROGRAM_UNIT;
+        src     += units * FLASH_PROGRAM_UNIT;
+        length  -= units * FLASH_PROGRAM_UNIT;
+    }
+
+    if (success && (length > 0)) {
+        uint8_t unit[FLASH_PROGRAM_UNIT];
+
+        std::memset(unit, 0xFF, sizeof(unit));
+        std::memcpy(unit, src, length);
+
+        success &= programUnits(address, unit, 1) == FLASH_COMPLETE;
+        _statistics.programs++;
+    }
+
+    _statistics.bytes += size;
+
+    return success;
+} // write
+
+bool
+FlashSegment::write_offset(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    return write(_from + offset, data, size);
 }
+
+void
+FlashSegment::resetStatistics()
+{
+    _statistics = Statistics();
+}
+// --- ASYNCHRONOUS -----------------------------------------------------------
+
+struct AsyncOperation {
+    FlashSegment* volatile segment;
+    FlashSegment::Callback callback;
+    void*                  arg;
+    Address                address;
+    const uint8_t*         data; //!< nullptr while erasing
+    std::size_t            units;
+    bool                   success; //!< Simulated flash: the operation is done when started
+
+    static void
+    serveInterrupt();
+};
+
+static AsyncOperation _async;
+
+struct AsyncWaiter {
+    thread_reference_t thread;
+    bool               done;
+    bool               success;
+};
+
+static void
+wakeup(
+    FlashSegment& segment,
+    bool          success,
+    void*         arg
+)
+{
+    (void)segment;
+
+    AsyncWaiter* waiter = reinterpret_cast<AsyncWaiter*>(arg);
+
+    waiter->done    = true;
+    waiter->success = success;
+    osalThreadResumeI(&waiter->thread, MSG_OK);
 }
+
+#if !defined(CORE_STM32_FLASH_SIMULATED)
+static void
+programUnit(
+    Address        address,
+    const uint8_t* data
+)
+{
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    uint16_t tmp;
+    std::memcpy(&tmp, data, sizeof(tmp));
+
+    *(volatile uint16_t*)address = tmp;
+#else
+    uint32_t tmp;
+    std::memcpy(&tmp, data, sizeof(tmp));
+
+    *(volatile uint32_t*)address = tmp;
+#endif
+}
+
+static void
+startOperation()
+{
+    static bool vectorEnabled = false;
+
+    if (!vectorEnabled) {
+        nvicEnableVector(FLASH_IRQn, CORE_STM32_FLASH_IRQ_PRIORITY);
+        vectorEnabled = true;
+    }
+
+    FLASH_ClearFlag(FLASH_FLAG_EOP | CORE_STM32_FLASH_ERRORS);
+    FLASH_ITConfig(FLASH_IT_EOP | FLASH_IT_ERR, ENABLE);
+}
+
+static void
+stopOperation()
+{
+    FLASH_ITConfig(FLASH_IT_EOP | FLASH_IT_ERR, DISABLE);
+
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    FLASH->CR &= ~(FLASH_CR_PG | FLASH_CR_PER);
+#else
+    FLASH->CR &= ~(FLASH_CR_PG | FLASH_CR_SER | FLASH_CR_SNB);
+#endif
+}
+
+void
+AsyncOperation::serveInterrupt()
+{
+    uint32_t status = FLASH->SR;
+
+    FLASH_ClearFlag(FLASH_FLAG_EOP | CORE_STM32_FLASH_ERRORS);
+
+    FlashSegment* segment = _async.segment;
+
+    if (segment == nullptr) {
+        stopOperation();
+        return;
+    }
+
+    bool success = (status & CORE_STM32_FLASH_ERRORS) == 0;
+
+    if (_async.data == nullptr) {
+        segment->_statistics.erases++;
+    } else {
+        segment->_statistics.programs++;
+
+        if (success && (--_async.units > 0)) {
+            _async.address += FLASH_PROGRAM_UNIT;
+            _async.data    += FLASH_PROGRAM_UNIT;
+            programUnit(_async.address, _async.data);
+            return;
+        }
+    }
+
+    stopOperation();
+
+    _async.segment = nullptr;
+
+    osalSysLockFromISR();
+    _async.callback(*segment, success, _async.arg);
+    osalSysUnlockFromISR();
+} // AsyncOperation::serveInterrupt
+#else
+void
+AsyncOperation::serveInterrupt()
+{
+    FlashSegment* segment = _async.segment;
+
+    if (segment == nullptr) {
+        return;
+    }
+
+    if (_async.data == nullptr) {
+        segment->_statistics.erases++;
+    } else {
+        segment->_statistics.programs += _async.units;
+    }
+
+    _async.segment = nullptr;
+
+    _async.callback(*segment, _async.success, _async.arg);
+}
+#endif // if !defined(CORE_STM32_FLASH_SIMULATED)
+
+bool
+FlashSegment::startEraseS(
+    Sector   sector,
+    bool     blank,
+    Callback callback,
+    void*    arg
+)
+{
+    Address address = FLASH_SECTOR_ADDRESS(sector);
+
+    if (!isAddressValid(address) || (_async.segment != nullptr)) {
+        return false;
+    }
+
+    if (blank) {
+        _statistics.erasesSkipped++;
+        callback(*this, true, arg);
+        return true;
+    }
+
+    if (FLASH_GetStatus() == FLASH_BUSY) {
+        return false;
+    }
+
+    _async.segment  = this;
+    _async.callback = callback;
+    _async.arg      = arg;
+    _async.address  = address;
+    _async.data     = nullptr;
+    _async.units    = 0;
+
+#if defined(CORE_STM32_FLASH_SIMULATED)
+    _async.success = FLASH_ErasePage(address) == FLASH_COMPLETE;
+
+    simulated::raiseInterrupt(AsyncOperation::serveInterrupt);
+#else
+    startOperation();
+
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR  = address;
+    FLASH->CR |= FLASH_CR_STRT;
+#else
+    FLASH->CR &= CR_PSIZE_MASK;
+    FLASH->CR |= FLASH_PSIZE_WORD;
+    FLASH->CR &= ~FLASH_CR_SNB;
+    FLASH->CR |= FLASH_CR_SER | (sector << 3);
+    FLASH->CR |= FLASH_CR_STRT;
+#endif
+#endif // if defined(CORE_STM32_FLASH_SIMULATED)
+
+    return true;
+} // FlashSegment::startEraseS
+
+bool
+FlashSegment::startWriteS(
+    Address     address,
+    const void* data,
+    std::size_t size,
+    Callback    callback,
+    void*       arg
+)
+{
+    if (!isRangeValid(address, size) || (_async.segment != nullptr)) {
+        return false;
+    }
+
+    if (((address % FLASH_PROGRAM_UNIT) != 0) || ((size % FLASH_PROGRAM_UNIT) != 0)) {
+        return false;
+    }
+
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+
+    _statistics.bytes += size;
+
+    if (size == 0) {
+        callback(*this, true, arg);
+        return true;
+    }
+
+    if (FLASH_GetStatus() == FLASH_BUSY) {
+        return false;
+    }
+
+    _async.segment  = this;
+    _async.callback = callback;
+    _async.arg      = arg;
+    _async.address  = address;
+    _async.data     = src;
+    _async.units    = size / FLASH_PROGRAM_UNIT;
+
+#if defined(CORE_STM32_FLASH_SIMULATED)
+    _async.success = programUnits(address, src, _async.units) == FLASH_COMPLETE;
+
+    simulated::raiseInterrupt(AsyncOperation::serveInterrupt);
+#else
+    startOperation();
+
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    FLASH->CR |= FLASH_CR_PG;
+#else
+    FLASH->CR &= CR_PSIZE_MASK;
+    FLASH->CR |= FLASH_PSIZE_WORD;
+    FLASH->CR |= FLASH_CR_PG;
+#endif
+
+    programUnit(address, src);
+#endif // if defined(CORE_STM32_FLASH_SIMULATED)
+
+    return true;
+} // FlashSegment::startWriteS
+
+bool
+FlashSegment::eraseSectorAsync(
+    Sector sector
+)
+{
+    AsyncWaiter waiter = {
+        nullptr, false, false
+    };
+
+    bool blank = _blankCheck && isSectorBlank(sector);
+
+    osalSysLock();
+
+    if (startEraseS(sector, blank, wakeup, &waiter) && !waiter.done) {
+        osalThreadSuspendS(&waiter.thread);
+    }
+
+    osalSysUnlock();
+
+    return waiter.success;
+}
+
+bool
+FlashSegment::eraseSectorAsync(
+    Sector   sector,
+    Callback callback,
+    void*    arg
+)
+{
+    bool blank = _blankCheck && isSectorBlank(sector);
+
+    osalSysLock();
+
+    bool success = startEraseS(sector, blank, callback, arg);
+
+    osalSysUnlock();
+
+    return success;
+}
+
+bool
+FlashSegment::eraseAsync()
+{
+    Sector from = FLASH_ADDRESS_SECTOR(_from);
+    Sector to   = FLASH_ADDRESS_SECTOR(_to);
+
+    for (Sector i = from; i < to; i++) {
+        if (!eraseSectorAsync(i)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+FlashSegment::writeAsync(
+    Address     address,
+    const void* data,
+    std::size_t size
+)
+{
+    AsyncWaiter waiter = {
+        nullptr, false, false
+    };
+
+    osalSysLock();
+
+    if (startWriteS(address, data, size, wakeup, &waiter) && !waiter.done) {
+        osalThreadSuspendS(&waiter.thread);
+    }
+
+    osalSysUnlock();
+
+    return waiter.success;
+}
+
+bool
+FlashSegment::writeAsync(
+    Address     address,
+    const void* data,
+    std::size_t size,
+    Callback    callback,
+    void*       arg
+)
+{
+    osalSysLock();
+
+    bool success = startWriteS(address, data, size, callback, arg);
+
+    osalSysUnlock();
+
+    return success;
+}
+
+bool
+FlashSegment::writeAsyncI(
+    Address     address,
+    const void* data,
+    std::size_t size,
+    Callback    callback,
+    void*       arg
+)
+{
+    return startWriteS(address, data, size, callback, arg);
+}
+
+bool
+FlashSegment::isBusy() const
+{
+    return _async.segment == this;
+}
+}
+}
+
+#if !defined(CORE_STM32_FLASH_SIMULATED)
+extern "C" {
+OSAL_IRQ_HANDLER(CORE_STM32_FLASH_HANDLER) {
+    OSAL_IRQ_PROLOGUE();
+
+    core::stm32_flash::AsyncOperation::serveInterrupt();
+
+    OSAL_IRQ_EPILOGUE();
+}
+}
+#endif
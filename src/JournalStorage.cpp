@@ -0,0 +1,320 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/JournalStorage.hpp>
+#include <core/stm32_flash/RunningCRC.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace core {
+namespace stm32_flash {
+JournalStorage::JournalStorage(
+    FlashSegment& bank1,
+    FlashSegment& bank2,
+    std::size_t   size
+) : _bank1(bank1), _bank2(bank2), _size((size + 3) & ~static_cast<std::size_t>(3)), _cnt(0xFFFF), _readBank(nullptr), _writeBank(&bank1), _head(0), _statistics()
+{
+    osalMutexObjectInit(&_mutex);
+
+    uint16_t cnt1       = _bank1.read16_offset(CNT_OFFSET);
+    uint16_t cnt2       = _bank2.read16_offset(CNT_OFFSET);
+    bool     bank1Valid = isBankValid(_bank1);
+    bool     bank2Valid = isBankValid(_bank2);
+
+    if (bank1Valid && bank2Valid) {
+        // Both banks are valid, choose the newest
+        if (Storage::isNewer(cnt1, cnt2)) {
+            bank2Valid = false;
+        } else {
+            bank1Valid = false;
+        }
+    }
+
+    if (bank1Valid) {
+        _cnt       = cnt1;
+        _readBank  = &_bank1;
+        _writeBank = &_bank2;
+    } else if (bank2Valid) {
+        _cnt       = cnt2;
+        _readBank  = &_bank2;
+        _writeBank = &_bank1;
+    }
+
+    if (_readBank != nullptr) {
+        _head = findHead(*_readBank);
+    }
+}
+
+bool
+JournalStorage::isValid() const
+{
+    osalSysLock();
+
+    bool valid = _readBank != nullptr;
+
+    osalSysUnlock();
+
+    return valid;
+}
+
+bool
+JournalStorage::read(
+    Address     offset,
+    void*       data,
+    std::size_t size
+)
+{
+    if ((offset > _size) || (size > (_size - offset))) {
+        return false;
+    }
+
+    osalMutexLock(&_mutex);
+
+    resolve(offset, reinterpret_cast<uint8_t*>(data), size);
+
+    osalMutexUnlock(&_mutex);
+
+    return true;
+}
+
+bool
+JournalStorage::write(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    if ((offset > _size) || (size > (_size - offset))) {
+        return false;
+    }
+
+    osalMutexLock(&_mutex);
+
+    bool success = true;
+
+    if ((_readBank == nullptr) || ((_head + recordSize(size)) > _readBank->size())) {
+        success = compactM();
+    }
+
+    if (success && ((_head + recordSize(size)) > _readBank->size())) {
+        // Does not fit even in an empty journal
+        success = false;
+    }
+
+    if (success) {
+        uint32_t   header  = offset | (size << 16);
+        Address    address = _readBank->from() + _head;
+        RunningCRC crc;
+
+        crc.update(&header, sizeof(header));
+        crc.update(data, size);
+        crc.updateErased(recordSize(size) - RECORD_OVERHEAD - size);
+
+        _readBank->unlock();
+
+        success &= _readBank->write32(address, header);
+        success &= _readBank->write(address + sizeof(header), data, size);
+        success &= _readBank->write32(address + recordSize(size) - sizeof(uint32_t), crc.value());
+
+        _readBank->lock();
+
+        // Even if failed, the space is gone
+        _head += recordSize(size);
+        _statistics.appends++;
+    }
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+} // JournalStorage::write
+
+bool
+JournalStorage::compact()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = compactM();
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+JournalStorage::erase()
+{
+    bool success = true;
+
+    osalMutexLock(&_mutex);
+
+    _bank1.unlock();
+    success &= _bank1.erase();
+    success &= _bank2.erase();
+    _bank1.lock();
+
+    osalSysLock();
+
+    _cnt       = 0xFFFF;
+    _readBank  = nullptr;
+    _writeBank = &_bank1;
+    _head      = 0;
+
+    osalSysUnlock();
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+JournalStorage::isBankValid(
+    FlashSegment& bank
+) const
+{
+    if (!isBankUsable(bank) || (bank.read16_offset(CNT_OFFSET) == 0xFFFF) || (bank.read16_offset(FORMAT_OFFSET) != FORMAT_JOURNAL)) {
+        return false;
+    }
+
+    RunningCRC crc;
+
+    crc.update(reinterpret_cast<const void*>(bank.from() + DATA_OFFSET), _size);
+
+    return crc.value() == bank.read32_offset(CRC_OFFSET);
+}
+
+Address
+JournalStorage::findHead(
+    FlashSegment& bank
+) const
+{
+    Address offset = journalFrom();
+
+    while ((offset + RECORD_OVERHEAD) <= bank.size()) {
+        uint32_t header = bank.read32_offset(offset);
+
+        if (header == 0xFFFFFFFF) {
+            return offset;
+        }
+
+        std::size_t length = header >> 16;
+
+        if ((offset + recordSize(length)) > bank.size()) {
+            // Torn header, consider the journal full
+            break;
+        }
+
+        offset += recordSize(length);
+    }
+
+    return bank.size();
+}
+
+void
+JournalStorage::resolve(
+    Address     offset,
+    uint8_t*    data,
+    std::size_t size
+) const
+{
+    if (_readBank == nullptr) {
+        std::memset(data, 0xFF, size);
+        return;
+    }
+
+    std::memcpy(data, reinterpret_cast<const void*>(_readBank->from() + DATA_OFFSET + offset), size);
+
+    // Apply the records in order, the newest wins
+    Address record = journalFrom();
+
+    while (record < _head) {
+        uint32_t    header = _readBank->read32_offset(record);
+        Address     from   = header & 0xFFFF;
+        std::size_t length = header >> 16;
+        Address     to     = from + length;
+
+        if ((from < (offset + size)) && (to > offset) && (to <= _size)) {
+            RunningCRC crc;
+            Address    payload = _readBank->from() + record + sizeof(header);
+
+            crc.update(&header, sizeof(header));
+            crc.update(reinterpret_cast<const void*>(payload), recordSize(length) - RECORD_OVERHEAD);
+
+            if (crc.value() == _readBank->read32_offset(record + recordSize(length) - sizeof(uint32_t))) {
+                Address begin = std::max(from, offset);
+                Address end   = std::min(to, static_cast<Address>(offset + size));
+
+                std::memcpy(data + (begin - offset), reinterpret_cast<const void*>(payload + (begin - from)), end - begin);
+            }
+        }
+
+        record += recordSize(length);
+    }
+} // JournalStorage::resolve
+
+bool
+JournalStorage::compactM()
+{
+    FlashSegment* target  = _writeBank;
+    bool          success = true;
+
+    if (!isBankUsable(*target)) {
+        return false;
+    }
+
+    target->unlock();
+    success &= target->erase();
+
+    RunningCRC crc;
+    uint8_t    buffer[64];
+
+    for (Address offset = 0; success && (offset < _size); offset += sizeof(buffer)) {
+        std::size_t n = std::min(sizeof(buffer), static_cast<std::size_t>(_size - offset));
+
+        resolve(offset, buffer, n);
+        crc.update(buffer, n);
+
+        // Erased chunks need no programming
+        if (std::any_of(buffer, buffer + n, [](uint8_t x) {
+            return x != 0xFF;
+        })) {
+            success &= target->write_offset(DATA_OFFSET + offset, buffer, n);
+        }
+    }
+
+    uint16_t cnt = _cnt + 1;
+
+    if (cnt == 0xFFFF) {
+        cnt = 0;
+    }
+
+    // The CRC validates the bank, so it goes last
+    success &= target->write16_offset(FORMAT_OFFSET, FORMAT_JOURNAL);
+    success &= target->write16_offset(CNT_OFFSET, cnt);
+    success &= target->write32_offset(CRC_OFFSET, crc.value());
+
+    target->lock();
+
+    if (success) {
+        FlashSegment* tmp = (target == &_bank1) ? &_bank2 : &_bank1;
+
+        osalSysLock();
+
+        _cnt       = cnt;
+        _readBank  = target;
+        _writeBank = tmp;
+        _head      = journalFrom();
+
+        osalSysUnlock();
+
+        _statistics.compactions++;
+    }
+
+    return success;
+} // JournalStorage::compactM
+}
+}
@@ -0,0 +1,363 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/KeyValueStorage.hpp>
+#include <core/stm32_flash/RunningCRC.hpp>
+
+#include <cstring>
+
+namespace core {
+namespace stm32_flash {
+static uint32_t
+recordCRC(
+    uint32_t    header,
+    const void* data,
+    std::size_t size
+)
+{
+    RunningCRC crc;
+
+    crc.update(&header, sizeof(header));
+    crc.update(data, size);
+    crc.updateErased(((size + 3) & ~static_cast<std::size_t>(3)) - size);
+
+    return crc.value();
+}
+
+KeyValueStorage::KeyValueStorage(
+    Storage& storage
+) : _storage(storage), _head(0), _index(), _statistics()
+{
+    osalMutexObjectInit(&_mutex);
+
+    build();
+}
+
+const void*
+KeyValueStorage::get(
+    Key          key,
+    std::size_t& size
+) const
+{
+    osalSysLock();
+
+    const Entry* entry  = find(key);
+    Address      record = ((entry != nullptr) && (entry->key == key)) ? entry->record : 0;
+
+    osalSysUnlock();
+
+    if (record == 0) {
+        return nullptr;
+    }
+
+    size = *reinterpret_cast<const uint32_t*>(record) >> 16;
+
+    return reinterpret_cast<const void*>(record + sizeof(uint32_t));
+}
+
+bool
+KeyValueStorage::set(
+    Key         key,
+    const void* data,
+    std::size_t size
+)
+{
+    if ((key == INVALID_KEY) || (size == 0) || (size > 0xFFFF)) {
+        return false;
+    }
+
+    std::size_t current;
+    const void* value = get(key, current);
+
+    if ((value != nullptr) && (current == size) && (std::memcmp(value, data, size) == 0)) {
+        // Already stored
+        return true;
+    }
+
+    osalMutexLock(&_mutex);
+
+    bool success;
+
+    if (_storage.isValid() && ((_head + recordSize(size)) <= _storage.size())) {
+        success = appendM(key, data, size);
+    } else {
+        success = compactM(key, data, size);
+    }
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+} // set
+
+bool
+KeyValueStorage::remove(
+    Key key
+)
+{
+    std::size_t size;
+
+    if (get(key, size) == nullptr) {
+        return true;
+    }
+
+    osalMutexLock(&_mutex);
+
+    bool success;
+
+    if ((_head + recordSize(0)) <= _storage.size()) {
+        success = appendM(key, nullptr, 0);
+    } else {
+        success = compactM(key, nullptr, 0);
+    }
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+} // remove
+
+bool
+KeyValueStorage::compact()
+{
+    osalMutexLock(&_mutex);
+
+    bool success = compactM(INVALID_KEY, nullptr, 0);
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+KeyValueStorage::Entry*
+KeyValueStorage::find(
+    Key key
+)
+{
+    return const_cast<Entry*>(static_cast<const KeyValueStorage*>(this)->find(key));
+}
+
+const KeyValueStorage::Entry*
+KeyValueStorage::find(
+    Key key
+) const
+{
+    std::size_t i = hash(key);
+
+    // Linear probing, keys are never removed from the index
+    for (std::size_t n = 0; n < MAX_KEYS; n++, i++) {
+        const Entry* entry = &_index[i % MAX_KEYS];
+
+        if ((entry->key == key) || (entry->key == INVALID_KEY)) {
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+void
+KeyValueStorage::build()
+{
+    for (std::size_t i = 0; i < MAX_KEYS; i++) {
+        _index[i].key    = INVALID_KEY;
+        _index[i].record = 0;
+    }
+
+    if (!_storage.isValid()) {
+        // Nothing to append to, the first update creates a generation
+        _head = _storage.size();
+        return;
+    }
+
+    std::size_t payload = _storage.usedSize();
+
+    // The compacted records, then the appended ones
+    scan(0, payload);
+    _head = scan(payload, _storage.size());
+}
+
+Address
+KeyValueStorage::scan(
+    Address from,
+    Address to
+)
+{
+    Address base   = _storage.getAddress();
+    Address offset = from;
+
+    while ((offset + RECORD_OVERHEAD) <= to) {
+        uint32_t header = *reinterpret_cast<const uint32_t*>(base + offset);
+
+        if (header == 0xFFFFFFFF) {
+            return offset;
+        }
+
+        Key         key    = header & 0xFFFF;
+        std::size_t length = header >> 16;
+
+        if ((offset + recordSize(length)) > to) {
+            // Torn header, consider the area full
+            break;
+        }
+
+        uint32_t crc = *reinterpret_cast<const uint32_t*>(base + offset + recordSize(length) - sizeof(uint32_t));
+
+        if ((key != INVALID_KEY) && (crc == recordCRC(header, reinterpret_cast<const void*>(base + offset + sizeof(header)), length))) {
+            Entry* entry = find(key);
+
+            if (entry != nullptr) {
+                entry->key    = key;
+                entry->record = (length != 0) ? (base + offset) : 0;
+            }
+        }
+
+        offset += recordSize(length);
+    }
+
+    return to;
+} // scan
+
+bool
+KeyValueStorage::appendM(
+    Key         key,
+    const void* data,
+    std::size_t size
+)
+{
+    Entry* entry = find(key);
+
+    if (entry == nullptr) {
+        // Index full
+        return false;
+    }
+
+    uint32_t header  = key | (size << 16);
+    uint32_t crc     = recordCRC(header, data, size);
+    Address  offset  = _head;
+    bool     success = true;
+
+    success &= _storage.append(offset, &header, sizeof(header));
+
+    if (size != 0) {
+        success &= _storage.append(offset + sizeof(header), data, size);
+    }
+
+    // The CRC validates the record, so it goes last
+    success &= _storage.append(offset + recordSize(size) - sizeof(crc), &crc, sizeof(crc));
+
+    // Even if failed, the space is gone
+    _head += recordSize(size);
+
+    if (success) {
+        osalSysLock();
+
+        entry->record = (size != 0) ? (_storage.getAddress() + offset) : 0;
+        entry->key    = key;
+
+        osalSysUnlock();
+
+        _statistics.appends++;
+    }
+
+    return success;
+} // appendM
+
+bool
+KeyValueStorage::compactM(
+    Key         key,
+    const void* data,
+    std::size_t size
+)
+{
+    Entry* target = (key != INVALID_KEY) ? find(key) : nullptr;
+
+    if ((key != INVALID_KEY) && (target == nullptr)) {
+        // Index full
+        return false;
+    }
+
+    // Check that everything fits before starting a new generation
+    std::size_t total = (size != 0) ? recordSize(size) : 0;
+
+    for (std::size_t i = 0; i < MAX_KEYS; i++) {
+        if ((_index[i].record != 0) && (&_index[i] != target)) {
+            total += recordSize(*reinterpret_cast<const uint32_t*>(_index[i].record) >> 16);
+        }
+    }
+
+    if (total > _storage.size()) {
+        return false;
+    }
+
+    bool success = true;
+
+    success &= _storage.format();
+
+    if (!success) {
+        return false;
+    }
+
+    // The current generation stays readable until the commit
+    Address offset = 0;
+
+    for (std::size_t i = 0; i < MAX_KEYS; i++) {
+        if ((_index[i].record != 0) && (&_index[i] != target)) {
+            std::size_t length = recordSize(*reinterpret_cast<const uint32_t*>(_index[i].record) >> 16);
+
+            success &= _storage.write(offset, reinterpret_cast<const void*>(_index[i].record), length);
+            offset  += length;
+        }
+    }
+
+    if (size != 0) {
+        uint32_t header = key | (size << 16);
+        uint32_t crc    = recordCRC(header, data, size);
+
+        success &= _storage.write(offset, &header, sizeof(header));
+        success &= _storage.write(offset + sizeof(header), data, size);
+        success &= _storage.write(offset + recordSize(size) - sizeof(crc), &crc, sizeof(crc));
+    }
+
+    success &= _storage.commit();
+
+    if (!success) {
+        // Resync with whatever generation is now current
+        build();
+        return false;
+    }
+
+    // Same order as above
+    Address base = _storage.getAddress();
+
+    offset = 0;
+
+    for (std::size_t i = 0; i < MAX_KEYS; i++) {
+        if ((_index[i].record != 0) && (&_index[i] != target)) {
+            std::size_t length = recordSize(*reinterpret_cast<const uint32_t*>(_index[i].record) >> 16);
+
+            osalSysLock();
+            _index[i].record = base + offset;
+            osalSysUnlock();
+
+            offset += length;
+        }
+    }
+
+    if (target != nullptr) {
+        osalSysLock();
+
+        target->record = (size != 0) ? (base + offset) : 0;
+        target->key    = key;
+
+        osalSysUnlock();
+    }
+
+    _head = _storage.usedSize();
+    _statistics.compactions++;
+
+    return true;
+} // compactM
+}
+}
@@ -0,0 +1,206 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/ProgramDecompressor.hpp>
+
+namespace core {
+namespace stm32_flash {
+static const std::size_t WINDOW    = CORE_STM32_FLASH_LZ_WINDOW;
+static const std::size_t MIN_MATCH = 4;
+
+ProgramDecompressor::ProgramDecompressor(
+    ProgramStorage& program
+) : _program(program), _address(0), _state(State::HEADER), _failed(false), _header(), _headerSize(0), _token(0), _length(0), _offset(0), _offsetSize(0), _out(0), _flushed(0), _window() {}
+
+bool
+ProgramDecompressor::begin(
+    Address address
+)
+{
+    if (!_program.isReady() || ((address % 4) != 0)) {
+        return false;
+    }
+
+    _address    = address;
+    _state      = State::HEADER;
+    _failed     = false;
+    _headerSize = 0;
+    _out        = 0;
+    _flushed    = 0;
+
+    return true;
+}
+
+bool
+ProgramDecompressor::push(
+    const void* data,
+    std::size_t size
+)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+    for (std::size_t i = 0; (i < size) && !_failed; i++) {
+        _failed = !parse(bytes[i]);
+    }
+
+    return !_failed;
+}
+
+bool
+ProgramDecompressor::finish()
+{
+    bool success = !_failed && (_state == State::DONE);
+
+    success &= flush();
+
+    return success;
+}
+
+bool
+ProgramDecompressor::parse(
+    uint8_t byte
+)
+{
+    switch (_state) {
+      case State::HEADER:
+          reinterpret_cast<uint8_t*>(_header)[_headerSize++] = byte;
+
+          if (_headerSize < sizeof(_header)) {
+              return true;
+          }
+
+          if ((_header[0] != MAGIC) || !_program.isAddressValid(_address) || (_header[1] > (_program.to() - _address))) {
+              return false;
+          }
+
+          _state = (_header[1] == 0) ? State::DONE : State::TOKEN;
+          return true;
+
+      case State::TOKEN:
+          _token  = byte;
+          _length = byte >> 4;
+
+          if (_length == 15) {
+              _state = State::LITERAL_LENGTH;
+              return true;
+          }
+
+          return literals();
+
+      case State::LITERAL_LENGTH:
+          _length += byte;
+          return (byte == 255) || literals();
+
+      case State::LITERALS:
+          if (!emit(byte)) {
+              return false;
+          }
+
+          _length--;
+          return literals();
+
+      case State::OFFSET:
+          _offset |= static_cast<uint16_t>(byte << (8 * _offsetSize));
+          _offsetSize++;
+
+          if (_offsetSize < sizeof(_offset)) {
+              return true;
+          }
+
+          if ((_offset == 0) || (_offset > WINDOW) || (_offset > _out)) {
+              return false;
+          }
+
+          _length = (_token & 0x0F) + MIN_MATCH;
+
+          if ((_token & 0x0F) == 15) {
+              _state = State::MATCH_LENGTH;
+              return true;
+          }
+
+          return match();
+
+      case State::MATCH_LENGTH:
+          _length += byte;
+          return (byte == 255) || match();
+
+      case State::DONE:
+      default:
+          return false;
+    } // switch
+} // parse
+
+bool
+ProgramDecompressor::literals()
+{
+    if (_length > 0) {
+        _state = State::LITERALS;
+    } else if (_out == _header[1]) {
+        // The last sequence has no match
+        _state = State::DONE;
+    } else {
+        _state      = State::OFFSET;
+        _offset     = 0;
+        _offsetSize = 0;
+    }
+
+    return true;
+}
+
+bool
+ProgramDecompressor::match()
+{
+    // The source can overlap the bytes being copied
+    while (_length > 0) {
+        if (!emit(_window[(_out - _offset) & (WINDOW - 1)])) {
+            return false;
+        }
+
+        _length--;
+    }
+
+    _state = State::TOKEN;
+
+    return true;
+}
+
+bool
+ProgramDecompressor::emit(
+    uint8_t byte
+)
+{
+    if (_out >= _header[1]) {
+        return false;
+    }
+
+    _window[_out & (WINDOW - 1)] = byte;
+    _out++;
+
+    // Each half of the window is programmed when full, the other half keeps the history
+    if ((_out - _flushed) == (WINDOW / 2)) {
+        return flush();
+    }
+
+    return true;
+}
+
+bool
+ProgramDecompressor::flush()
+{
+    std::size_t size = _out - _flushed;
+
+    if (size == 0) {
+        return true;
+    }
+
+    bool success = _program.write(_address + _flushed, &_window[_flushed & (WINDOW - 1)], size);
+
+    _flushed = _out;
+
+    return success;
+}
+}
+}
@@ -0,0 +1,337 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/ProgramPatcher.hpp>
+
+#include <algorithm>
+
+#if defined(STM32F303xx)
+    #include <core/stm32_flash/stm32f30x.hpp>
+#elif defined(STM32F091xC)
+    #include <core/stm32_flash/stm32f0xx.hpp>
+#elif defined(STM32F407xx) || defined(STM32F417xx)
+    #include <core/stm32_flash/stm32f4xx.hpp>
+#else
+    #error "Chip not supported"
+#endif
+
+namespace core {
+namespace stm32_flash {
+static const std::size_t BUFFER_SIZE = CORE_STM32_FLASH_PATCH_BUFFER_SIZE;
+
+ProgramPatcher::ProgramPatcher(
+    ProgramStorage& program,
+    FlashSegment&   scratch
+) : _program(program), _scratch(scratch), _state(State::HEADER), _failed(false), _header(), _headerSize(0), _operation(0), _varint(0), _shift(0), _length(0), _old(0), _out(0), _flushed(0), _buffer(), _sector(0), _sectorEnd(0) {}
+
+bool
+ProgramPatcher::begin()
+{
+    _state      = State::HEADER;
+    _failed     = false;
+    _headerSize = 0;
+    _old        = 0;
+    _out        = 0;
+    _flushed    = 0;
+    _sector     = 0;
+    _sectorEnd  = 0;
+
+    return true;
+}
+
+bool
+ProgramPatcher::push(
+    const void* data,
+    std::size_t size
+)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+
+    for (std::size_t i = 0; (i < size) && !_failed; i++) {
+        _failed = !parse(bytes[i]);
+    }
+
+    return !_failed;
+}
+
+bool
+ProgramPatcher::finish()
+{
+    if (_state == State::HEADER) {
+        // The write session was not started
+        return false;
+    }
+
+    // The last sector is programmed with the last byte
+    bool success = !_failed && (_state == State::DONE);
+
+    success &= _program.endWrite();
+
+    _scratch.lock();
+
+    success &= (_program.imageLength() == _header.newLength) && (_program.crc() == _header.newCRC);
+
+    return success;
+}
+
+bool
+ProgramPatcher::parse(
+    uint8_t byte
+)
+{
+    switch (_state) {
+      case State::HEADER:
+          reinterpret_cast<uint8_t*>(&_header)[_headerSize++] = byte;
+          return (_headerSize < sizeof(_header)) || start();
+
+      case State::OPERATION:
+          if (byte > INSERT) {
+              return false;
+          }
+
+          _operation = byte;
+          _varint    = 0;
+          _shift     = 0;
+          _state     = State::LENGTH;
+          return true;
+
+      case State::LENGTH:
+      case State::DELTA:
+          if (_shift >= 32) {
+              return false;
+          }
+
+          _varint |= static_cast<uint32_t>(byte & 0x7F) << _shift;
+          _shift  += 7;
+
+          if ((byte & 0x80) != 0) {
+              return true;
+          }
+
+          if (_state == State::LENGTH) {
+              _length = _varint;
+              _varint = 0;
+              _shift  = 0;
+
+              if (_operation == INSERT) {
+                  _state = State::DATA;
+              } else {
+                  _state = State::DELTA;
+                  return true;
+              }
+          } else {
+              // Zigzag: 0, -1, 1, -2, ...
+              _old += static_cast<std::size_t>(static_cast<int32_t>((_varint >> 1) ^ (0 - (_varint & 1))));
+
+              if (_operation == COPY) {
+                  return copy();
+              }
+
+              _state = State::DATA;
+          }
+
+          if (_length == 0) {
+              next();
+          }
+
+          return true;
+
+      case State::DATA: {
+          uint8_t value = byte;
+
+          if (_operation == DIFF) {
+              uint8_t old;
+
+              if (!readOld(old)) {
+                  return false;
+              }
+
+              value += old;
+              _old++;
+          }
+
+          if (!emit(value)) {
+              return false;
+          }
+
+          _length--;
+
+          if (_length == 0) {
+              next();
+          }
+
+          return true;
+      }
+
+      case State::DONE:
+      default:
+          return false;
+    } // switch
+} // parse
+
+bool
+ProgramPatcher::start()
+{
+    if ((_header.magic != MAGIC) || (_header.oldLength > _program.size()) || (_header.newLength > _program.size())) {
+        return false;
+    }
+
+    // The scratch holds a whole sector
+    Sector      first   = FLASH_ADDRESS_SECTOR(_program.from());
+    std::size_t largest = 0;
+
+    for (std::size_t i = 0; i < _program.sectors(); i++) {
+        largest = std::max(largest, static_cast<std::size_t>(FLASH_SECTOR_SIZE(first + i)));
+    }
+
+    if ((FLASH_SECTOR_ADDRESS(FLASH_ADDRESS_SECTOR(_scratch.from())) != _scratch.from()) || (_scratch.size() < largest)) {
+        return false;
+    }
+
+    if ((_scratch.from() < _program.to()) && (_program.from() < _scratch.to())) {
+        return false;
+    }
+
+    // The patch applies to this image only
+    if (_program.updateCRC(_header.oldLength) != _header.oldCRC) {
+        return false;
+    }
+
+    bool success = true;
+
+    success &= _scratch.unlock();
+    success &= _program.beginLazyWrite();
+
+    _state = (_header.newLength == 0) ? State::DONE : State::OPERATION;
+
+    return success;
+}
+
+void
+ProgramPatcher::next()
+{
+    _state = (_out == _header.newLength) ? State::DONE : State::OPERATION;
+}
+
+bool
+ProgramPatcher::copy()
+{
+    while (_length > 0) {
+        uint8_t byte;
+
+        if (!readOld(byte) || !emit(byte)) {
+            return false;
+        }
+
+        _old++;
+        _length--;
+    }
+
+    next();
+
+    return true;
+}
+
+bool
+ProgramPatcher::emit(
+    uint8_t byte
+)
+{
+    if (_out >= _header.newLength) {
+        return false;
+    }
+
+    Address address = _program.from() + _out;
+
+    // The buffer never crosses a sector boundary, it is empty here
+    if ((address >= _sectorEnd) && !open(address)) {
+        return false;
+    }
+
+    _buffer[_out - _flushed] = byte;
+    _out++;
+
+    bool last = ((address + 1) == _sectorEnd) || (_out == _header.newLength);
+
+    if (((_out - _flushed) == BUFFER_SIZE) || last) {
+        if (!flush()) {
+            return false;
+        }
+    }
+
+    // All the references to the old sector were valid
+    return !last || commit();
+}
+
+bool
+ProgramPatcher::readOld(
+    uint8_t& byte
+)
+{
+    if (_old >= _header.oldLength) {
+        return false;
+    }
+
+    Address address = _program.from() + _old;
+
+    // The sector of the next byte and the following ones are not written yet
+    if (address < FLASH_SECTOR_ADDRESS(FLASH_ADDRESS_SECTOR(_program.from() + _out))) {
+        // Already overwritten by the new image
+        return false;
+    }
+
+    byte = *reinterpret_cast<const uint8_t*>(address);
+
+    return true;
+}
+
+bool
+ProgramPatcher::flush()
+{
+    std::size_t size = _out - _flushed;
+
+    if (size == 0) {
+        return true;
+    }
+
+    bool success = _scratch.write(_scratch.from() + (_program.from() + _flushed - _sector), _buffer, size);
+
+    _flushed = _out;
+
+    return success;
+}
+
+bool
+ProgramPatcher::open(
+    Address address
+)
+{
+    Sector sector = FLASH_ADDRESS_SECTOR(address);
+
+    _sector    = FLASH_SECTOR_ADDRESS(sector);
+    _sectorEnd = _sector + FLASH_SECTOR_SIZE(sector);
+
+    // The scratch sectors may be smaller than the program one
+    bool    success = true;
+    Address erase   = _scratch.from();
+
+    while (success && (erase < (_scratch.from() + (_sectorEnd - _sector)))) {
+        success &= _scratch.eraseSectorAt(erase);
+        erase    = FLASH_SECTOR_ADDRESS(FLASH_ADDRESS_SECTOR(erase) + 1);
+    }
+
+    return success;
+}
+
+bool
+ProgramPatcher::commit()
+{
+    std::size_t size = _program.from() + _out - _sector;
+
+    return _program.write(_sector, reinterpret_cast<const void*>(_scratch.from()), size);
+}
+}
+}
@@ -0,0 +1,49 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/ProgramSlots.hpp>
+
+namespace core {
+namespace stm32_flash {
+ProgramSlots::ProgramSlots(
+    ProgramStorage&       a,
+    ProgramStorage&       b,
+    ConfigurationStorage& configuration
+) : _a(a), _b(b), _configuration(configuration) {}
+
+ProgramSlots::Slot
+ProgramSlots::active() const
+{
+    // Slot A unless B is recorded: the configurations written before the slots have it erased
+    return (_configuration.getModuleConfiguration()->programSlot == B) ? B : A;
+}
+
+bool
+ProgramSlots::activate(
+    uint32_t    crc,
+    std::size_t length
+)
+{
+    Slot            slot    = inactive();
+    ProgramStorage& program = storage(slot);
+
+    if (program.isReady() || (program.updateCRC(length) != crc)) {
+        return false;
+    }
+
+    // Slot and CRC in a single generation
+    return _configuration.writeProgramSlot(slot, crc, length);
+}
+
+bool
+ProgramSlots::isActiveValid()
+{
+    const ModuleConfiguration* configuration = _configuration.getModuleConfiguration();
+
+    return _configuration.isValid() && (activeStorage().updateCRC(configuration->imageLength) == configuration->imageCRC);
+}
+}
+}
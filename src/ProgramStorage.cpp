@@ -8,18 +8,46 @@
 #include <core/stm32_crc/CRC.hpp>
 #include <core/stm32_flash/ProgramStorage.hpp>
 
+#include <algorithm>
+
+#if defined(STM32F303xx)
+    #include <core/stm32_flash/stm32f30x.hpp>
+#elif defined(STM32F091xC)
+    #include <core/stm32_flash/stm32f0xx.hpp>
+#elif defined(STM32F407xx) || defined(STM32F417xx)
+    #include <core/stm32_flash/stm32f4xx.hpp>
+#else
+    #error "Chip not supported"
+#endif
+
 namespace core {
 namespace stm32_flash {
+// Checkpoint: manifest ID (uint32_t), then a uint16_t per sector, programmed to 0 once the sector is verified
+static const std::size_t CHECKPOINT_MARKS = sizeof(uint32_t);
+static const uint16_t    CHECKPOINT_DONE  = 0x0000;
+
 ProgramStorage::ProgramStorage(
     FlashSegment& storage
-) : _storage(storage), _ready(false), _crc(0) {
+) : _storage(storage), _ready(false), _crc(0), _lazy(false), _eraseAheadTo(0), _erasedTo(0), _erasing(false), _waiter(nullptr), _deferred(), _runningCRC(), _runningCRCValid(false), _end(0), _differential(false), _skipped(0), _skip(), _manifest(nullptr), _checkpoint(nullptr), _checkpointed(0) {
 }
 
 uint32_t
 ProgramStorage::updateCRC() {
+    return updateCRC(size());
+}
+
+uint32_t
+ProgramStorage::updateCRC(
+    std::size_t length
+)
+{
+    // IMAGE_LENGTH_FULL (or any length past the end) is the whole segment
+    length = std::min(length, size());
+    length = std::min((length + 3) & ~static_cast<std::size_t>(3), size());
+
     core::stm32_crc::CRC::init();
     core::stm32_crc::CRC::setPolynomialSize(core::stm32_crc::CRC::PolynomialSize::POLY_32);
-    core::stm32_crc::CRC::CRCBlock((uint32_t*)from(), size() / sizeof(uint32_t));
+    core::stm32_crc::CRC::CRCBlock((uint32_t*)from(), length / sizeof(uint32_t));
 
     _crc =  core::stm32_crc::CRC::getCRC();
 
@@ -40,7 +68,39 @@ ProgramStorage::beginWrite()
     success &= unlock();
     success &= erase();
 
-    _ready = success;
+    _runningCRC.reset();
+    _runningCRCValid = true;
+    _end = 0;
+
+    _lazy         = false;
+    _differential = false;
+    _checkpoint   = nullptr;
+    _ready        = success;
+
+    return success;
+}
+
+bool
+ProgramStorage::beginLazyWrite(
+    std::size_t length
+)
+{
+    bool success = true;
+
+    success &= unlock();
+
+    _runningCRC.reset();
+    _runningCRCValid = true;
+    _end = 0;
+
+    _differential = false;
+    _checkpoint   = nullptr;
+    _lazy         = true;
+    _eraseAheadTo = from() + std::min(length, size());
+    _erasedTo     = from();
+
+    _deferred.callback = nullptr;
+    _ready        = success;
 
     return success;
 }
@@ -50,10 +110,430 @@ ProgramStorage::endWrite()
 {
     bool success = true;
 
+    waitErase();
+
+    if (_checkpoint != nullptr) {
+        // The image is complete: the last sector is recorded too
+        success &= record(true);
+        success &= _checkpoint->lock();
+        _checkpoint = nullptr;
+    }
+
+    _manifest = nullptr;
+
     success &= lock();
     _ready   = false;
+    _lazy    = false;
+
+    _differential = false;
+
+    if (_runningCRCValid) {
+        _crc = _runningCRC.value();
+    } else {
+        // Not written in order, read it back
+        updateCRC(_end);
+    }
+
+    return success;
+}
+
+bool
+ProgramStorage::beginDifferentialWrite(
+    const ImageManifest& manifest
+)
+{
+    return beginDifferential(manifest, nullptr);
+}
+
+bool
+ProgramStorage::beginResumableWrite(
+    const ImageManifest& manifest,
+    FlashSegment&        checkpoint
+)
+{
+    if (manifest.sectors > CORE_STM32_FLASH_MANIFEST_SECTORS) {
+        return false;
+    }
+
+    std::size_t count   = manifestSectors(manifest);
+    bool        success = true;
+
+    if (checkpoint.size() < (CHECKPOINT_MARKS + (count * sizeof(uint16_t)))) {
+        return false;
+    }
+
+    // The checkpoint belongs to the image with this manifest
+    RunningCRC id;
+
+    id.update(&manifest.sectors, sizeof(manifest.sectors));
+    id.update(manifest.crc, count * sizeof(manifest.crc[0]));
+
+    success &= checkpoint.unlock();
+
+    if (checkpoint.read32(checkpoint.from()) != id.value()) {
+        success &= checkpoint.erase();
+        success &= checkpoint.write32(checkpoint.from(), id.value());
+    }
+
+    success &= beginDifferential(manifest, &checkpoint);
+
+    _manifest     = &manifest;
+    _checkpoint   = &checkpoint;
+    _checkpointed = 0;
+
+    return success;
+}
+
+bool
+ProgramStorage::beginDifferential(
+    const ImageManifest& manifest,
+    const FlashSegment*  checkpoint
+)
+{
+    if (manifest.sectors > CORE_STM32_FLASH_MANIFEST_SECTORS) {
+        return false;
+    }
+
+    bool        success = true;
+    std::size_t count   = manifestSectors(manifest);
+
+    success &= unlock();
+
+    _skipped = 0;
+    std::fill(_skip, _skip + (sizeof(_skip) / sizeof(_skip[0])), 0);
+
+    Sector first = FLASH_ADDRESS_SECTOR(from());
+
+    for (std::size_t i = 0; success && (i < count); i++) {
+        // A recorded sector is still verified: its programming could have been interrupted
+        bool recorded = (checkpoint == nullptr) || (*reinterpret_cast<const uint16_t*>(checkpoint->from() + CHECKPOINT_MARKS + (i * sizeof(uint16_t))) == CHECKPOINT_DONE);
+
+        if (recorded && (sectorCRC(i) == manifest.crc[i])) {
+            _skip[i / 32] |= 1u << (i % 32);
+            _skipped++;
+        } else {
+            success &= _storage.eraseSector(first + i);
+        }
+    }
+
+    _runningCRC.reset();
+    _runningCRCValid = true;
+    _end = 0;
+
+    _lazy         = false;
+    _differential = true;
+    _checkpoint   = nullptr;
+    _ready        = success;
+
+    return success;
+} // beginDifferential
+
+Address
+ProgramStorage::resumeAddress() const
+{
+    Sector first = FLASH_ADDRESS_SECTOR(from());
+
+    for (std::size_t i = 0; i < sectors(); i++) {
+        if (!isSkipped(i)) {
+            return FLASH_SECTOR_ADDRESS(first + i);
+        }
+    }
+
+    return to();
+}
+
+bool
+ProgramStorage::checkpoint()
+{
+    return record(false);
+}
+
+bool
+ProgramStorage::record(
+    bool all
+)
+{
+    if (_checkpoint == nullptr) {
+        return true;
+    }
+
+    std::size_t count   = manifestSectors(*_manifest);
+    Sector      first   = FLASH_ADDRESS_SECTOR(from());
+    bool        success = true;
+
+    for ( ; _checkpointed < count; _checkpointed++) {
+        Sector sector = first + _checkpointed;
+
+        if (!all && ((FLASH_SECTOR_ADDRESS(sector) + FLASH_SECTOR_SIZE(sector)) > (from() + _end))) {
+            // Still being written
+            break;
+        }
+
+        if (isSkipped(_checkpointed)) {
+            // Already recorded
+            continue;
+        }
+
+        if (sectorCRC(_checkpointed) == _manifest->crc[_checkpointed]) {
+            success &= _checkpoint->write16(_checkpoint->from() + CHECKPOINT_MARKS + (_checkpointed * sizeof(uint16_t)), CHECKPOINT_DONE);
+        }
+    }
+
+    return success;
+} // record
+
+std::size_t
+ProgramStorage::skippedBytes(
+    Address     address,
+    std::size_t size
+) const
+{
+    if (!_differential) {
+        return 0;
+    }
+
+    Sector      first   = FLASH_ADDRESS_SECTOR(from());
+    Address     end     = address + size;
+    std::size_t skipped = 0;
+
+    while (address < end) {
+        Sector  sector = FLASH_ADDRESS_SECTOR(address);
+        Address next   = std::min(static_cast<Address>(FLASH_SECTOR_ADDRESS(sector) + FLASH_SECTOR_SIZE(sector)), end);
+        std::size_t i  = sector - first;
+
+        if (isSkipped(i)) {
+            skipped += next - address;
+        }
+
+        address = next;
+    }
+
+    return skipped;
+} // skippedBytes
+
+bool
+ProgramStorage::writeDifferential(
+    Address     address,
+    const void* data,
+    std::size_t size
+)
+{
+    const uint8_t* bytes   = reinterpret_cast<const uint8_t*>(data);
+    Address        end     = address + size;
+    bool           success = true;
+
+    // Sector by sector
+    while (success && (address < end)) {
+        Sector  sector = FLASH_ADDRESS_SECTOR(address);
+        Address next   = std::min(static_cast<Address>(FLASH_SECTOR_ADDRESS(sector) + FLASH_SECTOR_SIZE(sector)), end);
+
+        if (skippedBytes(address, next - address) == 0) {
+            success &= _storage.write(address, bytes, next - address);
+        }
+
+        bytes  += next - address;
+        address = next;
+    }
+
+    return success;
+} // writeDifferential
+
+std::size_t
+ProgramStorage::sectors() const
+{
+    return FLASH_ADDRESS_SECTOR(to() - 1) - FLASH_ADDRESS_SECTOR(from()) + 1;
+}
+
+std::size_t
+ProgramStorage::manifestSectors(
+    const ImageManifest& manifest
+) const
+{
+    return std::min(std::min(static_cast<std::size_t>(manifest.sectors), sectors()), static_cast<std::size_t>(CORE_STM32_FLASH_MANIFEST_SECTORS));
+}
+
+uint32_t
+ProgramStorage::sectorCRC(
+    std::size_t index
+)
+{
+    Sector sector = FLASH_ADDRESS_SECTOR(from()) + index;
+
+    core::stm32_crc::CRC::init();
+    core::stm32_crc::CRC::setPolynomialSize(core::stm32_crc::CRC::PolynomialSize::POLY_32);
+    core::stm32_crc::CRC::CRCBlock((uint32_t*)FLASH_SECTOR_ADDRESS(sector), FLASH_SECTOR_SIZE(sector) / sizeof(uint32_t));
+
+    return core::stm32_crc::CRC::getCRC();
+}
+
+bool
+ProgramStorage::buildManifest(
+    ImageManifest& manifest
+)
+{
+    if (sectors() > CORE_STM32_FLASH_MANIFEST_SECTORS) {
+        return false;
+    }
+
+    manifest.sectors = sectors();
+
+    for (std::size_t i = 0; i < manifest.sectors; i++) {
+        manifest.crc[i] = sectorCRC(i);
+    }
+
+    return true;
+}
+
+bool
+ProgramStorage::verify()
+{
+    uint32_t expected = _crc;
+
+    return updateCRC(_end) == expected;
+}
+
+void
+ProgramStorage::track(
+    Address     address,
+    const void* data,
+    std::size_t size
+)
+{
+    Address offset = address - from();
+
+    _end = std::max(_end, static_cast<std::size_t>(offset + size));
+
+    if (!_runningCRCValid) {
+        return;
+    }
+
+    if (offset < _runningCRC.size()) {
+        _runningCRCValid = false;
+        return;
+    }
+
+    if (_differential) {
+        // The skipped sectors may not be sent again: a gap is read back, it is erased or already programmed
+        _runningCRC.update(reinterpret_cast<const void*>(from() + _runningCRC.size()), offset - _runningCRC.size());
+    } else {
+        // A gap is still erased
+        _runningCRC.updateErased(offset - _runningCRC.size());
+    }
+
+    _runningCRC.update(data, size);
+}
+
+bool
+ProgramStorage::prepare(
+    Address     address,
+    std::size_t size
+)
+{
+    if (!_lazy || !_storage.isRangeValid(address, size)) {
+        // Let the write fail
+        return true;
+    }
+
+    bool success = true;
+
+    waitErase();
+
+    while (success && (_erasedTo < (address + size))) {
+        success  &= _storage.eraseSectorAt(_erasedTo);
+        _erasedTo = FLASH_SECTOR_ADDRESS(FLASH_ADDRESS_SECTOR(_erasedTo) + 1);
+    }
+
+    // Only the sector right after the write head
+    bool ahead = FLASH_ADDRESS_SECTOR(_erasedTo) == (FLASH_ADDRESS_SECTOR(address + size - 1) + 1);
+
+    if (success && ahead && (_erasedTo < _eraseAheadTo)) {
+        _erasing = true;
+
+        if (!_storage.eraseSectorAsync(FLASH_ADDRESS_SECTOR(_erasedTo), erased, this)) {
+            // Busy, it will be erased when written
+            _erasing = false;
+        }
+    }
 
     return success;
+} // prepare
+
+bool
+ProgramStorage::isPrepared(
+    Address     address,
+    std::size_t size
+) const
+{
+    if (!_lazy) {
+        return true;
+    }
+
+    // The erase ahead is due when the range reaches the last sector erased
+    bool ahead = !_erasing && (_erasedTo < _eraseAheadTo) && (FLASH_ADDRESS_SECTOR(_erasedTo) == (FLASH_ADDRESS_SECTOR(address + size - 1) + 1));
+
+    return ((address + size) <= _erasedTo) && !ahead;
+}
+
+void
+ProgramStorage::erased(
+    FlashSegment& segment,
+    bool          success,
+    void*         arg
+)
+{
+    (void)segment;
+
+    ProgramStorage* program = reinterpret_cast<ProgramStorage*>(arg);
+
+    if (success) {
+        program->_erasedTo = FLASH_SECTOR_ADDRESS(FLASH_ADDRESS_SECTOR(program->_erasedTo) + 1);
+    }
+
+    program->_erasing = false;
+
+    Deferred deferred = program->_deferred;
+
+    program->_deferred.callback = nullptr;
+
+    if ((deferred.callback != nullptr) && !program->_storage.writeAsyncI(deferred.address, deferred.data, deferred.size, deferred.callback, deferred.arg)) {
+        deferred.callback(program->_storage, false, deferred.arg);
+    }
+
+    osalThreadResumeI(&program->_waiter, MSG_OK);
+} // erased
+
+bool
+ProgramStorage::deferI(
+    Address                address,
+    const void*            data,
+    std::size_t            size,
+    FlashSegment::Callback callback,
+    void*                  arg
+)
+{
+    if (_deferred.callback != nullptr) {
+        return false;
+    }
+
+    _deferred.address  = address;
+    _deferred.data     = data;
+    _deferred.size     = size;
+    _deferred.callback = callback;
+    _deferred.arg      = arg;
+
+    return true;
+}
+
+void
+ProgramStorage::waitErase()
+{
+    osalSysLock();
+
+    while (_erasing) {
+        osalThreadSuspendS(&_waiter);
+    }
+
+    osalSysUnlock();
 }
 
 bool
@@ -0,0 +1,227 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#include <core/stm32_flash/ProgramStreamWriter.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(STM32F303xx)
+    #include <core/stm32_flash/stm32f30x.hpp>
+#elif defined(STM32F091xC)
+    #include <core/stm32_flash/stm32f0xx.hpp>
+#elif defined(STM32F407xx) || defined(STM32F417xx)
+    #include <core/stm32_flash/stm32f4xx.hpp>
+#else
+    #error "Chip not supported"
+#endif
+
+namespace core {
+namespace stm32_flash {
+static const std::size_t BUFFERS     = CORE_STM32_FLASH_STREAM_BUFFERS;
+static const std::size_t BUFFER_SIZE = CORE_STM32_FLASH_STREAM_BUFFER_SIZE;
+
+ProgramStreamWriter::ProgramStreamWriter(
+    ProgramStorage& program
+) : _program(program), _address(0), _next(0), _buffers(), _sizes(), _oldest(0), _sent(0), _block(0), _full(0), _filled(0), _busy(false), _failed(false), _received(0), _programmed(0), _waiter(nullptr) {}
+
+bool
+ProgramStreamWriter::begin(
+    Address address
+)
+{
+    if (!_program.isReady() || ((address % 4) != 0) || _busy) {
+        return false;
+    }
+
+    _address    = address;
+    _next       = address;
+    _oldest     = 0;
+    _sent       = 0;
+    _full       = 0;
+    _filled     = 0;
+    _failed     = false;
+    _received   = 0;
+    _programmed = 0;
+
+    return true;
+}
+
+std::size_t
+ProgramStreamWriter::available() const
+{
+    osalSysLock();
+
+    std::size_t free = (BUFFERS - _full) * BUFFER_SIZE - _filled;
+
+    osalSysUnlock();
+
+    return free;
+}
+
+std::size_t
+ProgramStreamWriter::push(
+    const void* data,
+    std::size_t size
+)
+{
+    const uint8_t* bytes    = reinterpret_cast<const uint8_t*>(data);
+    std::size_t    accepted = 0;
+
+    while ((accepted < size) && !_failed) {
+        osalSysLock();
+
+        // The interrupt moves _oldest and _full together: the buffer being filled does not change
+        bool        room   = _full < BUFFERS;
+        std::size_t buffer = (_oldest + _full) % BUFFERS;
+
+        osalSysUnlock();
+
+        if (!room) {
+            break;
+        }
+
+        std::size_t n = std::min(BUFFER_SIZE - _filled, size - accepted);
+
+        std::memcpy(&_buffers[buffer][_filled], bytes + accepted, n);
+        _filled  += n;
+        accepted += n;
+
+        if ((_filled == BUFFER_SIZE) && prepare()) {
+            osalSysLock();
+            submitS();
+            osalSysUnlock();
+        }
+    }
+
+    _received += accepted;
+
+    return accepted;
+} // push
+
+bool
+ProgramStreamWriter::finish()
+{
+    osalSysLock();
+
+    if ((_filled != 0) && (_full < BUFFERS) && !_failed) {
+        std::size_t buffer = (_oldest + _full) % BUFFERS;
+        std::size_t padded = (_filled + 3) & ~static_cast<std::size_t>(3);
+
+        osalSysUnlock();
+
+        std::memset(&_buffers[buffer][_filled], 0xFF, padded - _filled);
+        _filled = padded;
+
+        bool prepared = prepare();
+
+        osalSysLock();
+
+        if (prepared) {
+            submitS();
+        }
+    }
+
+    while (_busy) {
+        osalThreadSuspendS(&_waiter);
+    }
+
+    bool success = !_failed && (_filled == 0) && (_full == 0);
+
+    osalSysUnlock();
+
+    return success;
+} // finish
+
+bool
+ProgramStreamWriter::prepare()
+{
+    if (_program.isPrepared(_next, _filled)) {
+        return true;
+    }
+
+    // No erase while the previous buffers are being programmed, the erase ahead would be rejected
+    osalSysLock();
+
+    while (_busy) {
+        osalThreadSuspendS(&_waiter);
+    }
+
+    osalSysUnlock();
+
+    if (!_failed && !_program.prepare(_next, _filled)) {
+        _failed = true;
+    }
+
+    return !_failed;
+} // prepare
+
+void
+ProgramStreamWriter::submitS()
+{
+    _sizes[(_oldest + _full) % BUFFERS] = _filled;
+    _full++;
+    _next  += _filled;
+    _filled = 0;
+
+    if (!_busy) {
+        startI();
+    }
+}
+
+void
+ProgramStreamWriter::startI()
+{
+    if ((_full == 0) || _failed) {
+        _busy = false;
+        osalThreadResumeI(&_waiter, MSG_OK);
+        return;
+    }
+
+    // Up to the end of the sector
+    Sector  sector = FLASH_ADDRESS_SECTOR(_address);
+    Address end    = FLASH_SECTOR_ADDRESS(sector) + FLASH_SECTOR_SIZE(sector);
+
+    _busy  = true;
+    _block = std::min(_sizes[_oldest] - _sent, static_cast<std::size_t>(end - _address));
+
+    if (!_program.writeAsyncI(_address, &_buffers[_oldest][_sent], _block, done, this)) {
+        _failed = true;
+        _busy   = false;
+        osalThreadResumeI(&_waiter, MSG_OK);
+    }
+}
+
+void
+ProgramStreamWriter::done(
+    FlashSegment& segment,
+    bool          success,
+    void*         arg
+)
+{
+    (void)segment;
+
+    ProgramStreamWriter* writer = reinterpret_cast<ProgramStreamWriter*>(arg);
+
+    writer->_address    += writer->_block;
+    writer->_programmed += writer->_block;
+    writer->_sent       += writer->_block;
+
+    if (writer->_sent == writer->_sizes[writer->_oldest]) {
+        writer->_oldest = (writer->_oldest + 1) % BUFFERS;
+        writer->_sent   = 0;
+        writer->_full--;
+    }
+
+    if (!success) {
+        writer->_failed = true;
+    }
+
+    // Chain the rest of the buffer, or the next one if already full
+    writer->startI();
+}
+}
+}
@@ -9,93 +9,191 @@
 #include <core/stm32_crc/CRC.hpp>
 
 #include <algorithm>
+#include <cstring>
 
 namespace core {
 namespace stm32_flash {
+// The flash operations run under _mutex, only the bank pointers update is done
+// in a critical section. Its length is tracked in the statistics.
+static inline uint32_t
+enterCritical()
+{
+    osalSysLock();
+
+#if defined(PORT_SUPPORTS_RT) && (PORT_SUPPORTS_RT == TRUE)
+    return chSysGetRealtimeCounterX();
+#else
+    return 0;
+#endif
+}
+
+static inline void
+leaveCritical(
+    uint32_t  start,
+    uint32_t& longest
+)
+{
+#if defined(PORT_SUPPORTS_RT) && (PORT_SUPPORTS_RT == TRUE)
+    uint32_t elapsed = chSysGetRealtimeCounterX() - start;
+
+    if (elapsed > longest) {
+        longest = elapsed;
+    }
+#else
+    (void)start;
+    (void)longest;
+#endif
+
+    osalSysUnlock();
+}
+
 Storage::Storage(
     FlashSegment& bank1,
-    FlashSegment& bank2
-) : _bank1(bank1), _bank2(bank2), _cnt(0xFFFF), _readBank(nullptr), _writeBank(nullptr), _head(0), _writeReady(false), _bankSize(0)
-{
-    uint16_t cnt1       = _bank1.read16_offset(CNT_OFFSET);
-    uint16_t cnt2       = _bank2.read16_offset(CNT_OFFSET);
-    uint32_t crc1       = _bank1.read32_offset(CRC_OFFSET);
-    uint32_t crc2       = _bank2.read32_offset(CRC_OFFSET);
-    bool     bank1Valid = false;
-    bool     bank2Valid = false;
-
-    if (cnt1 != 0xFFFF) {
-        if (crc1 == getBankCRC(_bank1)) {
-            bank1Valid = true;
-        }
+    FlashSegment& bank2,
+    std::size_t   slotSize
+) : _banks(), _bankCount(2), _cnt(0xFFFF), _readBank(nullptr), _writeBank(&bank1), _readSlot(0), _writeSlot(0), _writeReady(false), _bankSize(0), _slotSize(0), _wholeBank(nullptr), _statistics(), _runningCRC(), _runningCRCValid(false), _used(0)
+{
+    _banks[0] = &bank1;
+    _banks[1] = &bank2;
+
+    init(slotSize);
+}
+
+Storage::Storage(
+    FlashSegment* banks,
+    std::size_t   count,
+    std::size_t   slotSize
+) : _banks(), _bankCount(std::min(count, MAX_BANKS)), _cnt(0xFFFF), _readBank(nullptr), _writeBank(&banks[0]), _readSlot(0), _writeSlot(0), _writeReady(false), _bankSize(0), _slotSize(0), _wholeBank(nullptr), _statistics(), _runningCRC(), _runningCRCValid(false), _used(0)
+{
+    for (std::size_t i = 0; i < _bankCount; i++) {
+        _banks[i] = &banks[i];
+    }
+
+    init(slotSize);
+}
+
+void
+Storage::init(
+    std::size_t slotSize
+)
+{
+    osalMutexObjectInit(&_mutex);
+
+    _bankSize = _banks[0]->size();
+
+    for (std::size_t i = 1; i < _bankCount; i++) {
+        _bankSize = std::min(_bankSize, _banks[i]->size());
     }
 
-    if (cnt2 != 0xFFFF) {
-        if (crc2 == getBankCRC(_bank2)) {
-            bank2Valid = true;
+    if ((slotSize >= (DATA_OFFSET + LENGTH_UNIT)) && (slotSize < _bankSize)) {
+        _slotSize = slotSize - (slotSize % LENGTH_UNIT);
+    }
+
+    // Look for the newest valid slot: the counters are checked first, the CRC
+    // is computed only for the best candidate(s).
+    // Corrupt counters may not be ordered (isNewer() is not transitive): the
+    // candidates are taken by age behind the newest counter, then by position,
+    // so that each slot is checked at most once.
+    uint16_t newest = 0xFFFF;
+
+    for (std::size_t i = 0; i < _bankCount; i++) {
+        FlashSegment* candidate = _banks[i];
+
+        for (Address offset = 0; (offset + getSlotSize(*candidate)) <= candidate->size(); offset += getSlotSize(*candidate)) {
+            uint16_t tmp = candidate->read16_offset(offset + CNT_OFFSET);
+
+            if ((tmp != 0xFFFF) && ((newest == 0xFFFF) || isNewer(tmp, newest))) {
+                newest = tmp;
+            }
         }
     }
 
-    if (bank1Valid && bank2Valid) {
-        // Both banks are valid, choose the newest
-        if (cnt1 > cnt2) {
-            _cnt       = cnt1;
-            _head      = _bank1.from() + DATA_OFFSET;
-            _readBank  = &_bank1;
-            _writeBank = &_bank2;
-        } else if (cnt2 > cnt1) {
-            _cnt       = cnt2;
-            _head      = _bank2.from() + DATA_OFFSET;
-            _readBank  = &_bank2;
-            _writeBank = &_bank1;
-        } else {
-            // This case is not possible, but handle it anyway...
-            bank1Valid = false;
-            bank2Valid = false;
+    bool        rejected      = false;
+    uint32_t    rejectedAge   = 0;
+    std::size_t rejectedIndex = 0;
+
+    while ((newest != 0xFFFF) && (_readBank == nullptr)) {
+        FlashSegment* bank  = nullptr;
+        Address       slot  = 0;
+        uint16_t      cnt   = 0;
+        uint32_t      age   = 0;
+        std::size_t   index = 0;
+        std::size_t   n     = 0;
+
+        for (std::size_t i = 0; i < _bankCount; i++) {
+            FlashSegment* candidate = _banks[i];
+
+            for (Address offset = 0; (offset + getSlotSize(*candidate)) <= candidate->size(); offset += getSlotSize(*candidate), n++) {
+                uint16_t tmp      = candidate->read16_offset(offset + CNT_OFFSET);
+                uint32_t distance = (static_cast<uint32_t>(newest) + 0xFFFF - tmp) % 0xFFFF;
+
+                if ((tmp == 0xFFFF) || (rejected && ((distance < rejectedAge) || ((distance == rejectedAge) && (n <= rejectedIndex))))) {
+                    continue;
+                }
+
+                if ((bank == nullptr) || (distance < age)) {
+                    bank  = candidate;
+                    slot  = offset;
+                    cnt   = tmp;
+                    age   = distance;
+                    index = n;
+                }
+            }
         }
-    } else {
-        if (bank1Valid) {
-            // only bank1 is valid, lets erase bank2, and set it as write bank
-            _cnt       = cnt1;
-            _readBank  = &_bank1;
-            _writeBank = &_bank2;
-        } else if (bank2Valid) {
-            // only bank2 is valid, lets erase bank1, and set it as write bank
-            _cnt       = cnt2;
-            _readBank  = &_bank2;
-            _writeBank = &_bank1;
-        } else {
+
+        if (bank == nullptr) {
             // We have no valid read bank.
-            // See below
+            break;
         }
-    }
 
-    if (!(bank1Valid || bank2Valid)) {
-        // We have no valid read bank.
-        // set bank1  as write bank
-        _cnt       = 0xFFFF;
-        _writeBank = &_bank1;
-        _readBank  = nullptr;
-    }
+        bool valid = bank->read32_offset(slot + CRC_OFFSET) == getSlotCRC(*bank, slot);
 
-    _bankSize = std::min(_bank1.size(), _bank2.size());
-}
+        if (!valid && (_slotSize != 0) && (slot == 0)) {
+            // Maybe written with one generation per bank
+            _wholeBank = bank;
+            valid      = bank->read32_offset(CRC_OFFSET) == getSlotCRC(*bank, 0);
+
+            if (!valid) {
+                _wholeBank = nullptr;
+            }
+        }
+
+        if (valid) {
+            _cnt       = cnt;
+            _readBank  = bank;
+            _readSlot  = slot;
+            _writeBank = nextBank(bank);
+        } else {
+            rejected      = true;
+            rejectedAge   = age;
+            rejectedIndex = index;
+        }
+    }
+} // init
 
 bool
 Storage::erase()
 {
     bool success = true;
 
-    success &= _bank1.erase();
-    success &= _bank2.erase();
+    osalMutexLock(&_mutex);
 
-    osalSysLock();
+    for (std::size_t i = 0; i < _bankCount; i++) {
+        success &= _banks[i]->erase();
+    }
+
+    uint32_t start = enterCritical();
 
     _cnt       = 0xFFFF;
     _readBank  = nullptr;
-    _writeBank = &_bank1;
+    _readSlot  = 0;
+    _writeBank = _banks[0];
+    _writeSlot = 0;
+    _wholeBank = nullptr;
 
-    osalSysUnlock();
+    leaveCritical(start, _statistics.erase);
+
+    osalMutexUnlock(&_mutex);
 
     return success;
 }
@@ -103,64 +201,117 @@ Storage::erase()
 bool
 Storage::format()
 {
-    osalSysLock();
+    osalMutexLock(&_mutex);
 
     if (_writeReady) {
-        osalSysUnlock();
+        osalMutexUnlock(&_mutex);
         return false;
     }
 
-    // write bank is always defined
-    _writeBank->unlock();
-    _writeReady = _writeBank->erase();
+    FlashSegment* bank  = nullptr;
+    Address       slot  = 0;
+    bool          ready = true;
+
+    // The next free slot after the current one, in the same bank
+    if (_readBank != nullptr) {
+        for (Address offset = _readSlot + getSlotSize(*_readBank); (offset + getSlotSize(*_readBank)) <= _readBank->size(); offset += getSlotSize(*_readBank)) {
+            if (isSlotBlank(*_readBank, offset)) {
+                bank = _readBank;
+                slot = offset;
+                break;
+            }
+        }
+    }
 
-    osalSysUnlock();
+    if (bank == nullptr) {
+        // No slot left, move to the next bank of the ring
+        bank = nextBank(_readBank);
+        slot = 0;
 
-    return _writeReady;
-}
+        bank->unlock();
+        ready = bank->erase();
+
+        if (bank == _wholeBank) {
+            _wholeBank = nullptr;
+        }
+    } else {
+        bank->unlock();
+    }
+
+    _runningCRC.reset();
+    _runningCRCValid = true;
+    _used = 0;
+
+    uint32_t start = enterCritical();
+
+    _writeBank  = bank;
+    _writeSlot  = slot;
+    _writeReady = ready;
+
+    leaveCritical(start, _statistics.format);
+
+    osalMutexUnlock(&_mutex);
+
+    return ready;
+} // format
 
 bool
 Storage::commit()
 {
-    osalSysLock();
+    osalMutexLock(&_mutex);
 
     if (!_writeReady) {
-        osalSysUnlock();
+        osalMutexUnlock(&_mutex);
         return false;
     }
 
-    _writeReady = false;
+    uint16_t cnt = _cnt + 1;
+
+    if (cnt == 0xFFFF) {
+        cnt = 0;
+    }
 
-    _cnt++;
+    std::size_t dataSize = getSlotSize(*_writeBank) - DATA_OFFSET;
+    std::size_t length   = (_used + LENGTH_UNIT - 1) / LENGTH_UNIT;
+    std::size_t payload  = length * LENGTH_UNIT;
 
-    if (_cnt == 0xFFFF) {
-        _cnt = 0;
+    if ((length >= FORMAT_LENGTH_FULL) || (payload > dataSize)) {
+        length  = FORMAT_LENGTH_FULL;
+        payload = dataSize;
     }
 
     bool success = true;
 
-    // write bank is always defined
-    success &= _writeBank->write16_offset(CNT_OFFSET, _cnt);
-    success &= _writeBank->write32_offset(CRC_OFFSET, getBankCRC(*_writeBank));
+    // The format must be written before the counter, that validates the slot
+    success &= _writeBank->write16_offset(_writeSlot + FORMAT_OFFSET, (FORMAT_VERSION << 12) | length);
+
+    uint32_t crc;
+
+    if (_runningCRCValid && (_runningCRC.size() <= payload)) {
+        // The rest of the payload is still erased, no need to read it back
+        _runningCRC.updateErased(payload - _runningCRC.size());
+        crc = _runningCRC.value();
+    } else {
+        crc = getSlotCRC(*_writeBank, _writeSlot);
+    }
+
+    _runningCRCValid = false;
+
+    success &= _writeBank->write16_offset(_writeSlot + CNT_OFFSET, cnt);
+    success &= _writeBank->write32_offset(_writeSlot + CRC_OFFSET, crc);
 
     _writeBank->lock();
 
-    // Swap the 2 banks
-    FlashSegment* tmp = _readBank;
+    uint32_t start = enterCritical();
 
-    if (tmp == nullptr) {
-        // It was invalid. We cannot assign it to write...
-        if (_writeBank == &_bank1) {
-            tmp = &_bank2;
-        } else {
-            tmp = &_bank1;
-        }
-    }
+    _writeReady = false;
+    _cnt        = cnt;
+    _readBank   = _writeBank;
+    _readSlot   = _writeSlot;
 
-    _readBank  = _writeBank;
-    _writeBank = tmp;
+    leaveCritical(start, _statistics.commit);
 
-    osalSysUnlock();
+    osalMutexUnlock(&_mutex);
 
     return success;
 } // commit
@@ -177,6 +328,16 @@ Storage::isValid() const
     return valid;
 }
 
+void
+Storage::resetStatistics()
+{
+    osalMutexLock(&_mutex);
+
+    _statistics = Statistics();
+
+    osalMutexUnlock(&_mutex);
+}
+
 bool
 Storage::lock()
 {
@@ -189,18 +350,159 @@ Storage::unlock()
     return _writeBank->unlock();
 }
 
+FlashSegment*
+Storage::nextBank(
+    const FlashSegment* bank
+) const
+{
+    for (std::size_t i = 0; i < _bankCount; i++) {
+        if (_banks[i] == bank) {
+            return _banks[(i + 1) % _bankCount];
+        }
+    }
+
+    return _banks[0];
+}
+
 uint32_t
-Storage::getBankCRC(
-    FlashSegment& bank
+Storage::getSlotCRC(
+    FlashSegment& bank,
+    Address       slot
 )
 {
-    if (((bank.size() - DATA_OFFSET) % 4) != 0) {
+    std::size_t payload = getPayloadSize(bank, slot);
+
+    if ((payload % 4) != 0) {
         chSysHalt("Data size not multiple of 4");
     }
 
     core::stm32_crc::CRC::init();
     core::stm32_crc::CRC::setPolynomialSize(core::stm32_crc::CRC::PolynomialSize::POLY_32);
-    return core::stm32_crc::CRC::CRCBlock(reinterpret_cast<uint32_t*>(bank.from() + DATA_OFFSET), (bank.size() - DATA_OFFSET) / sizeof(uint32_t));
+    return core::stm32_crc::CRC::CRCBlock(reinterpret_cast<uint32_t*>(bank.from() + slot + DATA_OFFSET), payload / sizeof(uint32_t));
+}
+
+std::size_t
+Storage::getPayloadSize(
+    const FlashSegment& bank,
+    Address             slot
+) const
+{
+    uint16_t    format   = *reinterpret_cast<const uint16_t*>(bank.from() + slot + FORMAT_OFFSET);
+    std::size_t dataSize = getSlotSize(bank) - DATA_OFFSET;
+
+    if ((format >> 12) == FORMAT_VERSION) {
+        std::size_t length = format & FORMAT_LENGTH_FULL;
+
+        if ((length != FORMAT_LENGTH_FULL) && ((length * LENGTH_UNIT) <= dataSize)) {
+            return length * LENGTH_UNIT;
+        }
+    }
+
+    // Legacy format
+    return dataSize;
+}
+
+bool
+Storage::isSlotBlank(
+    const FlashSegment& bank,
+    Address             slot
+) const
+{
+    const uint32_t* word = reinterpret_cast<const uint32_t*>(bank.from() + slot);
+    const uint32_t* end  = reinterpret_cast<const uint32_t*>(bank.from() + slot + getSlotSize(bank));
+
+    while (word < end) {
+        if (*word++ != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::size_t
+Storage::usedSize() const
+{
+    osalSysLock();
+
+    FlashSegment* bank = _readBank;
+    Address       slot = _readSlot;
+
+    osalSysUnlock();
+
+    if (bank == nullptr) {
+        return 0;
+    }
+
+    return std::min(getPayloadSize(*bank, slot), size());
+}
+
+bool
+Storage::append(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    bool success = false;
+
+    osalMutexLock(&_mutex);
+
+    // Not while a new generation is being written, it owns the bank lock
+    if ((_readBank != nullptr) && !_writeReady && (offset >= getPayloadSize(*_readBank, _readSlot)) && isRangeValid(offset, size)) {
+        _readBank->unlock();
+        success = _readBank->write_offset(_readSlot + DATA_OFFSET + offset, data, size);
+        _readBank->lock();
+    }
+
+    osalMutexUnlock(&_mutex);
+
+    return success;
+}
+
+bool
+Storage::matches(
+    Address     offset,
+    const void* data,
+    std::size_t size
+) const
+{
+    osalSysLock();
+
+    FlashSegment* bank = _readBank;
+    Address       slot = _readSlot;
+
+    osalSysUnlock();
+
+    if ((bank == nullptr) || !isRangeValid(offset, size)) {
+        return false;
+    }
+
+    // Past the payload the slot is erased, as the new data would be (appended
+    // bytes just make the comparison fail)
+    return std::memcmp(reinterpret_cast<const void*>(bank->from() + slot + DATA_OFFSET + offset), data, size) == 0;
+}
+
+void
+Storage::trackWrite(
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    _used = std::max(_used, static_cast<std::size_t>(offset + size));
+
+    if (!_runningCRCValid) {
+        return;
+    }
+
+    if (offset < _runningCRC.size()) {
+        _runningCRCValid = false;
+        return;
+    }
+
+    _runningCRC.updateErased(offset - _runningCRC.size());
+    _runningCRC.update(data, size);
 }
 }
 }
@@ -0,0 +1,291 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+#if defined(CORE_STM32_FLASH_SIMULATED)
+
+#include <core/stm32_flash/simulated_flash.hpp>
+#include <osal.h>
+
+#include <cstring>
+#include <sys/mman.h>
+
+namespace core {
+namespace stm32_flash {
+namespace simulated {
+static uint8_t*     _memory = nullptr;
+static bool         _locked = true;
+static FLASH_Status _status = FLASH_COMPLETE;
+static Statistics   _statistics;
+static uint32_t     _sectorErases[FLASH_NUMBER_OF_PAGES];
+static bool         _hold = false;
+static void         (* _pending)() = nullptr;
+
+static bool
+isProgramAddress(
+    uint32_t    address,
+    std::size_t size
+)
+{
+    return (address >= FLASH_BASE_ADDRESS) && (address - FLASH_BASE_ADDRESS + size <= FLASH_TOTAL_SIZE());
+}
+
+static FLASH_Status
+fail(
+    FLASH_Status status
+)
+{
+    _statistics.errors++;
+    _status = status;
+    return status;
+}
+
+static FLASH_Status
+program(
+    uint32_t address,
+    uint16_t data
+)
+{
+    if (!init()) {
+        return fail(FLASH_ERROR_OPERATION);
+    }
+
+    if (_locked) {
+        return fail(FLASH_ERROR_WRP);
+    }
+
+    if (!isProgramAddress(address, sizeof(data))) {
+        return fail(FLASH_ERROR_PROGRAM);
+    }
+
+    if ((address % sizeof(data)) != 0) {
+        return fail(FLASH_ERROR_PGA);
+    }
+
+    uint16_t* cell = reinterpret_cast<uint16_t*>(_memory + (address - FLASH_BASE_ADDRESS));
+
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    // The controller refuses to program a half-word that is not blank, unless the data is 0x0000
+    if ((*cell != 0xFFFF) && (data != 0x0000)) {
+        return fail(FLASH_ERROR_PROGRAM);
+    }
+#endif
+
+    // Programming can only clear bits
+    *cell &= data;
+
+    _status = FLASH_COMPLETE;
+    return _status;
+} // program
+
+bool
+init()
+{
+    if (_memory != nullptr) {
+        return true;
+    }
+
+    void* memory = mmap(reinterpret_cast<void*>(FLASH_BASE_ADDRESS), FLASH_TOTAL_SIZE(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (memory != reinterpret_cast<void*>(FLASH_BASE_ADDRESS)) {
+        if (memory != MAP_FAILED) {
+            munmap(memory, FLASH_TOTAL_SIZE());
+        }
+
+        return false;
+    }
+
+    _memory = reinterpret_cast<uint8_t*>(memory);
+
+    reset();
+
+    return true;
+} // init
+
+void
+reset()
+{
+    if (_memory != nullptr) {
+        std::memset(_memory, 0xFF, FLASH_TOTAL_SIZE());
+    }
+
+    _locked  = true;
+    _status  = FLASH_COMPLETE;
+    _hold    = false;
+    _pending = nullptr;
+
+    resetStatistics();
+}
+
+const Statistics&
+statistics()
+{
+    return _statistics;
+}
+
+void
+resetStatistics()
+{
+    _statistics = Statistics();
+    std::memset(_sectorErases, 0, sizeof(_sectorErases));
+}
+
+uint32_t
+sectorErases(
+    std::size_t sector
+)
+{
+    return sector < FLASH_NUMBER_OF_PAGES ? _sectorErases[sector] : 0;
+}
+
+void
+holdInterrupt(
+    bool hold
+)
+{
+    _hold = hold;
+}
+
+bool
+serveInterrupt()
+{
+    osalSysLock();
+
+    void (* handler)() = _pending;
+
+    _pending = nullptr;
+
+    if (handler != nullptr) {
+        handler();
+    }
+
+    osalSysUnlock();
+
+    return handler != nullptr;
+}
+
+void
+raiseInterrupt(
+    void (* handler)()
+)
+{
+    // Called with the system lock held
+    if (_hold) {
+        _pending = handler;
+    } else {
+        handler();
+    }
+}
+}
+}
+}
+
+using namespace core::stm32_flash;
+
+void
+FLASH_Unlock(
+    void
+)
+{
+    simulated::_locked = false;
+}
+
+void
+FLASH_Lock(
+    void
+)
+{
+    simulated::_locked = true;
+}
+
+FLASH_Status
+FLASH_ErasePage(
+    uint32_t Page_Address
+)
+{
+    if (!simulated::init()) {
+        return simulated::fail(FLASH_ERROR_OPERATION);
+    }
+
+    if (simulated::_locked) {
+        return simulated::fail(FLASH_ERROR_WRP);
+    }
+
+    std::size_t sector = FLASH_ADDRESS_SECTOR(Page_Address);
+
+    if ((sector >= FLASH_NUMBER_OF_PAGES) || (FLASH_SECTOR_ADDRESS(sector) != Page_Address)) {
+        return simulated::fail(FLASH_ERROR_OPERATION);
+    }
+
+    std::memset(simulated::_memory + FLASH_SECTOR_OFFSET(sector), 0xFF, FLASH_SECTOR_SIZE(sector));
+
+    simulated::_sectorErases[sector]++;
+    simulated::_statistics.erases++;
+    simulated::_statistics.time += simulated::FLASH_ERASE_TIME(sector);
+
+    simulated::_status = FLASH_COMPLETE;
+    return simulated::_status;
+} // FLASH_ErasePage
+
+FLASH_Status
+FLASH_ProgramWord(
+    uint32_t Address,
+    uint32_t Data
+)
+{
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    // Two half-word cycles, as done by the StdPeriph driver
+    FLASH_Status status = FLASH_ProgramHalfWord(Address, static_cast<uint16_t>(Data));
+
+    if (status == FLASH_COMPLETE) {
+        status = FLASH_ProgramHalfWord(Address + 2, static_cast<uint16_t>(Data >> 16));
+    }
+
+    return status;
+#else
+    if ((Address % sizeof(Data)) != 0) {
+        return simulated::fail(FLASH_ERROR_PGA);
+    }
+
+    FLASH_Status status = simulated::program(Address, static_cast<uint16_t>(Data));
+
+    if (status == FLASH_COMPLETE) {
+        status = simulated::program(Address + 2, static_cast<uint16_t>(Data >> 16));
+    }
+
+    if (status == FLASH_COMPLETE) {
+        simulated::_statistics.programs++;
+        simulated::_statistics.time += simulated::FLASH_PROGRAM_TIME();
+    }
+
+    return status;
+#endif // if defined(STM32F303xx) || defined(STM32F091xC)
+} // FLASH_ProgramWord
+
+FLASH_Status
+FLASH_ProgramHalfWord(
+    uint32_t Address,
+    uint16_t Data
+)
+{
+    FLASH_Status status = simulated::program(Address, Data);
+
+    if (status == FLASH_COMPLETE) {
+        simulated::_statistics.programs++;
+        simulated::_statistics.time += simulated::FLASH_PROGRAM_TIME();
+    }
+
+    return status;
+}
+
+FLASH_Status
+FLASH_GetStatus(
+    void
+)
+{
+    return (simulated::_pending != nullptr) ? FLASH_BUSY : simulated::_status;
+}
+
+#endif // if defined(CORE_STM32_FLASH_SIMULATED)
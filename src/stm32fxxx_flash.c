@@ -4,7 +4,9 @@
  * subject to the License Agreement located in the file LICENSE.
  */
 
-#if defined(STM32F303xx)
+#if defined(CORE_STM32_FLASH_SIMULATED)
+    // The flash is simulated in RAM, see simulated_flash.cpp
+#elif defined(STM32F303xx)
     #define assert_param(expr) ((void)0)
     #include "stm32f30x_flash.impl"
 #elif defined(STM32F091xC)
@@ -0,0 +1,164 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Write-behind: rate limited commits, coalesced updates, retried failures, other writers meanwhile
+//
+// The test waits for the flusher with wait(). The rate limit is checked with an
+// interval long enough never to elapse during the test.
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationFlusher.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <thread>
+
+using namespace core::stm32_flash;
+
+static const systime_t NEVER    = 3600 * 1000; // [ms]
+static const systime_t INTERVAL = 20;          // [ms]
+static const systime_t TIMEOUT  = 10000;       // [ms] Only reached if the flusher is stuck
+
+static uint8_t shadow[128];
+
+static uint32_t
+stored(
+    const ConfigurationStorage& configuration,
+    std::size_t                 index
+)
+{
+    return reinterpret_cast<const uint32_t*>(configuration.getUserConfiguration())[index];
+}
+
+static void
+post(
+    ConfigurationFlusher& flusher,
+    std::size_t           index,
+    uint32_t              value
+)
+{
+    // The queue drains into the shadow, even without a token
+    while (!flusher.post(index * sizeof(value), &value, sizeof(value))) {
+        std::this_thread::yield();
+    }
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment         bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment         bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    Storage              storage(bank1, bank2);
+    ConfigurationStorage configuration(storage);
+
+    CHECK(configuration.writeCanID(1));
+    configuration.setShadow(shadow, sizeof(shadow));
+
+    {
+        // A burst of 2 commits, no token afterwards
+        static ConfigurationFlusher flusher(configuration, NEVER, 2);
+
+        std::thread(ConfigurationFlusher::thread, &flusher).detach();
+
+        CHECK(flusher.wait(0));
+
+        post(flusher, 0, 100);
+        CHECK(flusher.wait(TIMEOUT));
+        CHECK(stored(configuration, 0) == 100);
+
+        post(flusher, 0, 101);
+        CHECK(flusher.wait(TIMEOUT));
+        CHECK(stored(configuration, 0) == 101);
+        CHECK(flusher.statistics().commits == 2);
+
+        // Rate limited: applied to the shadow, not committed
+        post(flusher, 0, 102);
+        CHECK(!flusher.wait(10 * INTERVAL));
+        CHECK(flusher.statistics().commits == 2);
+        CHECK(stored(configuration, 0) == 101);
+
+        // Coalesced with the next ones, committed at once by sync()
+        simulated::resetStatistics();
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            post(flusher, i % 30, i);
+        }
+
+        CHECK(flusher.sync());
+        CHECK(flusher.wait(0));
+        CHECK(flusher.statistics().commits == 3);
+        CHECK(simulated::statistics().erases == 1);
+        CHECK((flusher.statistics().posts - flusher.statistics().dropped) == (3 + 1000));
+
+        std::printf("1000 posts: 1 commit, %u dropped as the queue was full\n", flusher.statistics().dropped);
+    }
+
+    {
+        Storage              reopened(bank1, bank2);
+        ConfigurationStorage configuration(reopened);
+
+        for (uint32_t k = 0; k < 30; k++) {
+            CHECK(stored(configuration, k) == (999 - ((999 - k) % 30)));
+        }
+    }
+
+    static ConfigurationFlusher flusher(configuration, INTERVAL, 1);
+
+    std::thread(ConfigurationFlusher::thread, &flusher).detach();
+
+    // The commits fail while a transaction is open, they are retried with the next tokens
+    uint32_t value = 0xCAFEBABE;
+
+    CHECK(configuration.beginTransaction());
+
+    post(flusher, 0, value);
+
+    CHECK(!flusher.wait(TIMEOUT));
+    CHECK(flusher.statistics().failures >= 1);
+
+    uint32_t failures = flusher.statistics().failures;
+
+    CHECK(!flusher.wait(TIMEOUT));
+    CHECK(flusher.statistics().failures > failures);
+
+    configuration.abortTransaction();
+
+    CHECK(flusher.wait(TIMEOUT));
+    CHECK(!configuration.isDirty());
+    CHECK(stored(configuration, 0) == value);
+
+    // Other writers while the flusher runs: every change is kept
+    for (uint32_t i = 0; i < 200; i++) {
+        post(flusher, 1 + (i % 10), i);
+
+        if ((i % 20) == 0) {
+            CHECK(configuration.writeCanID(1000 + i));
+        }
+
+        if ((i % 50) == 0) {
+            CHECK(configuration.beginTransaction());
+            CHECK(configuration.setUserData(20 * sizeof(uint32_t), &i, sizeof(i)));
+            CHECK(configuration.commitTransaction());
+        }
+    }
+
+    CHECK(flusher.wait(TIMEOUT));
+    CHECK(configuration.getModuleConfiguration()->canID == 1180);
+    CHECK(stored(configuration, 0) == value);
+    CHECK(stored(configuration, 20) == 150);
+
+    for (uint32_t k = 0; k < 10; k++) {
+        CHECK(stored(configuration, 1 + k) == (190 + k));
+    }
+
+    std::printf("OK\n");
+    std::fflush(stdout);
+
+    // The flusher threads never return
+    std::_Exit(0);
+} // main
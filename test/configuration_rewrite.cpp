@@ -0,0 +1,95 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Rewriting the user data keeps the whole module configuration: the image still verifies
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t image[3000];
+
+//! The configuration still describes the installed image
+static void
+checkImage(
+    const ConfigurationStorage& configuration,
+    ProgramStorage&             program
+)
+{
+    const ModuleConfiguration* module = configuration.getModuleConfiguration();
+
+    CHECK(module->imageLength == sizeof(image));
+    CHECK(module->programSlot == ModuleConfiguration::PROGRAM_SLOT_B);
+    CHECK(module->canID == 42);
+    CHECK(program.updateCRC(module->imageLength) == module->imageCRC);
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment   bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment   bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    FlashSegment   segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    ProgramStorage program(segment);
+    uint8_t        user[40];
+
+    for (std::size_t i = 0; i < sizeof(image); i++) {
+        image[i] = static_cast<uint8_t>(test::random());
+    }
+
+    for (std::size_t i = 0; i < sizeof(user); i++) {
+        user[i] = static_cast<uint8_t>(i);
+    }
+
+    CHECK(program.beginWrite());
+    CHECK(program.write(PROGRAM_FLASH_FROM, image, sizeof(image)));
+    CHECK(program.endWrite());
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.writeCanID(42));
+        CHECK(configuration.writeProgramSlot(ModuleConfiguration::PROGRAM_SLOT_B, program.updateCRC(sizeof(image)), sizeof(image)));
+        checkImage(configuration, program);
+
+        // Whole user data rewrite
+        CHECK(configuration.beginWrite());
+        CHECK(configuration.writeUserData(0, user, sizeof(user)));
+        CHECK(configuration.endWrite());
+        checkImage(configuration, program);
+        CHECK(std::memcmp(configuration.getUserConfiguration(), user, sizeof(user)) == 0);
+
+        // Twice, the second one starting from the rewritten generation
+        CHECK(configuration.beginWrite());
+        CHECK(configuration.writeUserData32(0, 0x12345678));
+        CHECK(configuration.endWrite());
+        checkImage(configuration, program);
+
+        CHECK(configuration.eraseUserConfiguration());
+        checkImage(configuration, program);
+    }
+
+    {
+        // After reboot
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        checkImage(configuration, program);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,184 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A flush takes the dirty ranges from the RAM shadow and the rest from the current generation
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static const std::size_t USED  = 256; //!< User data stored, the 64 bytes chunk at 128 left erased
+static const std::size_t CHUNK = 64;  //!< Copy chunk of ConfigurationStorage::rewrite()
+
+static uint8_t shadow[2 * USED];
+static uint8_t expected[USED];
+
+static std::size_t
+units(
+    std::size_t size
+)
+{
+    return (size + FLASH_PROGRAM_UNIT - 1) / FLASH_PROGRAM_UNIT;
+}
+
+/*! \brief Program cycles of a new generation
+ *
+ * The module configuration, the user data chunks that are not erased, then the
+ * format, the counter and the CRC.
+ */
+static std::size_t
+generationPrograms(
+    std::size_t chunks
+)
+{
+    return units(offsetof(ModuleConfiguration, padding)) + (chunks * units(CHUNK)) + 2 + units(sizeof(uint32_t));
+}
+
+static bool
+stored(
+    const ConfigurationStorage& configuration
+)
+{
+    return std::memcmp(configuration.getUserConfiguration(), expected, sizeof(expected)) == 0;
+}
+
+//! Through the shadow, expected updated too
+static void
+change(
+    ConfigurationStorage& configuration,
+    Address               offset,
+    std::size_t           size,
+    uint8_t               value
+)
+{
+    uint8_t data[USED];
+
+    std::memset(data, value, size);
+    std::memset(expected + offset, value, size);
+
+    CHECK(configuration.writeShadow(offset, data, size));
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+
+    for (std::size_t i = 0; i < USED; i++) {
+        expected[i] = ((i / CHUNK) == 2) ? 0xFF : static_cast<uint8_t>(i);
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.beginWrite());
+        CHECK(configuration.writeUserData(0, expected, sizeof(expected)));
+        CHECK(configuration.endWrite());
+
+        // Loaded from the current generation, erased past it
+        configuration.setShadow(shadow, sizeof(shadow));
+
+        CHECK(configuration.shadowSize() == sizeof(shadow));
+        CHECK(!configuration.isDirty());
+        CHECK(std::memcmp(shadow, expected, USED) == 0);
+        CHECK(shadow[USED] == 0xFF);
+
+        // Overlapping, adjacent and separate ranges
+        change(configuration, 10, 4, 0xA0);
+        change(configuration, 12, 8, 0xA1);
+        change(configuration, 20, 4, 0xA2);
+        change(configuration, 100, 4, 0xA3);
+        change(configuration, USED - 1, 1, 0xA4);
+
+        CHECK(configuration.isDirty());
+
+        // Changed in RAM but not marked: not stored
+        shadow[50] ^= 0xFF;
+        shadow[200] ^= 0xFF;
+
+        CHECK(!configuration.markDirty(sizeof(shadow) - 1, 2));
+
+        simulated::resetStatistics();
+
+        CHECK(configuration.flush());
+        CHECK(!configuration.isDirty());
+        CHECK(stored(configuration));
+
+        // One erase, the user data programmed up to the used size, the erased chunk skipped
+        CHECK(simulated::statistics().erases == 1);
+        CHECK(simulated::statistics().programs == generationPrograms((USED / CHUNK) - 1));
+
+        // Reloaded: the unmarked changes are gone
+        CHECK(std::memcmp(shadow, expected, USED) == 0);
+
+        // Nothing dirty, nothing written
+        simulated::resetStatistics();
+
+        CHECK(configuration.flush());
+        CHECK(simulated::statistics().erases == 0);
+        CHECK(simulated::statistics().programs == 0);
+
+        // More ranges than tracked: merged into one covering them all
+        for (std::size_t i = 0; i < (2 * CORE_STM32_FLASH_DIRTY_RANGES); i++) {
+            change(configuration, i * 8, 2, static_cast<uint8_t>(0xB0 + i));
+        }
+
+        CHECK(configuration.flush());
+        CHECK(stored(configuration));
+
+        // Discarded
+        uint8_t discarded[16];
+
+        std::memset(discarded, 0xC0, sizeof(discarded));
+
+        CHECK(configuration.writeShadow(0, discarded, sizeof(discarded)));
+
+        configuration.reloadShadow();
+
+        CHECK(!configuration.isDirty());
+        CHECK(std::memcmp(shadow, expected, USED) == 0);
+
+        // Past the used size, the chunks in between stay erased
+        uint8_t tail[4] = {
+            1, 2, 3, 4
+        };
+
+        CHECK(configuration.writeShadow(sizeof(shadow) - sizeof(tail), tail, sizeof(tail)));
+
+        simulated::resetStatistics();
+
+        CHECK(configuration.flush());
+        CHECK(simulated::statistics().programs == generationPrograms(((USED / CHUNK) - 1) + 1));
+        CHECK(stored(configuration));
+        CHECK(std::memcmp(reinterpret_cast<const uint8_t*>(configuration.getUserConfiguration()) + sizeof(shadow) - sizeof(tail), tail, sizeof(tail)) == 0);
+        CHECK(reinterpret_cast<const uint8_t*>(configuration.getUserConfiguration())[USED] == 0xFF);
+    }
+
+    {
+        // After reboot
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        configuration.setShadow(shadow, sizeof(shadow));
+
+        CHECK(stored(configuration));
+        CHECK(std::memcmp(shadow, expected, USED) == 0);
+        CHECK(shadow[sizeof(shadow) - 1] == 4);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,154 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// An update identical to the current generation is counted and not written, a single changed byte is written
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t user[100];
+
+//! The flash was not touched, one more update was skipped
+static void
+checkSkipped(
+    const Storage& storage,
+    uint32_t&      skipped
+)
+{
+    CHECK(simulated::statistics().erases == 0);
+    CHECK(simulated::statistics().programs == 0);
+    CHECK(storage.statistics().skipped == ++skipped);
+
+    simulated::resetStatistics();
+}
+
+//! A new generation was written
+static void
+checkWritten(
+    const Storage& storage,
+    uint32_t       skipped
+)
+{
+    CHECK(simulated::statistics().erases == 1);
+    CHECK(simulated::statistics().programs != 0);
+    CHECK(storage.statistics().skipped == skipped);
+
+    simulated::resetStatistics();
+}
+
+static bool
+setUser(
+    ConfigurationStorage& configuration,
+    Address               offset,
+    const void*           data,
+    std::size_t           size
+)
+{
+    bool success = configuration.beginTransaction();
+
+    success &= configuration.setUserData(offset, data, size);
+    success &= configuration.commitTransaction();
+
+    return success;
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    char         name[16] = "module";
+    uint32_t     skipped  = 0;
+
+    for (std::size_t i = 0; i < sizeof(user); i++) {
+        user[i] = static_cast<uint8_t>(i);
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.writeCanID(7));
+        CHECK(configuration.writeModuleName(name));
+        CHECK(configuration.writeProgramCRC(0x1234, 1000));
+        CHECK(setUser(configuration, 0, user, sizeof(user)));
+
+        simulated::resetStatistics();
+
+        // Same fields
+        CHECK(configuration.writeCanID(7));
+        checkSkipped(storage, skipped);
+        CHECK(configuration.writeModuleName(name));
+        checkSkipped(storage, skipped);
+        CHECK(configuration.writeProgramCRC(0x1234, 1000));
+        checkSkipped(storage, skipped);
+
+        // Same user data, also erased bytes past the stored ones
+        uint8_t erased[8];
+
+        std::memset(erased, 0xFF, sizeof(erased));
+
+        CHECK(setUser(configuration, 10, user + 10, 20));
+        checkSkipped(storage, skipped);
+        CHECK(setUser(configuration, sizeof(user) + 50, erased, sizeof(erased)));
+        checkSkipped(storage, skipped);
+
+        // A changed byte: field, then user data at the first and the last byte
+        CHECK(configuration.writeCanID(8));
+        checkWritten(storage, skipped);
+        CHECK(configuration.getModuleConfiguration()->canID == 8);
+
+        uint8_t byte = user[0] ^ 0x01;
+
+        CHECK(setUser(configuration, 0, &byte, 1));
+        checkWritten(storage, skipped);
+
+        byte = 0;
+
+        CHECK(setUser(configuration, sizeof(user) - 1, &byte, 1));
+        checkWritten(storage, skipped);
+
+        // Past the stored user data
+        CHECK(setUser(configuration, sizeof(user) + 50, &byte, 1));
+        checkWritten(storage, skipped);
+    }
+
+    {
+        // After reboot, compared with the generation found at boot
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        skipped = 0;
+        simulated::resetStatistics();
+
+        CHECK(configuration.writeCanID(8));
+        checkSkipped(storage, skipped);
+        CHECK(configuration.writeProgramCRC(0x1234, 1000));
+        checkSkipped(storage, skipped);
+
+        // Same CRC, other length
+        CHECK(configuration.writeProgramCRC(0x1234, 1004));
+        checkWritten(storage, skipped);
+
+        // Dropping the user data is a change, then no more
+        CHECK(configuration.eraseUserConfiguration());
+        checkWritten(storage, skipped);
+        CHECK(configuration.eraseUserConfiguration());
+        checkSkipped(storage, skipped);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
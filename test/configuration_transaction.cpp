@@ -0,0 +1,164 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A transaction is written as one generation on commit, nothing on abort, and an interrupted one is not seen after reboot
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static const uint8_t USER[8] = {
+    1, 2, 3, 4, 5, 6, 7, 8
+};
+
+//! The configuration written by the first transaction
+static void
+checkCommitted(
+    const ConfigurationStorage& configuration
+)
+{
+    const uint8_t* user = reinterpret_cast<const uint8_t*>(configuration.getUserConfiguration());
+    const uint8_t  expected[10] = {
+        1, 2, 0xA0, 0xA1, 0xB0, 0xB1, 0xB2, 8, 0xFF, 0xC0
+    };
+
+    CHECK(configuration.isValid());
+    CHECK(configuration.getModuleConfiguration()->canID == 2);
+    CHECK(std::strcmp(configuration.getModuleConfiguration()->name, "module") == 0);
+    CHECK(configuration.getModuleConfiguration()->imageCRC == 0x1234);
+    CHECK(configuration.getModuleConfiguration()->imageLength == 100);
+    CHECK(configuration.getModuleConfiguration()->programSlot == ModuleConfiguration::PROGRAM_SLOT_B);
+    CHECK(std::memcmp(user, expected, sizeof(expected)) == 0);
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    char         name[16] = "module";
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.writeCanID(1));
+        CHECK(configuration.beginWrite());
+        CHECK(configuration.writeUserData(0, USER, sizeof(USER)));
+        CHECK(configuration.endWrite());
+
+        // Only within a transaction, one at a time
+        CHECK(!configuration.setCanID(2));
+        CHECK(!configuration.commitTransaction());
+        CHECK(configuration.beginTransaction());
+        CHECK(!configuration.beginTransaction());
+
+        // Commit: everything in a single generation, the last change wins
+        uint8_t a[2] = {
+            0xA0, 0xA1
+        };
+        uint8_t b[3] = {
+            0xB0, 0xB1, 0xB2
+        };
+        uint8_t c = 0xC0;
+
+        CHECK(configuration.setCanID(2));
+        CHECK(configuration.setModuleName(name));
+        CHECK(configuration.setProgramCRC(0x1234, 100));
+        CHECK(configuration.setProgramSlot(ModuleConfiguration::PROGRAM_SLOT_B));
+        CHECK(configuration.setUserData(2, a, sizeof(a)));
+        CHECK(configuration.setUserData(4, a, sizeof(a)));
+        CHECK(configuration.setUserData(4, b, sizeof(b)));
+        CHECK(configuration.setUserData(9, &c, sizeof(c)));
+
+        // Staged only
+        CHECK(configuration.getModuleConfiguration()->canID == 1);
+
+        simulated::resetStatistics();
+
+        CHECK(configuration.commitTransaction());
+        CHECK(simulated::statistics().erases == 1);
+        checkCommitted(configuration);
+        CHECK(!configuration.commitTransaction());
+
+        // The staging buffer is bounded
+        uint8_t large[CORE_STM32_FLASH_TRANSACTION_SIZE];
+
+        std::memset(large, 0, sizeof(large));
+
+        CHECK(configuration.beginTransaction());
+        CHECK(!configuration.setUserData(0, large, sizeof(large)));
+        CHECK(configuration.setUserData(0, large, sizeof(large) - ConfigurationStorage::stagedSize(0)));
+        CHECK(!configuration.setUserData(0, large, 1));
+        CHECK(!configuration.setUserData(configuration.userDataSize(), large, 1));
+
+        // Abort: nothing is written, the configuration is unchanged
+        CHECK(configuration.setCanID(3));
+
+        simulated::resetStatistics();
+
+        configuration.abortTransaction();
+
+        CHECK(!configuration.commitTransaction());
+        CHECK(simulated::statistics().erases == 0);
+        CHECK(simulated::statistics().programs == 0);
+        checkCommitted(configuration);
+
+        // Interrupted before the commit
+        CHECK(configuration.beginTransaction());
+        CHECK(configuration.setCanID(4));
+        CHECK(configuration.setUserData(0, large, 8));
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        checkCommitted(configuration);
+
+        // Interrupted while committing: the new generation is formatted and partly
+        // written, its counter is not
+        ModuleConfiguration module = *configuration.getModuleConfiguration();
+
+        module.canID = 5;
+
+        CHECK(storage.format());
+        CHECK(storage.write(0, &module, offsetof(ModuleConfiguration, padding)));
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        checkCommitted(configuration);
+
+        // The torn bank is erased by the next transaction
+        CHECK(configuration.beginTransaction());
+        CHECK(configuration.setCanID(6));
+        CHECK(configuration.commitTransaction());
+        CHECK(configuration.getModuleConfiguration()->canID == 6);
+        CHECK(configuration.getModuleConfiguration()->programSlot == ModuleConfiguration::PROGRAM_SLOT_B);
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.getModuleConfiguration()->canID == 6);
+        CHECK(std::memcmp(reinterpret_cast<const uint8_t*>(configuration.getUserConfiguration()) + 2, "\xA0\xA1\xB0\xB1\xB2", 5) == 0);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
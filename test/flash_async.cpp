@@ -0,0 +1,142 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The asynchronous erase and program report to their callback, a failure too, and are rejected while busy
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+struct Completion {
+    FlashSegment* segment;
+    std::size_t   calls;
+    bool          success;
+};
+
+static void
+completed(
+    FlashSegment& segment,
+    bool          success,
+    void*         arg
+)
+{
+    Completion* completion = reinterpret_cast<Completion*>(arg);
+
+    completion->segment = &segment;
+    completion->calls++;
+    completion->success = success;
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    FlashSegment other(PROGRAM_B_FLASH_FROM, PROGRAM_B_FLASH_TO);
+    Sector       sector = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    uint8_t      data[64];
+    Completion   completion = {
+        nullptr, 0, false
+    };
+
+    for (std::size_t i = 0; i < sizeof(data); i++) {
+        data[i] = static_cast<uint8_t>(i);
+    }
+
+    CHECK(segment.unlock());
+
+    // Program, then erase: each operation calls back once with its segment
+    CHECK(segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data), completed, &completion));
+    CHECK((completion.calls == 1) && completion.success && (completion.segment == &segment));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), data, sizeof(data)) == 0);
+    CHECK(segment.statistics().programs == (sizeof(data) / FLASH_PROGRAM_UNIT));
+
+    CHECK(segment.eraseSectorAsync(sector, completed, &completion));
+    CHECK((completion.calls == 2) && completion.success);
+    CHECK(segment.isSectorBlank(sector));
+    CHECK(segment.statistics().erases == 1);
+
+    // The blocking variants
+    CHECK(segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data)));
+    CHECK(segment.eraseSectorAsync(sector));
+    CHECK(segment.isSectorBlank(sector));
+
+    // Blank check: the callback comes without erasing
+    segment.setBlankCheck(true);
+    simulated::resetStatistics();
+
+    CHECK(segment.eraseSectorAsync(sector, completed, &completion));
+    CHECK((completion.calls == 3) && completion.success);
+    CHECK(simulated::statistics().erases == 0);
+    CHECK(segment.statistics().erasesSkipped == 1);
+
+    segment.setBlankCheck(false);
+
+    // Invalid requests are rejected without calling back
+    CHECK(!segment.eraseSectorAsync(sector - 1, completed, &completion));
+    CHECK(!segment.writeAsync(PROGRAM_FLASH_FROM + 1, data, sizeof(data), completed, &completion));
+    CHECK(!segment.writeAsync(PROGRAM_FLASH_FROM, data, FLASH_PROGRAM_UNIT + 1, completed, &completion));
+    CHECK(!segment.writeAsync(PROGRAM_FLASH_TO - FLASH_PROGRAM_UNIT, data, 2 * FLASH_PROGRAM_UNIT, completed, &completion));
+    CHECK(completion.calls == 3);
+
+    // Failure: the flash is locked
+    CHECK(segment.lock());
+    CHECK(segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data), completed, &completion));
+    CHECK((completion.calls == 4) && !completion.success);
+    CHECK(segment.eraseSectorAsync(sector, completed, &completion));
+    CHECK((completion.calls == 5) && !completion.success);
+    CHECK(!segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data)));
+    CHECK(segment.isSectorBlank(sector));
+
+    // Failure: programming over programmed cells
+    CHECK(segment.unlock());
+    CHECK(segment.write32(PROGRAM_FLASH_FROM, 0x00000000));
+    CHECK(segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data), completed, &completion));
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    CHECK((completion.calls == 6) && !completion.success);
+#else
+    // F4 just clears the bits
+    CHECK((completion.calls == 6) && completion.success);
+#endif
+    CHECK(*reinterpret_cast<const uint32_t*>(PROGRAM_FLASH_FROM) == 0x00000000);
+
+    // Busy: a second operation is rejected until the interrupt is served, on any segment
+    CHECK(segment.eraseSectorAsync(sector));
+    simulated::holdInterrupt(true);
+
+    CHECK(segment.writeAsync(PROGRAM_FLASH_FROM, data, sizeof(data), completed, &completion));
+    CHECK(segment.isBusy());
+    CHECK(!other.isBusy());
+    CHECK(completion.calls == 6);
+    CHECK(!segment.writeAsync(PROGRAM_FLASH_FROM + sizeof(data), data, sizeof(data), completed, &completion));
+    CHECK(!segment.eraseSectorAsync(sector + 1, completed, &completion));
+    CHECK(!other.eraseSectorAsync(FLASH_ADDRESS_SECTOR(PROGRAM_B_FLASH_FROM), completed, &completion));
+
+    CHECK(simulated::serveInterrupt());
+    CHECK((completion.calls == 7) && completion.success && (completion.segment == &segment));
+    CHECK(!segment.isBusy());
+    CHECK(!simulated::serveInterrupt());
+
+    // Accepted again
+    CHECK(segment.eraseSectorAsync(sector, completed, &completion));
+    CHECK(segment.isBusy());
+    CHECK(simulated::serveInterrupt());
+    CHECK((completion.calls == 8) && completion.success);
+    CHECK(segment.isSectorBlank(sector));
+
+    simulated::holdInterrupt(false);
+
+    CHECK(segment.lock());
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
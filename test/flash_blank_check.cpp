@@ -0,0 +1,92 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The blank check skips the erase of an erased sector only, up to its first and last bit
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+
+using namespace core::stm32_flash;
+
+//! Clear the lowest bit of the program unit at address, erase its sector with the blank check
+static void
+dirty(
+    FlashSegment& segment,
+    Address       address
+)
+{
+    Sector sector = FLASH_ADDRESS_SECTOR(address);
+
+    CHECK(segment.write16(address, 0xFFFE));
+    CHECK(!segment.isSectorBlank(sector));
+
+    simulated::resetStatistics();
+    segment.resetStatistics();
+
+    CHECK(segment.eraseSector(sector));
+    CHECK(simulated::sectorErases(sector) == 1);
+    CHECK(segment.statistics().erases == 1);
+    CHECK(segment.statistics().erasesSkipped == 0);
+    CHECK(segment.isSectorBlank(sector));
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    Sector       first  = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    Sector       middle = first + 1;
+    Address      from   = FLASH_SECTOR_ADDRESS(middle);
+    Address      to     = from + FLASH_SECTOR_SIZE(middle);
+
+    CHECK(segment.unlock());
+
+    // Off by default: a blank sector is erased anyway
+    CHECK(segment.eraseSector(middle));
+    CHECK(simulated::sectorErases(middle) == 1);
+    CHECK(segment.statistics().erasesSkipped == 0);
+
+    segment.setBlankCheck(true);
+
+    // Erased
+    simulated::resetStatistics();
+    segment.resetStatistics();
+
+    CHECK(segment.isSectorBlank(middle));
+    CHECK(segment.eraseSector(middle));
+    CHECK(simulated::statistics().erases == 0);
+    CHECK(segment.statistics().erases == 0);
+    CHECK(segment.statistics().erasesSkipped == 1);
+
+    // The neighbours are programmed up to the sector edges: it is still blank
+    CHECK(segment.write16(from - sizeof(uint16_t), 0x0000));
+    CHECK(segment.write16(to, 0x0000));
+    CHECK(segment.isSectorBlank(middle));
+    CHECK(segment.eraseSector(middle));
+    CHECK(simulated::sectorErases(middle) == 0);
+
+    // A single bit programmed at the first, the last and a middle program unit
+    dirty(segment, from);
+    dirty(segment, to - sizeof(uint16_t));
+    dirty(segment, from + (FLASH_SECTOR_SIZE(middle) / 2) + 6);
+
+    // The neighbours were not touched
+    CHECK(*reinterpret_cast<const uint16_t*>(from - sizeof(uint16_t)) == 0x0000);
+    CHECK(*reinterpret_cast<const uint16_t*>(to) == 0x0000);
+
+    // Outside the segment the check fails, the sector is not erased
+    CHECK(!segment.isSectorBlank(first - 1));
+    CHECK(!segment.eraseSector(first - 1));
+
+    CHECK(segment.lock());
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
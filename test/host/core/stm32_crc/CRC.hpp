@@ -0,0 +1,101 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * Host stand-in for the stm32_crc package: the CRC unit in software.
+ *
+ * Same result as the hardware (CRC-32, polynomial 0x04C11DB7, initial value
+ * 0xFFFFFFFF, one word at a time, no reflection). The blocks and the words are
+ * counted, so the tests can measure how much of the flash is read back.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace core {
+namespace stm32_crc {
+class CRC
+{
+public:
+    enum class PolynomialSize {
+        POLY_32
+    };
+
+    struct Statistics {
+        uint32_t blocks;
+        uint32_t words;
+    };
+
+public:
+    static void
+    init()
+    {
+        state() = 0xFFFFFFFF;
+    }
+
+    static void
+    reset()
+    {
+        state() = 0xFFFFFFFF;
+    }
+
+    static void
+    setPolynomialSize(
+        PolynomialSize
+    ) {}
+
+    static uint32_t
+    CRCBlock(
+        const uint32_t* data,
+        std::size_t     size
+    )
+    {
+        uint32_t crc = state();
+
+        for (std::size_t i = 0; i < size; i++) {
+            crc ^= data[i];
+
+            for (unsigned bit = 0; bit < 32; bit++) {
+                crc = ((crc & 0x80000000) != 0) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+            }
+        }
+
+        statistics().blocks++;
+        statistics().words += size;
+
+        state() = crc;
+
+        return crc;
+    }
+
+    static uint32_t
+    getCRC()
+    {
+        return state();
+    }
+
+    static Statistics&
+    statistics()
+    {
+        static Statistics statistics;
+
+        return statistics;
+    }
+
+
+private:
+    static uint32_t&
+    state()
+    {
+        static uint32_t crc = 0xFFFFFFFF;
+
+        return crc;
+    }
+};
+}
+}
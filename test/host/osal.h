@@ -0,0 +1,189 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * Host stand-in for the ChibiOS OSAL, just what the library uses.
+ *
+ * The system lock is a global mutex, the threads are std::thread: enough to run
+ * the library on the simulated flash (CORE_STM32_FLASH_SIMULATED). The system
+ * time unit is the millisecond.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstdlib>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+typedef int32_t  msg_t;
+typedef uint32_t systime_t;
+
+#define MSG_OK      0
+#define MSG_TIMEOUT -1
+#define MSG_RESET   -2
+
+#define TIME_INFINITE ((systime_t)-1)
+
+#define FALSE 0
+#define TRUE  1
+
+#define PORT_SUPPORTS_RT TRUE
+
+#define OSAL_IRQ_HANDLER(id) void id(void)
+#define OSAL_IRQ_PROLOGUE()
+#define OSAL_IRQ_EPILOGUE()
+
+struct thread_t {
+    std::condition_variable wakeup;
+    bool                    resumed;
+    msg_t                   msg;
+};
+
+typedef thread_t* thread_reference_t;
+
+inline std::mutex&
+hostSysMutex()
+{
+    static std::mutex mutex;
+
+    return mutex;
+}
+
+inline void
+osalSysLock()
+{
+    hostSysMutex().lock();
+}
+
+inline void
+osalSysUnlock()
+{
+    hostSysMutex().unlock();
+}
+
+inline void
+osalSysLockFromISR() {}
+
+inline void
+osalSysUnlockFromISR() {}
+
+/*! \brief Realtime counter, advanced by one tick at each read
+ *
+ * Deterministic: a critical section measured from its start to its end lasts one tick.
+ */
+inline uint32_t
+chSysGetRealtimeCounterX()
+{
+    static uint32_t counter = 0;
+
+    return ++counter;
+}
+
+inline void
+chSysHalt(
+    const char*
+)
+{
+    std::abort();
+}
+
+//! Called with the system lock held, like in ChibiOS it is released while waiting
+inline msg_t
+osalThreadSuspendTimeoutS(
+    thread_reference_t* reference,
+    systime_t           time
+)
+{
+    static thread_local thread_t self;
+
+    std::unique_lock<std::mutex> lock(hostSysMutex(), std::adopt_lock);
+
+    self.resumed = false;
+    self.msg     = MSG_TIMEOUT;
+    *reference   = &self;
+
+    if (time == TIME_INFINITE) {
+        self.wakeup.wait(lock, [] {
+            return self.resumed;
+        });
+    } else if (!self.wakeup.wait_for(lock, std::chrono::milliseconds(time), [] {
+        return self.resumed;
+    })) {
+        *reference = nullptr;
+    }
+
+    lock.release();
+
+    return self.msg;
+} // osalThreadSuspendTimeoutS
+
+inline msg_t
+osalThreadSuspendS(
+    thread_reference_t* reference
+)
+{
+    return osalThreadSuspendTimeoutS(reference, TIME_INFINITE);
+}
+
+inline void
+osalThreadResumeI(
+    thread_reference_t* reference,
+    msg_t               msg
+)
+{
+    if (*reference != nullptr) {
+        (*reference)->msg     = msg;
+        (*reference)->resumed = true;
+        (*reference)->wakeup.notify_one();
+        *reference = nullptr;
+    }
+}
+
+inline void
+osalThreadResumeS(
+    thread_reference_t* reference,
+    msg_t               msg
+)
+{
+    osalThreadResumeI(reference, msg);
+}
+
+inline systime_t
+osalOsGetSystemTimeX()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    return static_cast<systime_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+struct mutex_t {
+    std::mutex mutex;
+};
+
+inline void
+osalMutexObjectInit(
+    mutex_t*
+) {}
+
+inline void
+osalMutexLock(
+    mutex_t* mutex
+)
+{
+    mutex->mutex.lock();
+}
+
+inline void
+osalMutexUnlock(
+    mutex_t* mutex
+)
+{
+    mutex->mutex.unlock();
+}
@@ -0,0 +1,120 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Erases taken by 10000 small updates, and the bank choice across the counter wrap
+
+#include "test.hpp"
+
+#include <core/stm32_flash/JournalStorage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t copy[0x4000];
+
+// Rewrite the generation counter of a bank, keeping the rest
+static void
+setCounter(
+    FlashSegment& bank,
+    uint16_t      cnt
+)
+{
+    CHECK(bank.size() <= sizeof(copy));
+
+    std::memcpy(copy, reinterpret_cast<const void*>(bank.from()), bank.size());
+    std::memcpy(copy, &cnt, sizeof(cnt));
+
+    CHECK(bank.unlock());
+    CHECK(bank.erase());
+    CHECK(bank.write(bank.from(), copy, bank.size()));
+    CHECK(bank.lock());
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    uint8_t      shadow[512];
+    uint8_t      data[512];
+
+    std::memset(shadow, 0xFF, sizeof(shadow));
+
+    {
+        JournalStorage journal(bank1, bank2, sizeof(shadow));
+
+        CHECK(!journal.isValid());
+
+        for (unsigned i = 0; i < 10000; i++) {
+            uint32_t value  = test::random();
+            Address  offset = value % (sizeof(shadow) - sizeof(value));
+
+            CHECK(journal.write(offset, &value, sizeof(value)));
+            std::memcpy(shadow + offset, &value, sizeof(value));
+        }
+
+        std::printf("10000 updates: %u erases, %u compactions\n", simulated::statistics().erases, journal.statistics().compactions);
+
+        // One per compaction, a full rewrite would take one per update
+        CHECK(simulated::statistics().erases == journal.statistics().compactions);
+        CHECK(simulated::statistics().erases <= ((10000 * (8 + sizeof(uint32_t) + 4)) / (bank1.size() - 8 - sizeof(shadow))) + 1);
+
+        CHECK(journal.read(0, data, sizeof(data)));
+        CHECK(std::memcmp(data, shadow, sizeof(shadow)) == 0);
+    }
+
+    // Reopened
+    {
+        JournalStorage journal(bank1, bank2, sizeof(shadow));
+
+        CHECK(journal.isValid());
+        CHECK(journal.read(0, data, sizeof(data)));
+        CHECK(std::memcmp(data, shadow, sizeof(shadow)) == 0);
+    }
+
+    // The counter wraps from 0xFFFE to 0: bank2 holds the newer image
+    {
+        JournalStorage journal(bank1, bank2, sizeof(shadow));
+        uint32_t       value = 1;
+
+        CHECK(journal.erase());
+        CHECK(journal.write(0, &value, sizeof(value)));
+        CHECK(journal.compact());
+
+        value = 2;
+
+        CHECK(journal.write(0, &value, sizeof(value)));
+    }
+
+    setCounter(bank1, 0xFFFE);
+    setCounter(bank2, 0);
+
+    {
+        JournalStorage journal(bank1, bank2, sizeof(shadow));
+        uint32_t       value;
+
+        CHECK(journal.read(0, &value, sizeof(value)));
+        CHECK(value == 2);
+    }
+
+    // Banks larger than 64 KB are never used
+    {
+        FlashSegment   large1(PROGRAM_FLASH_FROM, PROGRAM_FLASH_FROM + 0x11000);
+        FlashSegment   large2(PROGRAM_FLASH_FROM + 0x11000, PROGRAM_FLASH_FROM + 0x22000);
+        JournalStorage journal(large1, large2, sizeof(shadow));
+        uint32_t       value = 3;
+
+        CHECK(!journal.write(0, &value, sizeof(value)));
+        CHECK(!journal.isValid());
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
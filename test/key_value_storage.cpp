@@ -0,0 +1,200 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Records are appended, compacted when the bank is full, indexed again at boot; torn records are ignored
+
+#include "test.hpp"
+
+#include <core/stm32_flash/KeyValueStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static const KeyValueStorage::Key KEYS = 20;
+
+static uint32_t values[KEYS]; //!< Expected value of each key, 0 if removed
+
+static void
+check(
+    const KeyValueStorage& kv
+)
+{
+    for (KeyValueStorage::Key key = 0; key < KEYS; key++) {
+        std::size_t size  = 0;
+        const void* value = kv.get(key, size);
+
+        if (values[key] == 0) {
+            CHECK(value == nullptr);
+        } else {
+            CHECK(value != nullptr);
+            CHECK(size == sizeof(uint32_t));
+            CHECK(std::memcmp(value, &values[key], sizeof(uint32_t)) == 0);
+        }
+    }
+}
+
+static bool
+set(
+    KeyValueStorage&     kv,
+    KeyValueStorage::Key key,
+    uint32_t             value
+)
+{
+    values[key] = value;
+
+    return kv.set(key, &value, sizeof(value));
+}
+
+//! Offset of the first erased word after the payload: where the next record goes
+static Address
+end(
+    const Storage& storage
+)
+{
+    Address offset = storage.usedSize();
+
+    while (*reinterpret_cast<const uint32_t*>(storage.getAddress() + offset) != 0xFFFFFFFF) {
+        offset += sizeof(uint32_t);
+    }
+
+    return offset;
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    Address      torn = 0;
+
+    {
+        Storage         storage(bank1, bank2);
+        KeyValueStorage kv(storage);
+        uint32_t        value = 1;
+        std::size_t     size;
+
+        check(kv);
+
+        CHECK(!kv.set(KeyValueStorage::INVALID_KEY, &value, sizeof(value)));
+        CHECK(!kv.set(1, &value, 0));
+
+        // The first record creates a generation, the next ones are appended
+        for (KeyValueStorage::Key key = 0; key < KEYS; key++) {
+            CHECK(set(kv, key, 0x1000 + key));
+        }
+
+        CHECK(kv.statistics().compactions == 1);
+        CHECK(kv.statistics().appends == (KEYS - 1));
+        check(kv);
+
+        // Update, with another size
+        uint8_t large[10] = {
+            1, 2, 3, 4, 5, 6, 7, 8, 9, 10
+        };
+
+        CHECK(kv.set(KEYS, large, sizeof(large)));
+        CHECK(std::memcmp(kv.get(KEYS, size), large, sizeof(large)) == 0);
+        CHECK(size == sizeof(large));
+        CHECK(set(kv, 5, 0x2005));
+
+        // Identical: nothing written
+        simulated::resetStatistics();
+
+        CHECK(set(kv, 5, 0x2005));
+        CHECK(simulated::statistics().programs == 0);
+
+        // Remove, twice
+        CHECK(kv.remove(3));
+        values[3] = 0;
+        CHECK(kv.remove(3));
+        CHECK(kv.remove(KEYS));
+        check(kv);
+    }
+
+    {
+        // Rebuilt at boot: the compacted records, then the appended ones
+        Storage         storage(bank1, bank2);
+        KeyValueStorage kv(storage);
+        std::size_t     size;
+
+        check(kv);
+        CHECK(kv.get(KEYS, size) == nullptr);
+
+        // Appended until the bank is full: compacted, the latest values kept
+        simulated::resetStatistics();
+
+        uint32_t i = 0;
+
+        while (kv.statistics().compactions < 3) {
+            CHECK(set(kv, i % KEYS, 0x3000 + i));
+
+            if ((i % KEYS) == 3) {
+                // Removed keys are dropped by the compaction
+                CHECK(kv.remove(3));
+                values[3] = 0;
+            }
+
+            i++;
+        }
+
+        CHECK(simulated::statistics().erases == 3);
+        CHECK(kv.statistics().appends > (3 * KEYS));
+        check(kv);
+
+        // A compaction keeps everything
+        CHECK(kv.compact());
+        check(kv);
+    }
+
+    {
+        Storage         storage(bank1, bank2);
+        KeyValueStorage kv(storage);
+
+        check(kv);
+
+        // Power lost while appending: a record with a bad CRC, then one without its CRC
+        uint32_t header = 7 | (sizeof(uint32_t) << 16);
+        uint32_t value  = 0xDEAD;
+        uint32_t crc    = 0x12345678;
+
+        torn = end(storage);
+
+        CHECK(storage.append(torn, &header, sizeof(header)));
+        CHECK(storage.append(torn + 4, &value, sizeof(value)));
+        CHECK(storage.append(torn + 8, &crc, sizeof(crc)));
+
+        header = 8 | (sizeof(uint32_t) << 16);
+
+        CHECK(storage.append(torn + 12, &header, sizeof(header)));
+        CHECK(storage.append(torn + 16, &value, sizeof(value)));
+    }
+
+    {
+        Storage         storage(bank1, bank2);
+        KeyValueStorage kv(storage);
+
+        check(kv);
+
+        // Appended after the torn records
+        CHECK(set(kv, 8, 0x4008));
+        CHECK(*reinterpret_cast<const uint32_t*>(storage.getAddress() + torn + 24) == (8 | (sizeof(uint32_t) << 16)));
+    }
+
+    {
+        Storage         storage(bank1, bank2);
+        KeyValueStorage kv(storage);
+
+        check(kv);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
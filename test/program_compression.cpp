@@ -0,0 +1,113 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Compression ratio and decompression throughput of a program image
+//
+// The image is the file given as argument, or this executable (compiled code)
+// when there is none, cut to the size of the program segment.
+
+#include "test.hpp"
+#include "../tools/lz.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramDecompressor.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using namespace core::stm32_flash;
+
+static const std::size_t FRAME = 8; //!< Bytes received at a time, as from CAN
+
+static double
+seconds(
+    std::chrono::steady_clock::time_point start
+)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//! Decompress the stream to the program segment, check the result
+static void
+program(
+    ProgramStorage&             storage,
+    ProgramDecompressor&        decompressor,
+    const std::vector<uint8_t>& stream,
+    const std::vector<uint8_t>& image
+)
+{
+    CHECK(storage.beginWrite());
+    CHECK(decompressor.begin(storage.from()));
+
+    for (std::size_t i = 0; i < stream.size(); i += FRAME) {
+        CHECK(decompressor.push(&stream[i], std::min(FRAME, stream.size() - i)));
+    }
+
+    CHECK(decompressor.finish());
+    CHECK(storage.endWrite());
+    CHECK(decompressor.written() == image.size());
+    CHECK(std::memcmp(reinterpret_cast<const void*>(storage.from()), image.data(), image.size()) == 0);
+}
+
+int
+main(
+    int   argc,
+    char* argv[]
+)
+{
+    test::reset();
+
+    FlashSegment        segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    ProgramStorage      storage(segment);
+    ProgramDecompressor decompressor(storage);
+    tools::LZCompressor compressor(CORE_STM32_FLASH_LZ_WINDOW);
+
+    // Corner cases: empty, ending with a match, not compressible
+    std::vector<uint8_t> zeros(1000, 0);
+    std::vector<uint8_t> noise(1000);
+
+    for (std::size_t i = 0; i < noise.size(); i++) {
+        noise[i] = static_cast<uint8_t>(test::random());
+    }
+
+    program(storage, decompressor, compressor.compress(std::vector<uint8_t>()), std::vector<uint8_t>());
+    program(storage, decompressor, compressor.compress(zeros), zeros);
+    program(storage, decompressor, compressor.compress(noise), noise);
+
+    // The image
+    std::ifstream        file((argc > 1) ? argv[1] : "/proc/self/exe", std::ios::binary);
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    CHECK(!image.empty());
+    image.resize(std::min<std::size_t>(image.size(), storage.size()));
+
+    auto                 start      = std::chrono::steady_clock::now();
+    std::vector<uint8_t> stream     = compressor.compress(image);
+    double               compressed = seconds(start);
+
+    simulated::resetStatistics();
+    start = std::chrono::steady_clock::now();
+
+    program(storage, decompressor, stream, image);
+
+    double decompressed = seconds(start);
+    double flash        = simulated::statistics().time / 1e6;
+
+    std::printf("image: %zu bytes, stream: %zu bytes, ratio %.2f (window %u)\n", image.size(), stream.size(), static_cast<double>(image.size()) / stream.size(), CORE_STM32_FLASH_LZ_WINDOW);
+    std::printf("compression: %.1f MB/s (host)\n", image.size() / compressed / 1e6);
+    std::printf("decompression and programming: %.1f MB/s (host, simulated flash), flash busy %.2f s on the device\n", image.size() / decompressed / 1e6, flash);
+
+    // Compiled code compresses
+    CHECK(stream.size() < image.size());
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
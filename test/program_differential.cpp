@@ -0,0 +1,103 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A differential session programs only the changed sector, streamed blocks are split at the sector boundaries
+
+#include "test.hpp"
+
+#include <core/stm32_crc/CRC.hpp>
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+#include <core/stm32_flash/ProgramStreamWriter.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t       image[3 * 0x20000];
+static ImageManifest manifest;
+
+static void
+write(
+    ProgramStorage& program,
+    std::size_t     length
+)
+{
+    CHECK(program.beginWrite());
+    CHECK(program.write(PROGRAM_FLASH_FROM, image, length));
+    CHECK(program.endWrite());
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment        segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    ProgramStorage      program(segment);
+    ProgramStreamWriter writer(program);
+
+    // Three sectors, the new image changes the second one only
+    Sector      first  = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    Address     second = FLASH_SECTOR_ADDRESS(first + 1);
+    std::size_t length = FLASH_SECTOR_ADDRESS(first + 3) - PROGRAM_FLASH_FROM;
+
+    CHECK(length <= sizeof(image));
+
+    for (std::size_t i = 0; i < length; i++) {
+        image[i] = static_cast<uint8_t>(test::random());
+    }
+
+    write(program, length);
+    image[second - PROGRAM_FLASH_FROM + 10] ^= 0xFF;
+    write(program, length);
+    CHECK(program.buildManifest(manifest));
+    image[second - PROGRAM_FLASH_FROM + 10] ^= 0xFF;
+    write(program, length);
+    image[second - PROGRAM_FLASH_FROM + 10] ^= 0xFF;
+
+    simulated::resetStatistics();
+
+    CHECK(program.beginDifferentialWrite(manifest));
+    CHECK(program.skippedSectors() == (program.sectors() - 1));
+    CHECK(simulated::statistics().erases == 1);
+
+    // The first sector is not sent again: the first block ends at the sector boundary
+    std::size_t offset = 4;
+
+    CHECK(writer.begin(PROGRAM_FLASH_FROM + offset));
+
+    while ((offset < length) && !writer.hasFailed()) {
+        offset += writer.push(image + offset, std::min<std::size_t>(100, length - offset));
+    }
+
+    CHECK(writer.finish());
+
+    // The running CRC reads back the gap only, not the image
+    core::stm32_crc::CRC::statistics().words = 0;
+
+    CHECK(program.endWrite());
+    CHECK(core::stm32_crc::CRC::statistics().words == 0);
+    CHECK(program.imageLength() == length);
+    CHECK(program.crc() == program.updateCRC(length));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, length) == 0);
+    CHECK(simulated::sectorErases(first) == 0);
+    CHECK(simulated::sectorErases(first + 2) == 0);
+
+    std::printf("%u skipped sectors, %u erases, %u program cycles\n", static_cast<unsigned>(program.skippedSectors()), simulated::statistics().erases, simulated::statistics().programs);
+
+    CHECK(simulated::statistics().programs == (FLASH_SECTOR_SIZE(first + 1) / FLASH_PROGRAM_UNIT));
+
+    // A manifest longer than the largest one is not valid
+    manifest.sectors = CORE_STM32_FLASH_MANIFEST_SECTORS + 1;
+
+    CHECK(!program.beginDifferentialWrite(manifest));
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,184 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A lazy write erases only the sectors of the image, the erase ahead stops at the declared length; also streamed, in background
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+#include <core/stm32_flash/ProgramStreamWriter.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t image[5000];
+
+static const std::size_t FIRST = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+static const std::size_t LAST  = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM + sizeof(image) - 1);
+static const std::size_t NEXT  = LAST + 1;
+
+//! The sectors of the image and the next one hold an old image
+static void
+dirty(
+    FlashSegment& segment
+)
+{
+    static const uint8_t junk[256] = {
+        0x55, 0x55, 0x55, 0x55
+    };
+
+    CHECK(segment.unlock());
+
+    for (std::size_t sector = FIRST; sector <= NEXT; sector++) {
+        CHECK(segment.eraseSectorAt(FLASH_SECTOR_ADDRESS(sector)));
+    }
+
+    for (Address address = PROGRAM_FLASH_FROM; address < (FLASH_SECTOR_ADDRESS(NEXT) + sizeof(junk)); address += sizeof(junk)) {
+        CHECK(segment.write(address, junk, sizeof(junk)));
+    }
+
+    CHECK(segment.lock());
+
+    simulated::resetStatistics();
+}
+
+static void
+write(
+    ProgramStorage& program,
+    std::size_t     length
+)
+{
+    CHECK(program.beginLazyWrite(length));
+
+    for (std::size_t offset = 0; offset < sizeof(image); offset += 256) {
+        CHECK(program.write(PROGRAM_FLASH_FROM + offset, image + offset, std::min<std::size_t>(256, sizeof(image) - offset)));
+    }
+
+    CHECK(program.endWrite());
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, sizeof(image)) == 0);
+}
+
+//! Through a stream, pushed in chunks not aligned to its buffers
+static void
+stream(
+    ProgramStorage& program,
+    std::size_t     length
+)
+{
+    ProgramStreamWriter writer(program);
+
+    CHECK(program.beginLazyWrite(length));
+    CHECK(writer.begin(PROGRAM_FLASH_FROM));
+
+    for (std::size_t offset = 0; offset < sizeof(image); offset += 100) {
+        std::size_t size = std::min<std::size_t>(100, sizeof(image) - offset);
+
+        CHECK(writer.push(image + offset, size) == size);
+    }
+
+    CHECK(writer.finish());
+    CHECK(!writer.hasFailed());
+    CHECK(writer.programmed() == sizeof(image));
+    CHECK(program.endWrite());
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, sizeof(image)) == 0);
+    CHECK(program.crc() == program.updateCRC(sizeof(image)));
+}
+
+int
+main()
+{
+    test::reset();
+
+    for (std::size_t i = 0; i < sizeof(image); i++) {
+        image[i] = static_cast<uint8_t>(test::random());
+    }
+
+    FlashSegment   segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    ProgramStorage program(segment);
+
+    const uint8_t* next = reinterpret_cast<const uint8_t*>(FLASH_SECTOR_ADDRESS(NEXT));
+
+    // No erase ahead by default
+    dirty(segment);
+    write(program, 0);
+
+    std::printf("length not given: %u erases\n", simulated::statistics().erases);
+
+    CHECK(simulated::statistics().erases == (NEXT - FIRST));
+    CHECK(simulated::sectorErases(NEXT) == 0);
+    CHECK(*next == 0x55);
+
+    // The erase ahead stops at the sector holding the end of the image
+    dirty(segment);
+    write(program, sizeof(image));
+
+    std::printf("length given: %u erases\n", simulated::statistics().erases);
+
+    CHECK(simulated::statistics().erases == (NEXT - FIRST));
+    CHECK(simulated::sectorErases(NEXT) == 0);
+    CHECK(*next == 0x55);
+
+    // A longer length erases ahead past the data written
+    dirty(segment);
+    write(program, program.size());
+
+    CHECK(simulated::sectorErases(NEXT) == 1);
+    CHECK(*next == 0xFF);
+
+    // Streamed: each buffer is prepared before being programmed in background
+    dirty(segment);
+    stream(program, 0);
+
+    CHECK(simulated::statistics().erases == (NEXT - FIRST));
+    CHECK(simulated::sectorErases(NEXT) == 0);
+    CHECK(*next == 0x55);
+
+    dirty(segment);
+    stream(program, program.size());
+
+    CHECK(simulated::sectorErases(NEXT) == 1);
+    CHECK(*next == 0xFF);
+
+    {
+        // A block queued during the erase ahead starts at its end
+        ProgramStreamWriter writer(program);
+
+        dirty(segment);
+
+        CHECK(program.beginLazyWrite(program.size()));
+        CHECK(writer.begin(PROGRAM_FLASH_FROM));
+
+        simulated::holdInterrupt(true);
+
+        CHECK(writer.push(image, CORE_STM32_FLASH_STREAM_BUFFER_SIZE) == CORE_STM32_FLASH_STREAM_BUFFER_SIZE);
+        CHECK(simulated::sectorErases(FIRST) == 1);
+        CHECK(simulated::sectorErases(FIRST + 1) == 1);
+        CHECK(simulated::statistics().programs == 0);
+        CHECK(segment.isBusy());
+
+        // The end of the erase ahead starts the block
+        CHECK(simulated::serveInterrupt());
+        CHECK(simulated::statistics().programs != 0);
+        CHECK(writer.programmed() == 0);
+        CHECK(simulated::serveInterrupt());
+        CHECK(writer.programmed() == CORE_STM32_FLASH_STREAM_BUFFER_SIZE);
+        CHECK(!simulated::serveInterrupt());
+
+        simulated::holdInterrupt(false);
+
+        CHECK(writer.push(image + CORE_STM32_FLASH_STREAM_BUFFER_SIZE, sizeof(image) - CORE_STM32_FLASH_STREAM_BUFFER_SIZE) == (sizeof(image) - CORE_STM32_FLASH_STREAM_BUFFER_SIZE));
+        CHECK(writer.finish());
+        CHECK(program.endWrite());
+        CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, sizeof(image)) == 0);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
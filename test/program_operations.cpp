@@ -0,0 +1,73 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A bulk write costs one program cycle per program unit
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t image[100000];
+
+int
+main()
+{
+    test::reset();
+
+    for (std::size_t i = 0; i < sizeof(image); i++) {
+        image[i] = static_cast<uint8_t>(test::random());
+    }
+
+    FlashSegment   segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    ProgramStorage program(segment);
+
+    CHECK(program.beginWrite());
+
+    simulated::resetStatistics();
+    segment.resetStatistics();
+
+    CHECK(program.write(PROGRAM_FLASH_FROM, image, sizeof(image)));
+    CHECK(program.endWrite());
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, sizeof(image)) == 0);
+
+    std::printf("%u bytes: %u program cycles, %.3f per byte\n", segment.statistics().bytes, segment.statistics().programs, static_cast<double>(segment.statistics().programs) / segment.statistics().bytes);
+
+    CHECK(segment.statistics().bytes == sizeof(image));
+    CHECK(segment.statistics().programs == (sizeof(image) / FLASH_PROGRAM_UNIT));
+    CHECK(simulated::statistics().programs == (sizeof(image) / FLASH_PROGRAM_UNIT));
+
+    // Out of the segment: rejected, the image length does not change
+    CHECK(program.beginWrite());
+    CHECK(!program.write(PROGRAM_FLASH_FROM - 4, image, 4));
+    CHECK(!program.write16(PROGRAM_FLASH_FROM - 2, 0));
+    CHECK(!program.write(PROGRAM_FLASH_TO - 2, image, 4));
+    CHECK(program.imageLength() == 0);
+    CHECK(program.write(PROGRAM_FLASH_FROM, image, 4));
+    CHECK(program.imageLength() == 4);
+    CHECK(program.endWrite());
+
+    // Unaligned head and tail: padded with 0xFF, one program cycle each
+    CHECK(segment.unlock());
+    CHECK(segment.eraseSectorAt(PROGRAM_FLASH_FROM));
+
+    segment.resetStatistics();
+
+    CHECK(segment.write(PROGRAM_FLASH_FROM + 1, image, 10));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM + 1), image, 10) == 0);
+    CHECK(*reinterpret_cast<const uint8_t*>(PROGRAM_FLASH_FROM) == 0xFF);
+    CHECK(*reinterpret_cast<const uint8_t*>(PROGRAM_FLASH_FROM + 11) == 0xFF);
+    CHECK(segment.statistics().programs == ((FLASH_PROGRAM_UNIT + 10) / FLASH_PROGRAM_UNIT));
+    CHECK(segment.lock());
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,160 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A patch built on the host rebuilds the new image in place, a bad reference fails before its sector is erased
+
+#include "test.hpp"
+#include "../tools/patch.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramPatcher.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+//! Code like: repeated instruction patterns with addresses
+static std::vector<uint8_t>
+firmware(
+    std::size_t length
+)
+{
+    std::vector<uint8_t> image(length);
+
+    for (std::size_t i = 0; i < length; i += 4) {
+        uint32_t word = ((test::random() % 4) == 0) ? test::random() : (0x4800F000 | (static_cast<uint32_t>(i) & 0x0FFF));
+
+        for (std::size_t j = 0; (j < 4) && ((i + j) < length); j++) {
+            image[i + j] = static_cast<uint8_t>(word >> (8 * j));
+        }
+    }
+
+    return image;
+}
+
+static void
+install(
+    ProgramStorage&             program,
+    const std::vector<uint8_t>& image
+)
+{
+    CHECK(program.beginWrite());
+    CHECK(program.write(program.from(), image.data(), image.size()));
+    CHECK(program.endWrite());
+}
+
+static bool
+apply(
+    ProgramPatcher&             patcher,
+    const std::vector<uint8_t>& patch
+)
+{
+    bool success = patcher.begin();
+
+    for (std::size_t i = 0; success && (i < patch.size()); i += 37) {
+        success &= patcher.push(&patch[i], std::min<std::size_t>(37, patch.size() - i));
+    }
+
+    return patcher.finish() && success;
+}
+
+int
+main()
+{
+    test::reset();
+
+    // Four sectors of program, the last sector of the program flash as scratch
+    Sector first = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    Sector last  = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_TO - 1);
+
+    FlashSegment   segment(PROGRAM_FLASH_FROM, FLASH_SECTOR_ADDRESS(first + 4));
+    FlashSegment   scratch(FLASH_SECTOR_ADDRESS(last), PROGRAM_FLASH_TO);
+    ProgramStorage program(segment);
+    ProgramPatcher patcher(program, scratch);
+
+    std::vector<std::size_t> sectors;
+
+    for (std::size_t i = 0; i < program.sectors(); i++) {
+        sectors.push_back(FLASH_SECTOR_SIZE(first + i));
+    }
+
+    // A point release: some code inserted and removed, a few constants changed
+    std::vector<uint8_t> oldImage = firmware(program.size() - (sectors.back() / 2));
+    std::vector<uint8_t> newImage = oldImage;
+    std::vector<uint8_t> added    = firmware(24);
+
+    newImage.insert(newImage.begin() + (newImage.size() / 3), added.begin(), added.end());
+    newImage.erase(newImage.begin() + ((2 * newImage.size()) / 3), newImage.begin() + ((2 * newImage.size()) / 3) + 12);
+
+    for (std::size_t i = 0; i < 20; i++) {
+        newImage[test::random() % newImage.size()] ^= 0x5A;
+    }
+
+    std::vector<uint8_t> patch   = tools::PatchEncoder(oldImage, newImage, sectors).encode();
+    std::vector<uint8_t> reverse = tools::PatchEncoder(newImage, oldImage, sectors).encode();
+
+    std::printf("%zu bytes image: %zu bytes patch, %zu bytes reverse patch\n", newImage.size(), patch.size(), reverse.size());
+
+    CHECK((patch.size() * 10) < newImage.size());
+
+    // Round trip
+    install(program, oldImage);
+
+    CHECK(apply(patcher, patch));
+    CHECK(program.imageLength() == newImage.size());
+    CHECK(std::memcmp(reinterpret_cast<const void*>(program.from()), newImage.data(), newImage.size()) == 0);
+
+    CHECK(apply(patcher, reverse));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(program.from()), oldImage.data(), oldImage.size()) == 0);
+
+    // Not for the installed image
+    CHECK(!apply(patcher, reverse));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(program.from()), oldImage.data(), oldImage.size()) == 0);
+
+    // The second sector refers to the first one of the old image: it fails before the second sector is erased
+    std::vector<uint8_t> bad(patch.begin(), patch.begin() + 12);
+    uint32_t             header[2] = {
+        static_cast<uint32_t>(sectors[0] + 16), 0
+    };
+
+    bad.insert(bad.end(), reinterpret_cast<const uint8_t*>(header), reinterpret_cast<const uint8_t*>(header) + sizeof(header));
+    bad.push_back(tools::PatchEncoder::INSERT);
+
+    for (std::size_t value = sectors[0]; ; value >>= 7) {
+        bad.push_back(static_cast<uint8_t>((value & 0x7F) | ((value >= 0x80) ? 0x80 : 0)));
+
+        if (value < 0x80) {
+            break;
+        }
+    }
+
+    bad.insert(bad.end(), newImage.begin(), newImage.begin() + sectors[0]);
+    bad.push_back(tools::PatchEncoder::COPY);
+    bad.push_back(16);
+    bad.push_back(0);
+
+    simulated::resetStatistics();
+
+    CHECK(!apply(patcher, bad));
+    CHECK(simulated::sectorErases(first) == 1);
+    CHECK(simulated::sectorErases(first + 1) == 0);
+    CHECK(std::memcmp(reinterpret_cast<const void*>(FLASH_SECTOR_ADDRESS(first + 1)), &oldImage[sectors[0]], sectors[1]) == 0);
+
+    // The scratch must start on a sector boundary
+    FlashSegment   unaligned(FLASH_SECTOR_ADDRESS(last) + 4, PROGRAM_FLASH_TO);
+    ProgramPatcher misplaced(program, unaligned);
+
+    install(program, oldImage);
+
+    CHECK(!apply(misplaced, patch));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(program.from()), oldImage.data(), oldImage.size()) == 0);
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
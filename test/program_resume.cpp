@@ -0,0 +1,87 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// An interrupted update resumes at the first sector not recorded, an oversized manifest is rejected
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+#include <core/stm32_flash/ProgramStorage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static uint8_t       image[3 * 0x20000];
+static uint8_t       other[sizeof(image)];
+static ImageManifest manifest;
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    FlashSegment checkpoint(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+
+    // Two sectors and a half
+    Sector      first  = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    Address     second = FLASH_SECTOR_ADDRESS(first + 1);
+    std::size_t length = (FLASH_SECTOR_ADDRESS(first + 2) - PROGRAM_FLASH_FROM) + (FLASH_SECTOR_SIZE(first + 2) / 2);
+
+    for (std::size_t i = 0; i < length; i++) {
+        image[i] = static_cast<uint8_t>(test::random());
+        other[i] = static_cast<uint8_t>(test::random());
+    }
+
+    {
+        ProgramStorage program(segment);
+
+        CHECK(program.beginWrite());
+        CHECK(program.write(PROGRAM_FLASH_FROM, image, length));
+        CHECK(program.endWrite());
+        CHECK(program.buildManifest(manifest));
+
+        CHECK(program.beginWrite());
+        CHECK(program.write(PROGRAM_FLASH_FROM, other, length));
+        CHECK(program.endWrite());
+    }
+
+    {
+        // Interrupted in the second sector: the first one is recorded
+        ProgramStorage program(segment);
+
+        CHECK(program.beginResumableWrite(manifest, checkpoint));
+        CHECK(program.resumeAddress() == PROGRAM_FLASH_FROM);
+        CHECK(program.write(PROGRAM_FLASH_FROM, image, (second - PROGRAM_FLASH_FROM) + 100));
+    }
+
+    ProgramStorage program(segment);
+
+    simulated::resetStatistics();
+
+    CHECK(program.beginResumableWrite(manifest, checkpoint));
+    CHECK(program.resumeAddress() == second);
+    CHECK(simulated::sectorErases(first) == 0);
+    CHECK(program.write(second, image + (second - PROGRAM_FLASH_FROM), length - (second - PROGRAM_FLASH_FROM)));
+    CHECK(program.endWrite());
+
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), image, length) == 0);
+    CHECK(program.imageLength() == length);
+    CHECK(program.crc() == program.updateCRC(length));
+
+    // The checkpoint of this manifest is kept
+    uint32_t id = *reinterpret_cast<const uint32_t*>(CONFIGURATION2_FLASH_FROM);
+
+    manifest.sectors = CORE_STM32_FLASH_MANIFEST_SECTORS + 1;
+
+    CHECK(!program.beginResumableWrite(manifest, checkpoint));
+    CHECK(*reinterpret_cast<const uint32_t*>(CONFIGURATION2_FLASH_FROM) == id);
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
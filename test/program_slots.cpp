@@ -0,0 +1,149 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The image is programmed into the inactive slot, then activated; the previous one can be activated back
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ProgramSlots.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+using namespace core::stm32_flash;
+
+static uint8_t imageA[3000];
+static uint8_t imageB[2000];
+
+static bool
+install(
+    ProgramStorage& program,
+    const uint8_t*  image,
+    std::size_t     size
+)
+{
+    bool success = program.beginWrite();
+
+    success &= program.write(program.from(), image, size);
+    success &= program.endWrite();
+
+    return success;
+}
+
+int
+main()
+{
+    test::reset();
+
+    for (std::size_t i = 0; i < sizeof(imageA); i++) {
+        imageA[i] = static_cast<uint8_t>(test::random());
+    }
+
+    for (std::size_t i = 0; i < sizeof(imageB); i++) {
+        imageB[i] = static_cast<uint8_t>(test::random());
+    }
+
+    FlashSegment   bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment   bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    FlashSegment   segmentA(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    FlashSegment   segmentB(PROGRAM_B_FLASH_FROM, PROGRAM_B_FLASH_TO);
+    ProgramStorage a(segmentA);
+    ProgramStorage b(segmentB);
+    uint32_t       crcA = 0;
+    uint32_t       crcB = 0;
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+        ProgramSlots         slots(a, b, configuration);
+
+        // Slot A until B is recorded
+        CHECK(slots.active() == ProgramSlots::A);
+        CHECK(&slots.activeStorage() == &a);
+        CHECK(&slots.inactiveStorage() == &b);
+        CHECK(!slots.isActiveValid());
+
+        CHECK(install(a, imageA, sizeof(imageA)));
+        crcA = a.crc();
+        CHECK(configuration.writeProgramCRC(crcA, sizeof(imageA)));
+        CHECK(slots.active() == ProgramSlots::A);
+        CHECK(slots.isActiveValid());
+
+        // Not activated: session still open, then wrong CRC
+        CHECK(b.beginWrite());
+        CHECK(b.write(PROGRAM_B_FLASH_FROM, imageB, sizeof(imageB)));
+        CHECK(!slots.activate(b.updateCRC(sizeof(imageB)), sizeof(imageB)));
+        CHECK(b.endWrite());
+        crcB = b.crc();
+        CHECK(!slots.activate(crcB ^ 1, sizeof(imageB)));
+        CHECK(slots.active() == ProgramSlots::A);
+
+        // Swap
+        CHECK(slots.activate(crcB, sizeof(imageB)));
+        CHECK(slots.active() == ProgramSlots::B);
+        CHECK(&slots.activeStorage() == &b);
+        CHECK(slots.isActiveValid());
+
+        // The other writes keep the slot and the image CRC
+        uint32_t user = 0x12345678;
+
+        CHECK(configuration.beginWrite());
+        CHECK(configuration.writeUserData32(0, user));
+        CHECK(configuration.endWrite());
+        CHECK(slots.active() == ProgramSlots::B);
+        CHECK(slots.isActiveValid());
+
+        CHECK(configuration.beginTransaction());
+        CHECK(configuration.setUserData(sizeof(user), &user, sizeof(user)));
+        CHECK(configuration.commitTransaction());
+        CHECK(configuration.writeCanID(9));
+        CHECK(slots.active() == ProgramSlots::B);
+        CHECK(slots.isActiveValid());
+    }
+
+    {
+        // After reboot
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+        ProgramSlots         slots(a, b, configuration);
+
+        CHECK(slots.active() == ProgramSlots::B);
+        CHECK(slots.isActiveValid());
+        CHECK(configuration.getModuleConfiguration()->imageCRC == crcB);
+        CHECK(configuration.getModuleConfiguration()->imageLength == sizeof(imageB));
+
+        // Rollback: slot A still holds the previous image
+        CHECK(slots.activate(crcA, sizeof(imageA)));
+        CHECK(slots.active() == ProgramSlots::A);
+        CHECK(slots.isActiveValid());
+
+        // An update that did not complete is not activated
+        CHECK(b.beginWrite());
+        CHECK(b.write(PROGRAM_B_FLASH_FROM, imageB, sizeof(imageB) / 2));
+        CHECK(b.endWrite());
+        CHECK(!slots.activate(crcB, sizeof(imageB)));
+        CHECK(slots.active() == ProgramSlots::A);
+
+        // Completed
+        CHECK(install(b, imageB, sizeof(imageB)));
+        CHECK(slots.activate(crcB, sizeof(imageB)));
+        CHECK(slots.active() == ProgramSlots::B);
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+        ProgramSlots         slots(a, b, configuration);
+
+        CHECK(slots.active() == ProgramSlots::B);
+        CHECK(slots.isActiveValid());
+        CHECK(configuration.getModuleConfiguration()->canID == 9);
+        CHECK(reinterpret_cast<const uint32_t*>(configuration.getUserConfiguration())[0] == 0x12345678);
+        CHECK(reinterpret_cast<const uint32_t*>(configuration.getUserConfiguration())[1] == 0x12345678);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,63 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The simulated flash follows the NOR rules and accounts for the flash time
+
+#include "test.hpp"
+
+#include <core/stm32_flash/FlashSegment.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment segment(PROGRAM_FLASH_FROM, PROGRAM_FLASH_TO);
+    Sector       sector = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    uint8_t      data[64];
+
+    for (std::size_t i = 0; i < sizeof(data); i++) {
+        data[i] = static_cast<uint8_t>(i);
+    }
+
+    CHECK(segment.isSectorBlank(sector));
+
+    // Locked
+    CHECK(!segment.write(PROGRAM_FLASH_FROM, data, sizeof(data)));
+
+    CHECK(segment.unlock());
+    CHECK(segment.write(PROGRAM_FLASH_FROM, data, sizeof(data)));
+    CHECK(std::memcmp(reinterpret_cast<const void*>(PROGRAM_FLASH_FROM), data, sizeof(data)) == 0);
+    CHECK(simulated::statistics().programs == (sizeof(data) / FLASH_PROGRAM_UNIT));
+    CHECK(simulated::statistics().time == ((sizeof(data) / FLASH_PROGRAM_UNIT) * simulated::FLASH_PROGRAM_TIME()));
+
+    // Programming can only clear bits
+    uint32_t zero = 0;
+
+    CHECK(segment.write(PROGRAM_FLASH_FROM + sizeof(data), &zero, sizeof(zero)));
+#if defined(STM32F303xx) || defined(STM32F091xC)
+    // ...and the controller refuses to program a half-word that is not blank
+    CHECK(!segment.write(PROGRAM_FLASH_FROM, data, sizeof(data)));
+    CHECK(simulated::statistics().errors != 0);
+#endif
+
+    CHECK(segment.eraseSector(sector));
+    CHECK(segment.isSectorBlank(sector));
+    CHECK(simulated::statistics().erases == 1);
+    CHECK(simulated::sectorErases(sector) == 1);
+    CHECK(segment.lock());
+
+    // Outside the segment
+    CHECK(!segment.isRangeValid(PROGRAM_FLASH_TO - 2, 4));
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
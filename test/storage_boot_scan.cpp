@@ -0,0 +1,117 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The boot scan ends on corrupt counters that are not ordered (0 < 0x5555 < 0xAAAA < 0)
+
+#include "test.hpp"
+
+#include <core/stm32_flash/Storage.hpp>
+
+using namespace core::stm32_flash;
+
+static const std::size_t BANKS = 4;
+
+//! A slot header with the given counter and a bad CRC
+static void
+corrupt(
+    FlashSegment& bank,
+    Address       slot,
+    uint16_t      cnt
+)
+{
+    CHECK(bank.unlock());
+    CHECK(bank.write16_offset(slot, cnt));
+    CHECK(bank.write32_offset(slot + 4, 0));
+    CHECK(bank.lock());
+}
+
+int
+main()
+{
+    test::reset();
+
+    Sector       first = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    FlashSegment banks[BANKS] = {
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 0), FLASH_SECTOR_ADDRESS(first + 1)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 1), FLASH_SECTOR_ADDRESS(first + 2)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 2), FLASH_SECTOR_ADDRESS(first + 3)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 3), FLASH_SECTOR_ADDRESS(first + 4))
+    };
+
+    // Only corrupt slots: no valid data
+    corrupt(banks[0], 0, 0x0000);
+    corrupt(banks[1], 0, 0x5555);
+    corrupt(banks[2], 0, 0xAAAA);
+
+    {
+        Storage storage(banks, 3);
+
+        CHECK(!storage.isValid());
+
+        // Still usable
+        CHECK(storage.format());
+        CHECK(storage.write32(0, 0xCAFE));
+        CHECK(storage.commit());
+    }
+
+    {
+        Storage storage(banks, 3);
+
+        CHECK(storage.isValid());
+        CHECK(*reinterpret_cast<const uint32_t*>(storage.getAddress()) == 0xCAFE);
+    }
+
+    // A valid generation behind the corrupt ones is found
+    test::reset();
+
+    {
+        Storage storage(banks, BANKS);
+
+        CHECK(storage.format());
+        CHECK(storage.write32(0, 0xBEEF));
+        CHECK(storage.commit());
+    }
+
+    corrupt(banks[1], 0, 0x5555);
+    corrupt(banks[2], 0, 0xAAAA);
+    corrupt(banks[3], 0, 0x0000);
+
+    {
+        Storage storage(banks, BANKS);
+
+        CHECK(storage.isValid());
+        CHECK(*reinterpret_cast<const uint32_t*>(storage.getAddress()) == 0xBEEF);
+    }
+
+    // The same with slots, corrupt ones in both banks
+    test::reset();
+
+    std::size_t slot = banks[0].size() / 4;
+
+    {
+        Storage storage(banks[0], banks[1], slot);
+
+        CHECK(storage.format());
+        CHECK(storage.write32(0, 0xF00D));
+        CHECK(storage.commit());
+    }
+
+    corrupt(banks[0], 1 * slot, 0x5555);
+    corrupt(banks[0], 2 * slot, 0xAAAA);
+    corrupt(banks[1], 0 * slot, 0x0000);
+    corrupt(banks[1], 3 * slot, 0x5555);
+
+    {
+        Storage storage(banks[0], banks[1], slot);
+
+        CHECK(storage.isValid());
+        CHECK(*reinterpret_cast<const uint32_t*>(storage.getAddress()) == 0xF00D);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
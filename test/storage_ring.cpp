@@ -0,0 +1,65 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// A ring of banks wears its sectors evenly
+
+#include "test.hpp"
+
+#include <core/stm32_flash/Storage.hpp>
+
+using namespace core::stm32_flash;
+
+static const std::size_t BANKS       = 6;
+static const uint32_t    GENERATIONS = 100 * BANKS;
+
+int
+main()
+{
+    test::reset();
+
+    // One sector per bank, from the start of the program segment
+    Sector       first = FLASH_ADDRESS_SECTOR(PROGRAM_FLASH_FROM);
+    FlashSegment banks[BANKS] = {
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 0), FLASH_SECTOR_ADDRESS(first + 1)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 1), FLASH_SECTOR_ADDRESS(first + 2)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 2), FLASH_SECTOR_ADDRESS(first + 3)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 3), FLASH_SECTOR_ADDRESS(first + 4)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 4), FLASH_SECTOR_ADDRESS(first + 5)),
+        FlashSegment(FLASH_SECTOR_ADDRESS(first + 5), FLASH_SECTOR_ADDRESS(first + 6))
+    };
+
+    CHECK(banks[BANKS - 1].to() <= PROGRAM_FLASH_TO);
+
+    for (uint32_t i = 0; i < GENERATIONS; i++) {
+        // Reopened each time: the newest generation is found at boot
+        Storage storage(banks);
+
+        if (i != 0) {
+            CHECK(storage.isValid());
+            CHECK(*reinterpret_cast<const uint32_t*>(storage.getAddress()) == (i - 1));
+        }
+
+        CHECK(storage.format());
+        CHECK(storage.write32(0, i));
+        CHECK(storage.commit());
+    }
+
+    std::printf("%u generations, erases per sector:", GENERATIONS);
+
+    for (std::size_t i = 0; i < BANKS; i++) {
+        std::printf(" %u", simulated::sectorErases(first + i));
+    }
+
+    std::printf("\n");
+
+    for (std::size_t i = 0; i < BANKS; i++) {
+        CHECK(simulated::sectorErases(first + i) == (GENERATIONS / BANKS));
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
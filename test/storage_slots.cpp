@@ -0,0 +1,126 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Several generations per bank: erases per commit, bounds, banks written without slots
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+#include <cstring>
+
+using namespace core::stm32_flash;
+
+static bool
+commit(
+    Storage&    storage,
+    Address     offset,
+    const void* data,
+    std::size_t size
+)
+{
+    bool success = true;
+
+    success &= storage.format();
+    success &= storage.write(offset, data, size);
+    success &= storage.commit();
+
+    return success;
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    std::size_t  slotSize = bank1.size() / 16;
+
+    {
+        Storage              storage(bank1, bank2, slotSize);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.writeModuleName("slots"));
+
+        simulated::resetStatistics();
+
+        for (uint32_t i = 0; i < 100; i++) {
+            CHECK(configuration.writeCanID(i));
+            CHECK(configuration.getModuleConfiguration()->canID == i);
+        }
+
+        std::printf("100 commits, 16 slots per bank: %u erases\n", simulated::statistics().erases);
+
+        CHECK(simulated::statistics().erases == ((100 + 1) / 16));
+    }
+
+    {
+        Storage              storage(bank1, bank2, slotSize);
+        ConfigurationStorage configuration(storage);
+
+        CHECK(configuration.isValid());
+        CHECK(configuration.getModuleConfiguration()->canID == 99);
+        CHECK(std::strcmp(configuration.getModuleConfiguration()->name, "slots") == 0);
+    }
+
+    // Nothing is written past the slot
+    {
+        Storage  storage(bank1, bank2, slotSize);
+        uint32_t value = 0;
+
+        CHECK(storage.size() == (slotSize - 8));
+        CHECK(storage.format());
+        CHECK(!storage.write(storage.size() - 2, &value, sizeof(value)));
+        CHECK(!storage.write32(storage.size(), value));
+        CHECK(!storage.write16(0xFFFFFFFF, 0));
+        CHECK(storage.write(storage.size() - 4, &value, sizeof(value)));
+        CHECK(storage.commit());
+    }
+
+    // A generation written with one per bank stays readable once the slots are enabled
+    {
+        Storage  storage(bank1, bank2);
+        uint32_t value = 0x12345678;
+
+        CHECK(storage.unlock());
+        CHECK(storage.erase());
+
+        // The payload is larger than a slot
+        CHECK(storage.format());
+        CHECK(storage.write(16, &value, sizeof(value)));
+        CHECK(storage.write(storage.size() - sizeof(value), &value, sizeof(value)));
+        CHECK(storage.commit());
+    }
+
+    {
+        Storage  storage(bank1, bank2, slotSize);
+        uint32_t value;
+
+        CHECK(storage.isValid());
+        std::memcpy(&value, reinterpret_cast<const uint8_t*>(storage.getAddress()) + 16, sizeof(value));
+        CHECK(value == 0x12345678);
+
+        value = 0xCAFEBABE;
+
+        CHECK(commit(storage, 0, &value, sizeof(value)));
+        CHECK(commit(storage, 4, &value, sizeof(value)));
+    }
+
+    {
+        Storage  storage(bank1, bank2, slotSize);
+        uint32_t value;
+
+        CHECK(storage.isValid());
+        std::memcpy(&value, reinterpret_cast<const uint8_t*>(storage.getAddress()) + 4, sizeof(value));
+        CHECK(value == 0xCAFEBABE);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,89 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// The critical sections of each operation are measured, the statistics reset
+//
+// The host realtime counter advances by one tick at each read (see test/host/osal.h):
+// each measured critical section lasts exactly one tick.
+
+#include "test.hpp"
+
+#include <core/stm32_flash/ConfigurationStorage.hpp>
+#include <core/stm32_flash/Storage.hpp>
+
+using namespace core::stm32_flash;
+
+static void
+check(
+    const Storage& storage,
+    uint32_t       erase,
+    uint32_t       format,
+    uint32_t       commit,
+    uint32_t       skipped
+)
+{
+    CHECK(storage.statistics().erase == erase);
+    CHECK(storage.statistics().format == format);
+    CHECK(storage.statistics().commit == commit);
+    CHECK(storage.statistics().skipped == skipped);
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+    Storage      storage(bank1, bank2);
+
+    check(storage, 0, 0, 0, 0);
+
+    // Each operation records its own critical section
+    CHECK(storage.format());
+    check(storage, 0, 1, 0, 0);
+
+    CHECK(storage.write32(0, 0x12345678));
+    CHECK(storage.commit());
+    check(storage, 0, 1, 1, 0);
+
+    CHECK(storage.unlock());
+    CHECK(storage.erase());
+    check(storage, 1, 1, 1, 0);
+
+    // The longest one is kept
+    for (uint32_t i = 0; i < 3; i++) {
+        CHECK(storage.format());
+        CHECK(storage.write32(0, i));
+        CHECK(storage.commit());
+    }
+
+    check(storage, 1, 1, 1, 0);
+
+    // A rewrite with no change is counted, not written
+    ConfigurationStorage configuration(storage);
+
+    CHECK(configuration.writeCanID(42));
+    CHECK(configuration.writeCanID(42));
+    check(storage, 1, 1, 1, 1);
+
+    CHECK(configuration.writeCanID(42));
+    check(storage, 1, 1, 1, 2);
+
+    storage.resetStatistics();
+    check(storage, 0, 0, 0, 0);
+
+    // Counting again after the reset
+    CHECK(configuration.writeCanID(43));
+    check(storage, 0, 1, 1, 0);
+
+    CHECK(configuration.writeCanID(43));
+    check(storage, 0, 1, 1, 1);
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
@@ -0,0 +1,48 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * Host tests: each one is an executable, a failed CHECK ends it with a non zero status.
+ */
+
+#pragma once
+
+#include <core/stm32_flash/simulated_flash.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            std::exit(1); \
+        } \
+    } while (0)
+
+namespace test {
+//! Same sequence on every run
+inline uint32_t
+random()
+{
+    static uint32_t state = 0x12345678;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    return state;
+}
+
+//! The flash factory state, statistics cleared
+inline void
+reset()
+{
+    CHECK(core::stm32_flash::simulated::init());
+
+    core::stm32_flash::simulated::reset();
+}
+}
@@ -0,0 +1,90 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// User configuration as a struct, written whole or member by member
+
+#include "test.hpp"
+
+#include <core/stm32_flash/Storage.hpp>
+#include <core/stm32_flash/TypedConfigurationStorage.hpp>
+
+using namespace core::stm32_flash;
+
+struct UserConfiguration {
+    float    gain;
+    uint32_t id;
+    uint8_t  mode;
+    float    table[40];
+};
+
+static UserConfiguration
+defaults()
+{
+    UserConfiguration configuration = {
+        1.5f, 7, 2, {}
+    };
+
+    return configuration;
+}
+
+int
+main()
+{
+    test::reset();
+
+    FlashSegment bank1(CONFIGURATION1_FLASH_FROM, CONFIGURATION1_FLASH_TO);
+    FlashSegment bank2(CONFIGURATION2_FLASH_FROM, CONFIGURATION2_FLASH_TO);
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        // The defaults are copied, the temporary can go
+        TypedConfigurationStorage<UserConfiguration> typed(configuration, defaults());
+
+        CHECK(typed.fits());
+        CHECK(typed.get().gain == 1.5f);
+
+        // Nothing stored: the other members come from the defaults
+        CHECK(typed.write<CORE_STM32_FLASH_MEMBER(UserConfiguration, gain)>(3.0f));
+        CHECK(typed.get().gain == 3.0f);
+        CHECK(typed.get().id == 7);
+        CHECK(typed.get().mode == 2);
+        CHECK(&typed.get() == configuration.getUserConfiguration());
+
+        // The member type is not deduced from the value
+        CHECK(typed.write<CORE_STM32_FLASH_MEMBER(UserConfiguration, mode)>(9));
+        CHECK(typed.get().gain == 3.0f);
+        CHECK(typed.get().mode == 9);
+
+        // The whole struct, the module configuration is kept
+        CHECK(configuration.writeProgramSlot(ModuleConfiguration::PROGRAM_SLOT_B, 0x1234, 1000));
+
+        UserConfiguration value = typed.get();
+
+        value.table[39] = 4;
+
+        CHECK(typed.write(value));
+        CHECK(configuration.getModuleConfiguration()->programSlot == ModuleConfiguration::PROGRAM_SLOT_B);
+        CHECK(configuration.getModuleConfiguration()->imageCRC == 0x1234);
+        CHECK(configuration.getModuleConfiguration()->imageLength == 1000);
+    }
+
+    {
+        Storage              storage(bank1, bank2);
+        ConfigurationStorage configuration(storage);
+
+        TypedConfigurationStorage<UserConfiguration> typed(configuration, defaults());
+
+        CHECK(typed.get().table[39] == 4);
+        CHECK(typed.get().mode == 9);
+        CHECK(typed.get().id == 7);
+    }
+
+    std::printf("OK\n");
+
+    return 0;
+} // main
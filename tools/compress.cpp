@@ -0,0 +1,54 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Build a ProgramDecompressor stream: compress <image> <stream> [window]
+//
+// The window must not be larger than the CORE_STM32_FLASH_LZ_WINDOW of the
+// bootloader (1024 by default).
+
+#include "lz.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+
+using namespace core::stm32_flash;
+
+int
+main(
+    int   argc,
+    char* argv[]
+)
+{
+    if ((argc != 3) && (argc != 4)) {
+        std::fprintf(stderr, "usage: %s <image> <stream> [window]\n", argv[0]);
+        return 1;
+    }
+
+    std::ifstream        input(argv[1], std::ios::binary);
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    std::size_t          window = (argc == 4) ? std::strtoul(argv[3], nullptr, 0) : 1024;
+
+    if (!input.is_open() || input.bad()) {
+        std::fprintf(stderr, "cannot read the image\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> stream = tools::LZCompressor(window).compress(image);
+    std::ofstream        output(argv[2], std::ios::binary);
+
+    output.write(reinterpret_cast<const char*>(stream.data()), stream.size());
+
+    if (!output) {
+        std::fprintf(stderr, "cannot write the stream\n");
+        return 1;
+    }
+
+    std::printf("%zu -> %zu bytes (ratio %.2f)\n", image.size(), stream.size(), static_cast<double>(image.size()) / std::max<std::size_t>(stream.size(), 1));
+
+    return 0;
+} // main
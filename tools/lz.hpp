@@ -0,0 +1,186 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * Host side: build the compressed streams programmed by ProgramDecompressor.
+ *
+ * Greedy LZ4 style parsing: at each position the longest match within the
+ * window is searched along a hash chain of the 4 byte strings. The window must
+ * be the CORE_STM32_FLASH_LZ_WINDOW of the decoder (or smaller).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace core {
+namespace stm32_flash {
+namespace tools {
+class LZCompressor
+{
+public:
+    static const uint32_t    MAGIC     = 0x315A4C4E; //!< "NLZ1"
+    static const std::size_t MIN_MATCH = 4;
+    static const std::size_t HASH_BITS = 12;
+    static const std::size_t DEPTH     = 64; //!< Chain positions tried for each match
+
+public:
+    LZCompressor(
+        std::size_t window = 1024
+    ) : _window(window) {}
+
+    std::vector<uint8_t>
+    compress(
+        const std::vector<uint8_t>& data
+    )
+    {
+        std::vector<uint8_t> out;
+        std::vector<int64_t> head(std::size_t(1) << HASH_BITS, -1);
+        std::vector<int64_t> chain(data.size(), -1);
+        std::size_t          literals = 0; //!< Start of the literals of the next sequence
+        std::size_t          i        = 0;
+
+        word(out, MAGIC);
+        word(out, static_cast<uint32_t>(data.size()));
+
+        while (i < data.size()) {
+            std::size_t length = 0;
+            std::size_t offset = 0;
+
+            if ((i + MIN_MATCH) <= data.size()) {
+                std::size_t tried = 0;
+
+                for (int64_t candidate = head[hash(data, i)]; (candidate >= 0) && ((i - static_cast<std::size_t>(candidate)) <= _window) && (tried < DEPTH); candidate = chain[candidate], tried++) {
+                    std::size_t n = 0;
+
+                    while (((i + n) < data.size()) && (data[candidate + n] == data[i + n])) {
+                        n++;
+                    }
+
+                    if (n > length) {
+                        length = n;
+                        offset = i - candidate;
+                    }
+                }
+            }
+
+            if (length < MIN_MATCH) {
+                insert(data, i, head, chain);
+                i++;
+                continue;
+            }
+
+            sequence(out, data, literals, i - literals, offset, length);
+
+            for (std::size_t end = i + length; i < end; i++) {
+                insert(data, i, head, chain);
+            }
+
+            literals = i;
+        }
+
+        // The last sequence has literals only, it is empty after a match
+        if (data.size() > 0) {
+            sequence(out, data, literals, data.size() - literals, 0, 0);
+        }
+
+        return out;
+    } // compress
+
+
+private:
+    std::size_t _window;
+
+private:
+    std::size_t
+    hash(
+        const std::vector<uint8_t>& data,
+        std::size_t                 i
+    ) const
+    {
+        uint32_t key = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (static_cast<uint32_t>(data[i + 3]) << 24);
+
+        return (key * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    void
+    insert(
+        const std::vector<uint8_t>& data,
+        std::size_t                 i,
+        std::vector<int64_t>&       head,
+        std::vector<int64_t>&       chain
+    ) const
+    {
+        if ((i + MIN_MATCH) <= data.size()) {
+            std::size_t key = hash(data, i);
+
+            chain[i]  = head[key];
+            head[key] = static_cast<int64_t>(i);
+        }
+    }
+
+    //! length 0: literals only
+    void
+    sequence(
+        std::vector<uint8_t>&       out,
+        const std::vector<uint8_t>& data,
+        std::size_t                 from,
+        std::size_t                 literals,
+        std::size_t                 offset,
+        std::size_t                 length
+    ) const
+    {
+        std::size_t match = (length > 0) ? (length - MIN_MATCH) : 0;
+
+        out.push_back(static_cast<uint8_t>((std::min<std::size_t>(literals, 15) << 4) | std::min<std::size_t>(match, 15)));
+
+        if (literals >= 15) {
+            extra(out, literals - 15);
+        }
+
+        out.insert(out.end(), data.begin() + from, data.begin() + from + literals);
+
+        if (length > 0) {
+            out.push_back(static_cast<uint8_t>(offset));
+            out.push_back(static_cast<uint8_t>(offset >> 8));
+
+            if (match >= 15) {
+                extra(out, match - 15);
+            }
+        }
+    }
+
+    //! Length bytes: 255 while more follow
+    void
+    extra(
+        std::vector<uint8_t>& out,
+        std::size_t           value
+    ) const
+    {
+        for ( ; value >= 255; value -= 255) {
+            out.push_back(255);
+        }
+
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    void
+    word(
+        std::vector<uint8_t>& out,
+        uint32_t              value
+    ) const
+    {
+        for (std::size_t i = 0; i < 4; i++) {
+            out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+};
+}
+}
+}
@@ -0,0 +1,77 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+// Build a ProgramPatcher patch: patch <old image> <new image> <patch> <sector size>...
+//
+// The sector sizes are the ones of the program segment from its start, the last
+// one is repeated (2048 for STM32F091xC, 131072 for a STM32F407xx program
+// segment starting at sector 5).
+
+#include "patch.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+
+using namespace core::stm32_flash;
+
+static bool
+load(
+    const char*           path,
+    std::vector<uint8_t>& data
+)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    return !file.bad() && file.is_open();
+}
+
+int
+main(
+    int   argc,
+    char* argv[]
+)
+{
+    if (argc < 5) {
+        std::fprintf(stderr, "usage: %s <old image> <new image> <patch> <sector size>...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t>     oldImage;
+    std::vector<uint8_t>     newImage;
+    std::vector<std::size_t> sectors;
+
+    if (!load(argv[1], oldImage) || !load(argv[2], newImage)) {
+        std::fprintf(stderr, "cannot read the images\n");
+        return 1;
+    }
+
+    for (int i = 4; i < argc; i++) {
+        sectors.push_back(std::strtoul(argv[i], nullptr, 0));
+
+        if (sectors.back() == 0) {
+            std::fprintf(stderr, "invalid sector size: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> patch = tools::PatchEncoder(oldImage, newImage, sectors).encode();
+    std::ofstream        file(argv[3], std::ios::binary);
+
+    file.write(reinterpret_cast<const char*>(patch.data()), patch.size());
+
+    if (!file) {
+        std::fprintf(stderr, "cannot write the patch\n");
+        return 1;
+    }
+
+    std::printf("%zu -> %zu bytes (%.1f%%)\n", newImage.size(), patch.size(), (100.0 * patch.size()) / std::max<std::size_t>(newImage.size(), 1));
+
+    return 0;
+} // main
@@ -0,0 +1,304 @@
+/* COPYRIGHT (c) 2016-2018 Nova Labs SRL
+ *
+ * All rights reserved. All use of this software and documentation is
+ * subject to the License Agreement located in the file LICENSE.
+ */
+
+/*! \file
+ * Host side: build the patches applied by ProgramPatcher.
+ *
+ * The new image is matched against the old one with a hash of 8 byte strings.
+ * The runs found in the old image are COPY operations; the bytes in between are
+ * DIFF operations when the old image continues on the same alignment (a
+ * changed constant or address), INSERT operations otherwise. The operations
+ * never cross a sector boundary of the new image and never refer to the old
+ * image before the sector they build: the patch is applied in place.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+namespace core {
+namespace stm32_flash {
+namespace tools {
+//! Same as ProgramStorage::updateCRC(length): CRC-32 of the words, the last one padded with 0xFF
+inline uint32_t
+imageCRC(
+    const std::vector<uint8_t>& image
+)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (std::size_t i = 0; i < image.size(); i += 4) {
+        uint32_t word = 0;
+
+        for (std::size_t j = 0; j < 4; j++) {
+            word |= static_cast<uint32_t>(((i + j) < image.size()) ? image[i + j] : 0xFF) << (8 * j);
+        }
+
+        crc ^= word;
+
+        for (unsigned bit = 0; bit < 32; bit++) {
+            crc = ((crc & 0x80000000) != 0) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+class PatchEncoder
+{
+public:
+    static const uint32_t    MAGIC     = 0x50444C4E; //!< "NLDP"
+    static const std::size_t KEY       = 8;  //!< Bytes hashed
+    static const std::size_t MIN_COPY  = 8;  //!< Shorter runs are not worth an operation
+    static const std::size_t CANDIDATE = 32; //!< Old positions tried for each key
+
+    enum Operation : uint8_t {
+        COPY   = 0x00,
+        DIFF   = 0x01,
+        INSERT = 0x02
+    };
+
+public:
+    /*! sectors: sizes of the sectors of the program segment, from its start; the
+     * last one is repeated as needed
+     */
+    PatchEncoder(
+        const std::vector<uint8_t>&     oldImage,
+        const std::vector<uint8_t>&     newImage,
+        const std::vector<std::size_t>& sectors
+    ) : _old(oldImage), _new(newImage), _sectors(sectors), _position(0), _literals(0) {}
+
+    std::vector<uint8_t>
+    encode()
+    {
+        _patch.clear();
+        _position = 0;
+
+        word(MAGIC);
+        word(static_cast<uint32_t>(_old.size()));
+        word(imageCRC(_old));
+        word(static_cast<uint32_t>(_new.size()));
+        word(imageCRC(_new));
+
+        index();
+
+        std::size_t from = 0;
+
+        while (from < _new.size()) {
+            std::size_t to = std::min(from + sectorSize(from), _new.size());
+
+            sector(from, to);
+            from = to;
+        }
+
+        return _patch;
+    }
+
+
+private:
+    const std::vector<uint8_t>&                          _old;
+    const std::vector<uint8_t>&                          _new;
+    const std::vector<std::size_t>&                      _sectors;
+    std::unordered_map<uint64_t, std::vector<uint32_t> > _index; //!< Old positions of each key, ascending
+    std::vector<uint8_t>                                 _patch;
+    std::size_t                                          _position; //!< Old image position of the decoder
+    std::size_t                                          _literals; //!< Start of the bytes not matched yet
+
+private:
+    std::size_t
+    sectorSize(
+        std::size_t offset
+    ) const
+    {
+        std::size_t from = 0;
+
+        for (std::size_t i = 0; ; i++) {
+            std::size_t size = _sectors[std::min(i, _sectors.size() - 1)];
+
+            if (offset < (from + size)) {
+                return size;
+            }
+
+            from += size;
+        }
+    }
+
+    uint64_t
+    key(
+        const std::vector<uint8_t>& image,
+        std::size_t                 offset
+    ) const
+    {
+        uint64_t key = 0;
+
+        for (std::size_t i = 0; i < KEY; i++) {
+            key |= static_cast<uint64_t>(image[offset + i]) << (8 * i);
+        }
+
+        return key;
+    }
+
+    void
+    index()
+    {
+        _index.clear();
+
+        for (std::size_t i = 0; (i + KEY) <= _old.size(); i++) {
+            _index[key(_old, i)].push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    //! Bytes equal from old position o and new position n, up to limit
+    std::size_t
+    common(
+        std::size_t o,
+        std::size_t n,
+        std::size_t limit
+    ) const
+    {
+        std::size_t length = 0;
+
+        while ((length < limit) && ((o + length) < _old.size()) && (_old[o + length] == _new[n + length])) {
+            length++;
+        }
+
+        return length;
+    }
+
+    //! Sector [from, to) of the new image, the old image is valid from from
+    void
+    sector(
+        std::size_t from,
+        std::size_t to
+    )
+    {
+        std::size_t n = from;
+
+        _literals = from;
+
+        while (n < to) {
+            std::size_t limit = to - n;
+
+            // Same alignment as the previous operation: no delta to send
+            std::size_t length = (_position >= from) ? common(_position + (n - _literals), n, limit) : 0;
+            std::size_t best   = _position + (n - _literals);
+
+            if ((length < MIN_COPY) && ((n + KEY) <= _new.size())) {
+                auto found = _index.find(key(_new, n));
+
+                if (found != _index.end()) {
+                    // The old positions closest to n, on both sides
+                    const std::vector<uint32_t>& positions = found->second;
+                    std::size_t                  first     = std::lower_bound(positions.begin(), positions.end(), static_cast<uint32_t>(from)) - positions.begin();
+                    std::size_t                  middle    = std::lower_bound(positions.begin(), positions.end(), static_cast<uint32_t>(n)) - positions.begin();
+                    std::size_t                  begin     = std::max(first, (middle > (CANDIDATE / 2)) ? (middle - (CANDIDATE / 2)) : 0);
+                    std::size_t                  end       = std::min(positions.size(), begin + CANDIDATE);
+
+                    for (std::size_t i = begin; i < end; i++) {
+                        std::size_t candidate = common(positions[i], n, limit);
+
+                        if (candidate > length) {
+                            length = candidate;
+                            best   = positions[i];
+                        }
+                    }
+                }
+            }
+
+            if (length < MIN_COPY) {
+                n++;
+                continue;
+            }
+
+            literals(from, n);
+            operation(COPY, best, length);
+
+            _position = best + length;
+            n        += length;
+            _literals = n;
+        }
+
+        literals(from, to);
+    } // sector
+
+    //! The bytes from _literals to n
+    void
+    literals(
+        std::size_t from,
+        std::size_t n
+    )
+    {
+        std::size_t length = n - _literals;
+
+        if (length == 0) {
+            return;
+        }
+
+        if ((_position >= from) && ((_position + length) <= _old.size())) {
+            // Differences from the old image on the same alignment
+            operation(DIFF, _position, length);
+
+            for (std::size_t i = 0; i < length; i++) {
+                _patch.push_back(static_cast<uint8_t>(_new[_literals + i] - _old[_position + i]));
+            }
+
+            _position += length;
+        } else {
+            operation(INSERT, _position, length);
+            _patch.insert(_patch.end(), _new.begin() + _literals, _new.begin() + n);
+        }
+
+        _literals = n;
+    } // literals
+
+    void
+    operation(
+        Operation   op,
+        std::size_t position,
+        std::size_t length
+    )
+    {
+        _patch.push_back(op);
+        varint(static_cast<uint32_t>(length));
+
+        if (op != INSERT) {
+            int32_t delta = static_cast<int32_t>(position - _position);
+
+            // Zigzag: 0, -1, 1, -2, ...
+            varint((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+        }
+    }
+
+    void
+    varint(
+        uint32_t value
+    )
+    {
+        while (value >= 0x80) {
+            _patch.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+
+        _patch.push_back(static_cast<uint8_t>(value));
+    }
+
+    void
+    word(
+        uint32_t value
+    )
+    {
+        for (std::size_t i = 0; i < 4; i++) {
+            _patch.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+};
+}
+}
+}